@@ -17,13 +17,146 @@
  */
 
 #include <event2/event.h>
+#include <event2/thread.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <unistd.h>
 
 #include "appstate.h"
 #include "config.h"
+#include "dirindex.h"
+#include "journal.h"
+#include "metrics.h"
 #include "quarantine.h"
 #include "log.h"
 #include "util.h"
+#include "writer.h"
+
+#ifdef O_PATH
+#define COMMENTS_DIR_FLAGS	(O_PATH | O_DIRECTORY | O_CLOEXEC)
+#else
+#define COMMENTS_DIR_FLAGS	(O_RDONLY | O_DIRECTORY | O_CLOEXEC)
+#endif
+
+#define QUARANTINE_SWEEP_INTERVAL	10	// seconds
+#define QUARANTINE_SWEEP_MAX		256	// evictions per run
+
+static void
+worker_sweep_cb(evutil_socket_t fd, short event, void *arg)
+{
+	(void)fd;
+	(void)event;
+
+	struct worker *w = arg;
+	size_t n;
+
+	timecache_update(&w->clock);
+
+	pthread_mutex_lock(&w->quarantine->lock);
+
+	n = quarantine_expire(w->quarantine->list,
+	    w->clock.now - w->state->cfg.quarantine_ttl, QUARANTINE_SWEEP_MAX);
+	quarantine_expire_prefixes(w->quarantine->list, w->clock.tick);
+
+	pthread_mutex_unlock(&w->quarantine->lock);
+
+	if (n > 0)
+		dbgxl("worker %lu: %lu quarantine entries expired", w->id, n);
+
+	// more to do, but let pending connections go first
+	if (n == QUARANTINE_SWEEP_MAX)
+		event_active(w->sweep_event, EV_TIMEOUT, 0);
+}
+
+static void
+worker_index_cb(evutil_socket_t fd, short event, void *arg)
+{
+	(void)fd;
+	(void)event;
+
+	struct worker *w = arg;
+
+	dirindex_update(w->state->index);
+}
+
+static void
+worker_stop_cb(evutil_socket_t fd, short event, void *arg)
+{
+	(void)fd;
+	(void)event;
+
+	struct worker *w = arg;
+
+	dbgxl("stopping worker %lu", w->id);
+
+	if (w->sock_event) {
+		event_free(w->sock_event);
+		w->sock_event = NULL;
+	}
+
+	event_del(w->sweep_event);
+	if (w->index_event)
+		event_del(w->index_event);
+}
+
+static void
+worker_init(struct worker *w, struct appstate *s, size_t id)
+{
+	struct timeval interval = { QUARANTINE_SWEEP_INTERVAL, 0 };
+	struct timeval rescan = { DIRINDEX_RESCAN, 0 };
+
+	w->state = s;
+	w->id = id;
+	w->listener = -1;
+	w->quarantine = &s->quarantine[id];
+
+	w->evbase = event_base_new();
+	if (!w->evbase)
+		errl(1, "event_base_new");
+
+	timecache_init(&w->clock, w->evbase);
+
+	w->metrics = &s->metrics[id];
+
+	if (!(w->writer = writer_client_new(s->writer, w->evbase,
+	    w->metrics)))
+		errl(1, "writer_client_new");
+
+	w->stop_event = event_new(w->evbase, -1, 0, worker_stop_cb, w);
+	if (!w->stop_event)
+		errxl(1, "stop_event");
+
+	w->sweep_event = event_new(w->evbase, -1, EV_PERSIST, worker_sweep_cb,
+	    w);
+	if (!w->sweep_event || event_add(w->sweep_event, &interval) != 0)
+		errxl(1, "sweep_event");
+
+	// the first worker keeps the index of all of them up to date
+	if (id != 0)
+		return;
+
+	// rescans without inotify, with it checks whether the root was replaced
+	w->index_event = event_new(w->evbase, s->index->fd, EV_PERSIST |
+	    (s->index->fd != -1 ? EV_READ : 0), worker_index_cb, w);
+	if (!w->index_event || event_add(w->index_event, &rescan) != 0)
+		errxl(1, "index_event");
+}
+
+static void
+worker_free(struct worker *w)
+{
+	if (w->sock_event)
+		event_free(w->sock_event);
+	if (w->stop_event)
+		event_free(w->stop_event);
+	if (w->sweep_event)
+		event_free(w->sweep_event);
+	if (w->index_event)
+		event_free(w->index_event);
+	writer_client_free(&w->writer);
+	event_base_free(w->evbase);
+}
 
 struct appstate *
 appstate_new(int argc, char *const *argv)
@@ -31,24 +164,73 @@ appstate_new(int argc, char *const *argv)
 	char pathbuf[PATH_MAX];
 	struct appstate *s;
 	FILE *f;
+	size_t i;
 
 	s = calloc(1, sizeof(struct appstate));
 
 	config_parse(&s->cfg, argc, argv);
 
-	s->quarantine = quarantine_new();
-	if (!s->quarantine)
-		errl(1, "quarantine_new");
+	if (evthread_use_pthreads() != 0)
+		errxl(1, "evthread_use_pthreads");
 
-	s->evbase = event_base_new();
-	if (!s->evbase)
-		errl(1, "event_base_new");
+	if ((s->comments_fd = open(s->cfg.comments_dir,
+	    COMMENTS_DIR_FLAGS)) == -1)
+		errl(1, "open %s", s->cfg.comments_dir);
+
+	if (s->cfg.journal) {
+		if (!path_combine(pathbuf, PATH_MAX, s->cfg.persistent_dir,
+		    JOURNAL_FILENAME))
+			errxl(1, "PATH_MAX exceeded! what??");
+
+		if (!(s->journal = journal_open(pathbuf)))
+			errl(1, "open %s", pathbuf);
+
+		// before anyone gets to comment again
+		if (!journal_replay(s->journal, s->comments_fd))
+			errl(1, "journal_replay");
+	}
+
+	if (!(s->writer = writer_new(s->comments_fd, s->cfg.fd_cache_size,
+	    s->cfg.write_window, s->cfg.durability, s->journal)))
+		errl(1, "writer_new");
+
+	s->workers = calloc(s->cfg.workers, sizeof(struct worker));
+	s->metrics = calloc(s->cfg.workers, sizeof(struct metrics));
+	s->quarantine = calloc(s->cfg.workers,
+	    sizeof(struct quarantine_shard));
+	if (!s->workers || !s->metrics || !s->quarantine)
+		errl(1, "calloc");
+	s->metrics_listener = -1;
+
+	// quarantine-max is for all shards together
+	for (i = 0; i < s->cfg.workers; ++i) {
+		if ((errno = pthread_mutex_init(&s->quarantine[i].lock,
+		    NULL)) != 0)
+			errl(1, "pthread_mutex_init");
+
+		if (!(s->quarantine[i].list = quarantine_new(
+		    (s->cfg.quarantine_max + s->cfg.workers - 1) /
+		    s->cfg.workers, s->cfg.comment.prefix_v4,
+		    s->cfg.comment.prefix_v6)))
+			errl(1, "quarantine_new");
+	}
+
+	if (!(s->index = dirindex_new(s->cfg.comments_dir)))
+		errl(1, "dirindex_new");
+
+	for (i = 0; i < s->cfg.workers; ++i)
+		worker_init(&s->workers[i], s, i);
 
 	if (path_combine(pathbuf, PATH_MAX, s->cfg.persistent_dir,
 	    QUARANTINE_FILENAME)) {
 		if ((f = fopen(pathbuf, "r"))) {
-			quarantine_deserialize(s->quarantine, f);
+			quarantine_deserialize(s->quarantine, s->cfg.workers,
+			    f);
 			fclose(f);
+
+			for (i = 0; i < s->cfg.workers; ++i)
+				quarantine_restore(s->quarantine[i].list,
+				    &s->cfg.comment.failure_limit);
 		} else {
 			warnl("opening quarantine_path failed");
 		}
@@ -60,8 +242,21 @@ appstate_new(int argc, char *const *argv)
 void
 appstate_free(struct appstate **s)
 {
-	event_base_free((*s)->evbase);
-	quarantine_free(&(*s)->quarantine);
+	size_t i;
+
+	for (i = 0; i < (*s)->cfg.workers; ++i) {
+		worker_free(&(*s)->workers[i]);
+		quarantine_free(&(*s)->quarantine[i].list);
+		pthread_mutex_destroy(&(*s)->quarantine[i].lock);
+	}
+	free((*s)->workers);
+	free((*s)->quarantine);
+	dirindex_free(&(*s)->index);
+	free((*s)->metrics);
+	writer_free(&(*s)->writer);
+	if ((*s)->journal)
+		journal_free(&(*s)->journal);
+	close((*s)->comments_fd);
 	config_free(&(*s)->cfg);
 	free(*s);
 	*s = NULL;
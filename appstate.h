@@ -18,12 +18,40 @@
 
 #pragma once
 
+#include <pthread.h>
+#include <stdatomic.h>
+#include <event2/util.h>
+
 #include "config.h"
+#include "timecache.h"
 
-struct appstate {
+struct worker {
+	struct appstate *state;
 	struct event_base *evbase;
-	struct quarantine_list *quarantine;
-	struct event *sock_event, *int_event, *term_event;
+	struct quarantine_shard *quarantine;	// the shard it sweeps
+	struct writer_client *writer;
+	struct timecache clock;
+	struct metrics *metrics;	// this worker's shard
+	struct event *sock_event, *stop_event, *sweep_event;
+	struct event *index_event;	// worker 0 only
+	evutil_socket_t listener;
+	pthread_t thread;
+	size_t id;
+};
+
+struct appstate {
+	struct worker *workers;
+	struct writer *writer;		// shared by all workers
+	struct journal *journal;	// NULL if disabled
+	struct quarantine_shard *quarantine;	// a shard per worker
+	struct dirindex *index;		// of comments_dir, kept by worker 0
+	struct event *int_event, *term_event;
+	struct metrics *metrics;	// a shard per worker
+	struct event *metrics_event;	// NULL without metrics
+	evutil_socket_t metrics_listener;
+	atomic_size_t connections;	// open, across all workers
+	atomic_size_t requests;		// in flight, across all workers
+	int comments_fd;		// comments_dir, to open files beneath
 	struct config cfg;
 };
 
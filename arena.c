@@ -0,0 +1,124 @@
+/**
+ * gmlgcd - the gemlog comment daemon
+ * Copyright (C) 2024 github.com/Sir-Photch
+ *
+ * This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "platform.h"
+
+#include <stdalign.h>
+#include <stdint.h>
+
+#include "arena.h"
+
+struct arena_block {
+	struct arena_block *next;
+	size_t size, used;
+	alignas(max_align_t) unsigned char data[];
+};
+
+static struct arena_block *
+arena_block_new(size_t size)
+{
+	struct arena_block *b;
+
+	if (size < ARENA_BLOCK_SIZE)
+		size = ARENA_BLOCK_SIZE;
+
+	if (!(b = malloc(sizeof(struct arena_block) + size)))
+		return NULL;
+
+	b->next = NULL;
+	b->size = size;
+	b->used = 0;
+
+	return b;
+}
+
+void
+arena_init(struct arena *a)
+{
+	a->head = a->current = NULL;
+}
+
+void *
+arena_alloc(struct arena *a, size_t n)
+{
+	struct arena_block *b, *prev;
+	void *p;
+
+	n = (n + alignof(max_align_t) - 1) & ~(alignof(max_align_t) - 1);
+
+	// blocks after current are empty leftovers of a previous reset
+	for (prev = NULL, b = a->current; b; prev = b, b = b->next) {
+		if (b->size - b->used >= n)
+			break;
+	}
+
+	if (!b) {
+		if (!(b = arena_block_new(n)))
+			return NULL;
+
+		if (prev)
+			prev->next = b;
+		else
+			a->head = b;
+	}
+
+	a->current = b;
+
+	p = b->data + b->used;
+	b->used += n;
+
+	return p;
+}
+
+char *
+arena_strndup(struct arena *a, const char *s, size_t n)
+{
+	char *p;
+
+	if (!(p = arena_alloc(a, n + 1)))
+		return NULL;
+
+	memcpy(p, s, n);
+	p[n] = '\0';
+
+	return p;
+}
+
+void
+arena_reset(struct arena *a)
+{
+	struct arena_block *b;
+
+	for (b = a->head; b; b = b->next)
+		b->used = 0;
+
+	a->current = a->head;
+}
+
+void
+arena_free(struct arena *a)
+{
+	struct arena_block *b, *next;
+
+	for (b = a->head; b; b = next) {
+		next = b->next;
+		free(b);
+	}
+
+	a->head = a->current = NULL;
+}
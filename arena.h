@@ -0,0 +1,40 @@
+/**
+ * gmlgcd - the gemlog comment daemon
+ * Copyright (C) 2024 github.com/Sir-Photch
+ *
+ * This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define ARENA_BLOCK_SIZE 4096
+
+struct arena_block;
+
+/*
+ * Bump allocator whose memory is released all at once by arena_reset().
+ * Blocks are kept across resets, so a warmed up arena does not allocate.
+ */
+struct arena {
+	struct arena_block *head, *current;
+};
+
+void  arena_init(struct arena *);
+void *arena_alloc(struct arena *, size_t);
+char *arena_strndup(struct arena *, const char *, size_t);
+void  arena_reset(struct arena *);
+void  arena_free(struct arena *);
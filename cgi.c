@@ -0,0 +1,73 @@
+/**
+ * gmlgcd - the gemlog comment daemon
+ * Copyright (C) 2024 github.com/Sir-Photch
+ *
+ * This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "cgi.h"
+
+#define CGI_NAME_MIN 11
+#define CGI_NAME_MAX 20
+
+/*
+ * Perfect hash over the names below, found by brute force:
+ *
+ *	h = (len + name[0] + name[len - 4]) % 16
+ *
+ * Update the table whenever a name is added, and look for a new formula
+ * if two names collide.
+ */
+#define CGI_HASH(name, len) \
+	(((len) + (unsigned char)(name)[0] + \
+	    (unsigned char)(name)[(len) - 4]) & 15)
+
+#define CGI_ENTRY(var) { #var, sizeof(#var) - 1, CGI_##var }
+
+static const struct {
+	const char *name;
+	size_t len;
+	enum cgi_var var;
+} cgi_table[16] = {
+	[1]  = CGI_ENTRY(SERVER_PROTOCOL),
+	[2]  = CGI_ENTRY(REMOTE_USER),
+	[4]  = CGI_ENTRY(REQUEST_METHOD),
+	[5]  = CGI_ENTRY(REMOTE_HOST),
+	[6]  = CGI_ENTRY(GEMINI_URL_PATH),
+	[11] = CGI_ENTRY(TLS_CLIENT_HASH),
+	[12] = CGI_ENTRY(SERVER_NAME),
+	[13] = CGI_ENTRY(GEMINI_SEARCH_STRING),
+	[14] = CGI_ENTRY(REMOTE_ADDR),
+};
+
+/*
+ * Returns CGI_VARS for names we are not interested in.
+ */
+enum cgi_var
+cgi_lookup(const char *name, size_t len)
+{
+	unsigned h;
+
+	if (len < CGI_NAME_MIN || len > CGI_NAME_MAX)
+		return CGI_VARS;
+
+	h = CGI_HASH(name, len);
+
+	if (cgi_table[h].len != len || memcmp(cgi_table[h].name, name, len) != 0)
+		return CGI_VARS;
+
+	return cgi_table[h].var;
+}
@@ -0,0 +1,47 @@
+/**
+ * gmlgcd - the gemlog comment daemon
+ * Copyright (C) 2024 github.com/Sir-Photch
+ *
+ * This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+/*
+ * CGI variables gmlgcd cares about; everything else a gemini server
+ * sends is skipped without being copied.
+ */
+enum cgi_var {
+	CGI_REMOTE_ADDR,
+	CGI_REMOTE_HOST,
+	CGI_REMOTE_USER,
+	CGI_REQUEST_METHOD,
+	CGI_SERVER_NAME,
+	CGI_SERVER_PROTOCOL,
+	CGI_GEMINI_URL_PATH,
+	CGI_GEMINI_SEARCH_STRING,
+	CGI_TLS_CLIENT_HASH,
+	CGI_VARS
+};
+
+struct cgi_params {
+	struct {
+		char *value;	// NUL-terminated, NULL if not sent
+		size_t len;
+	} vars[CGI_VARS];
+};
+
+enum cgi_var cgi_lookup(const char *, size_t);
@@ -23,6 +23,7 @@
 #include "comment.h"
 #include "log.h"
 #include "replies.h"
+#include "scan.h"
 #include "util.h"
 
 static const char CN_PREFIX[] = "/CN=";
@@ -32,60 +33,32 @@ static const char *DEFAULT_COMMENT_VERBS[DEFAULT_COMMENT_VERBS_LEN] = {
 	"says", "thinks", "argues", "writes"
 };
 
-static bool
-commentf(char *buf, ssize_t n, const char *username, const char *hash,
-    const char *verb, const char *msg, struct tm utc)
-{
-	size_t l;
-
-	n -= l = snprintf(buf, n, "### %s ", username);
-
-	if (n < 1)
-		return l;
-
-	buf += l;
-
-	if (*hash != '\0') {
-		n -= l = snprintf(buf, n, "(%s) ", hash);
-		if (n < 1)
-			return l;
-		buf += l;
-	}
-
-	l = snprintf(buf, n,
-	    "%s:\n%s\n--- %d-%02d-%02d %d:%02d (UTC)\n\n",
-	    verb, msg,
-	    utc.tm_year + 1900, utc.tm_mon + 1, utc.tm_mday,
-	    utc.tm_hour, utc.tm_min);
-
-	return 0 < n && l < (size_t)n;
-}
-
 bool
-format_comment(char formatted_comment[COMMENTS_MAX], const struct config *cfg,
-    unsigned short rid,
+format_comment(char formatted_comment[COMMENTS_MAX], size_t *comment_len,
+    const struct config *cfg, const struct timecache *tc, unsigned short rid,
     struct user_input user, bool allow_links, const char **errstatus)
 {
 	const char **comment_verbs = cfg->comment.verbs.p ?
 	    (const char **)cfg->comment.verbs.p : DEFAULT_COMMENT_VERBS;
 	size_t comment_verbs_len = cfg->comment.verbs.p ?
 	    cfg->comment.verbs.n : DEFAULT_COMMENT_VERBS_LEN;
-	struct tm utc;
+	struct format_value values[FORMAT_FIELDS];
+	struct scan_result scan;
 	char *col;
-	time_t now;
-	size_t n_lines;
-	ssize_t nontruncated_len;
-	const char *message, *nextline, *username, *verb;
+	size_t nontruncated_len, len;
+	const char *message, *end, *username, *verb;
 
 	*errstatus = NULL;
 
-	col = memchr(user.gemini_search_string, ':', cfg->comment.username_max);
+	len = user.gemini_search_string_len;
+	end = user.gemini_search_string + len;
+	username = NULL;
 
-	if (col && col[1] == ' ') {
-		message = col + 1;
-		*col = '\0';
+	col = memchr(user.gemini_search_string, ':',
+	    len < cfg->comment.username_max ? len : cfg->comment.username_max);
 
-		username = trim_whitespace(user.gemini_search_string);
+	if (col && col + 1 < end && col[1] == ' ') {
+		message = col + 1;
 	} else if (user.name) {
 		message = user.gemini_search_string;
 
@@ -102,50 +75,72 @@ format_comment(char formatted_comment[COMMENTS_MAX], const struct config *cfg,
 		return false;
 	}
 
-	while (*message != '\0' && isspace(*message))
+	while (message < end && isspace(*message))
 		message++;
 
-	if (*message == '\0') {
+	// all at once, before the username gets cut out
+	scan_text(user.gemini_search_string, len,
+	    message - user.gemini_search_string, &scan);
+
+	if (scan.flags & SCAN_INVALID) {
+		warnxli(rid, "invalid utf-8");
+		*errstatus = INVALID_TEXT;
+		return false;
+	}
+
+	if (!username) {
+		*col = '\0';
+		username = trim_whitespace(user.gemini_search_string);
+	}
+
+	if (message == end) {
 		warnxli(rid, "empty comment from %s", username);
 		*errstatus = EMPTY_COMMENT;
 		return false;
 	}
 
-	nextline = message;
-	n_lines = 0;
-	do {
-		if (++n_lines > cfg->comment.lines_max) {
-			warnxli(rid, "too many lines (%lu) from %s", n_lines,
-			    username);
-			*errstatus = TOO_MANY_LINES;
-			return false;
-		}
-		switch (*nextline) {
-		case '#':
-			warnxli(rid, "headers from %s", username);
-			*errstatus = HEADERS_NOT_ALLOWED;
-			return false;
-		case '=':
-			if (!allow_links && nextline[1] == '>') {
-				*errstatus = LINKS_NOT_ALLOWED;
-				return false;
-			}
-			break;
-		default:
-			break;
-		}
-	} while ((nextline = strchr(nextline, '\n')) &&
-	    *(nextline += 1) != '\0');
-
-	time(&now);
-	gmtime_r(&now, &utc);
+	if (scan.lines > cfg->comment.lines_max) {
+		warnxli(rid, "too many lines (%lu) from %s", scan.lines,
+		    username);
+		*errstatus = TOO_MANY_LINES;
+		return false;
+	}
 
-	verb = comment_verbs[rand() % comment_verbs_len];
+	if (scan.flags & SCAN_HEADER) {
+		warnxli(rid, "headers from %s", username);
+		*errstatus = HEADERS_NOT_ALLOWED;
+		return false;
+	}
+
+	if (!allow_links && (scan.flags & SCAN_LINK)) {
+		*errstatus = LINKS_NOT_ALLOWED;
+		return false;
+	}
 
-	memset(formatted_comment, 0, COMMENTS_MAX);
+	if (scan.flags & SCAN_PREFORMATTED) {
+		warnxli(rid, "preformatted text from %s", username);
+		*errstatus = PREFORMATTED_NOT_ALLOWED;
+		return false;
+	}
+
+	verb = comment_verbs[rand() % comment_verbs_len];
 
-	nontruncated_len = commentf(formatted_comment, COMMENTS_MAX, username,
-	    user.id.hash, verb, message, utc);
+	values[FORMAT_USER].s = username;
+	values[FORMAT_USER].len = strlen(username);
+	values[FORMAT_HASH].s = user.id.hash;
+	values[FORMAT_HASH].len = strlen(user.id.hash);
+	values[FORMAT_VERB].s = verb;
+	values[FORMAT_VERB].len = strlen(verb);
+	values[FORMAT_MESSAGE].s = message;
+	values[FORMAT_MESSAGE].len = end - message;
+	values[FORMAT_DATE].s = tc->date;
+	values[FORMAT_DATE].len = tc->date_len;
+
+	nontruncated_len = format_render(&cfg->comment.format,
+	    formatted_comment, COMMENTS_MAX, values);
+
+	*comment_len = nontruncated_len < COMMENTS_MAX ? nontruncated_len :
+	    COMMENTS_MAX - 1;
 
 	if (nontruncated_len >= COMMENTS_MAX) {
 		if (*user.id.hash != '\0')
@@ -19,9 +19,11 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
 
 #include "user.h"
 #include "config.h"
+#include "timecache.h"
 
 #define COMMENTS_MAX 1024
 
@@ -29,8 +31,8 @@ struct user_input {
 	struct user_id id;
 	const char *name; // maybe null
 	char *gemini_search_string;
+	size_t gemini_search_string_len;
 };
 
-bool format_comment(char [COMMENTS_MAX], const struct config *, unsigned short,
-    struct user_input,
-    bool, const char **);
+bool format_comment(char [COMMENTS_MAX], size_t *, const struct config *,
+    const struct timecache *, unsigned short, struct user_input, bool, const char **);
@@ -31,6 +31,8 @@
 #define CONF_PATH_DEFAULT "/etc/gmlgcd.conf"
 
 #define VERBOSE			"verbose"
+#define LOG_LEVEL		"log-level"
+#define JOURNALD_SOCKET	"journald-socket"
 
 #define URI_SUBPATH 	"uri-subpath"
 #define COMMENTS_DIR 	"comments-dir"
@@ -38,10 +40,26 @@
 
 #define RUNTIME_DIR		"runtime-dir"
 
+#define WORKERS			"workers"
+#define MAX_CONNECTIONS	"max-connections"
+#define MAX_REQUESTS	"max-requests"
+#define QUARANTINE_TTL	"quarantine-ttl"
+#define QUARANTINE_MAX	"quarantine-max"
+#define BLOCKED_NETWORKS	"blocked-networks"
+#define FD_CACHE_SIZE	"fd-cache-size"
+#define WRITE_WINDOW	"write-window"
+#define DURABILITY	"durability"
+#define JOURNAL		"journal"
+
 #define TCP				"tcp"
 #define THOST			"host"
 #define TPORT			"port"
 
+#define METRICS			"metrics"
+#define MSOCKET			"socket"
+#define MHOST			"host"
+#define MPORT			"port"
+
 #define HELP_TEMPLATE	"help-template-file"
 
 #define COMMENT			"comment"
@@ -50,7 +68,17 @@
 #define	CUSERNAME_MAX	"username-max"
 #define CALLOW_LINKS	"allow-links"
 #define CAUTH			"authentication"
-#define CVALIDATE (CUSERNAME_MAX "|" CLINES_MAX)
+#define CPOST_INTERVAL	"post-interval"
+#define CPOST_BURST		"post-burst"
+#define CFAIL_INTERVAL	"failure-interval"
+#define CFAIL_BURST		"failure-burst"
+#define CPREFIX_V4		"prefix-v4"
+#define CPREFIX_V6		"prefix-v6"
+#define CPPOST_INTERVAL	"prefix-post-interval"
+#define CPPOST_BURST	"prefix-post-burst"
+#define CPFAIL_INTERVAL	"prefix-failure-interval"
+#define CPFAIL_BURST	"prefix-failure-burst"
+#define CFORMAT			"format"
 
 static _Noreturn void
 usage(void)
@@ -87,6 +115,40 @@ config_validate_natural(cfg_t *c, cfg_opt_t *o)
 	return 0;
 }
 
+/*
+ * Range checks for options of the comment section, done once parsed.
+ */
+static long
+config_getnatural(cfg_t *sec, const char *name)
+{
+	long v;
+
+	if ((v = cfg_getint(sec, name)) < 1)
+		errxl(1, "bad '%s.%s': %ld < 1", sec->name, name, v);
+
+	return v;
+}
+
+/*
+ * Tats are compared through their difference, so a full bucket has to
+ * span less than half the range of the ticks.
+ */
+static void
+config_getratelimit(cfg_t *sec, const char *interval, const char *burst,
+    struct ratelimit *rl)
+{
+	long n;
+
+	rl->interval = ratelimit_ticks(config_getnatural(sec, interval));
+
+	if ((n = config_getnatural(sec, burst)) > INT32_MAX ||
+	    (uint64_t)rl->interval * n > INT32_MAX)
+		errxl(1, "bad '%s.%s' and '%s.%s': bucket too large",
+		    sec->name, interval, sec->name, burst);
+
+	rl->burst = n;
+}
+
 static int
 config_parse_comment_auth(cfg_t *cfg, cfg_opt_t *opt, const char *value,
     void *result)
@@ -109,6 +171,93 @@ config_parse_comment_auth(cfg_t *cfg, cfg_opt_t *opt, const char *value,
 	return 0;
 }
 
+static int
+config_parse_durability(cfg_t *cfg, cfg_opt_t *opt, const char *value,
+    void *result)
+{
+	enum durability *durability = result;
+
+	if (strcmp(value, "none") == 0)
+		*durability = DURABILITY_NONE;
+	else if (strcmp(value, "batched") == 0)
+		*durability = DURABILITY_BATCHED;
+	else if (strcmp(value, "always") == 0)
+		*durability = DURABILITY_ALWAYS;
+	else {
+		cfg_error(cfg,
+		    "Bad %s, possible values are: { 'none', 'batched', 'always' }",
+		    cfg_opt_name(opt));
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+config_parse_log_level(cfg_t *cfg, cfg_opt_t *opt, const char *value,
+    void *result)
+{
+	enum log_level *level = result;
+
+	if (strcmp(value, "warning") == 0)
+		*level = LOG_LEVEL_WARNING;
+	else if (strcmp(value, "message") == 0)
+		*level = LOG_LEVEL_MESSAGE;
+	else if (strcmp(value, "debug") == 0)
+		*level = LOG_LEVEL_DEBUG;
+	else {
+		cfg_error(cfg,
+		    "Bad %s, possible values are: { 'warning', 'message', 'debug' }",
+		    cfg_opt_name(opt));
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Adds a network in CIDR notation to r, the address alone means a host.
+ */
+static void
+config_parse_network(struct radix *r, const char *network)
+{
+	char addr[INET6_ADDRSTRLEN];
+	union {
+		struct in_addr  v4;
+		struct in6_addr v6;
+	} ip;
+	uint8_t key[RADIX_KEY_BITS / 8];
+	const char *errstr, *slash;
+	unsigned bits, offset;
+
+	if (!(slash = strchr(network, '/')))
+		slash = network + strlen(network);
+
+	if ((size_t)(slash - network) >= sizeof(addr))
+		errxl(1, "bad '" BLOCKED_NETWORKS "': %s", network);
+
+	memcpy(addr, network, slash - network);
+	addr[slash - network] = '\0';
+
+	if (inet_pton(AF_INET, addr, &ip.v4) == 1)
+		offset = radix_addr_key(key, AF_INET, &ip.v4);
+	else if (inet_pton(AF_INET6, addr, &ip.v6) == 1)
+		offset = radix_addr_key(key, AF_INET6, &ip.v6);
+	else
+		errxl(1, "bad '" BLOCKED_NETWORKS "': %s", network);
+
+	if (*slash) {
+		bits = strtonum(slash + 1, 0, RADIX_KEY_BITS - offset, &errstr);
+		if (errstr)
+			errxl(1, "bad '" BLOCKED_NETWORKS "': %s: prefix %s",
+			    network, errstr);
+	} else {
+		bits = RADIX_KEY_BITS - offset;
+	}
+
+	radix_insert(r, key, offset + bits, strdup(network));
+}
+
 void
 config_parse(struct config *cfg, int argc, char *const *argv)
 {
@@ -118,23 +267,55 @@ config_parse(struct config *cfg, int argc, char *const *argv)
 		CFG_INT(TPORT, 0, CFGF_NONE),
 		CFG_END()
 	};
+	cfg_opt_t metrics_opts[] = {
+		CFG_STR(MSOCKET, NULL, CFGF_NONE),
+		CFG_STR(MHOST, "127.0.0.1", CFGF_NONE),
+		CFG_INT(MPORT, 0, CFGF_NONE),
+		CFG_END()
+	};
 	cfg_opt_t comment_opts[] = {
 		CFG_STR_LIST(CVERBS, NULL, CFGF_LIST),
 		CFG_INT(CLINES_MAX, 4, CFGF_NONE),
 		CFG_INT(CUSERNAME_MAX, 25, CFGF_NONE),
 		CFG_BOOL(CALLOW_LINKS, false, CFGF_NONE),
 		CFG_INT_CB(CAUTH, REQUIRE_USERNAME, CFGF_NONE, config_parse_comment_auth),
+		CFG_INT(CPOST_INTERVAL, 60, CFGF_NONE),
+		CFG_INT(CPOST_BURST, 3, CFGF_NONE),
+		CFG_INT(CFAIL_INTERVAL, 60, CFGF_NONE),
+		CFG_INT(CFAIL_BURST, 5, CFGF_NONE),
+		CFG_INT(CPREFIX_V4, 0, CFGF_NONE),
+		CFG_INT(CPREFIX_V6, 0, CFGF_NONE),
+		CFG_INT(CPPOST_INTERVAL, 10, CFGF_NONE),
+		CFG_INT(CPPOST_BURST, 30, CFGF_NONE),
+		CFG_INT(CPFAIL_INTERVAL, 10, CFGF_NONE),
+		CFG_INT(CPFAIL_BURST, 50, CFGF_NONE),
+		CFG_STR(CFORMAT, FORMAT_DEFAULT, CFGF_NONE),
 		CFG_END()
 	};
 	cfg_opt_t file_opts[] = {
 		CFG_BOOL(VERBOSE, false, CFGF_NONE),
+		CFG_INT_CB(LOG_LEVEL, LOG_LEVEL_MESSAGE, CFGF_NONE,
+		    config_parse_log_level),
+		CFG_SIMPLE_STR(JOURNALD_SOCKET, &cfg->journald_socket),
 
 		CFG_SIMPLE_STR(URI_SUBPATH, &cfg->uri_subpath),
 		CFG_SIMPLE_STR(COMMENTS_DIR, &cfg->comments_dir),
 		CFG_SIMPLE_STR(PERSISTENT_DIR, &cfg->persistent_dir),
 
 		CFG_STR(RUNTIME_DIR, NULL, CFGF_NONE),
+		CFG_INT(WORKERS, 1, CFGF_NONE),
+		CFG_INT(MAX_CONNECTIONS, 64, CFGF_NONE),
+		CFG_INT(MAX_REQUESTS, 256, CFGF_NONE),
+		CFG_INT(QUARANTINE_TTL, 86400, CFGF_NONE),
+		CFG_INT(QUARANTINE_MAX, 4096, CFGF_NONE),
+		CFG_STR_LIST(BLOCKED_NETWORKS, NULL, CFGF_NONE),
+		CFG_INT(FD_CACHE_SIZE, 16, CFGF_NONE),
+		CFG_INT(WRITE_WINDOW, 0, CFGF_NONE),
+		CFG_INT_CB(DURABILITY, DURABILITY_BATCHED, CFGF_NONE,
+		    config_parse_durability),
+		CFG_BOOL(JOURNAL, false, CFGF_NONE),
 		CFG_SEC(TCP, tcp_opts, CFGF_NODEFAULT),
+		CFG_SEC(METRICS, metrics_opts, CFGF_NODEFAULT),
 
 		CFG_STR(HELP_TEMPLATE, NULL, CFGF_NONE),
 
@@ -142,8 +323,8 @@ config_parse(struct config *cfg, int argc, char *const *argv)
 
 		CFG_END()
 	};
-	cfg_t *file_cfg, *tcp_cfg, *comment_cfg;
-	const char *host;
+	cfg_t *file_cfg, *tcp_cfg, *comment_cfg, *metrics_cfg;
+	const char *host, *errstr;
 	size_t i, n;
 	char c;
 
@@ -172,15 +353,41 @@ config_parse(struct config *cfg, int argc, char *const *argv)
 
 	file_cfg = cfg_init(file_opts, CFGF_NONE);
 	cfg_set_error_function(file_cfg, config_parse_errorcb);
+	cfg_set_validate_func(file_cfg, WORKERS, config_validate_natural);
+	cfg_set_validate_func(file_cfg, MAX_CONNECTIONS,
+	    config_validate_natural);
+	cfg_set_validate_func(file_cfg, MAX_REQUESTS, config_validate_natural);
+	cfg_set_validate_func(file_cfg, QUARANTINE_TTL,
+	    config_validate_natural);
+	cfg_set_validate_func(file_cfg, QUARANTINE_MAX,
+	    config_validate_natural);
+	cfg_set_validate_func(file_cfg, FD_CACHE_SIZE, config_validate_natural);
 
 	if (cfg_parse(file_cfg, cfg_path) == CFG_FILE_ERROR)
 		errl(1, "opening %s failed", cfg_path);
 
 	if (!__log_verbose)
 		__log_verbose = cfg_getbool(file_cfg, VERBOSE);
+	__log_level = cfg_getint(file_cfg, LOG_LEVEL);
+
+	cfg->workers = cfg_getint(file_cfg, WORKERS);
+	cfg->max_connections = cfg_getint(file_cfg, MAX_CONNECTIONS);
+	cfg->max_requests = cfg_getint(file_cfg, MAX_REQUESTS);
+	cfg->quarantine_ttl = cfg_getint(file_cfg, QUARANTINE_TTL);
+	cfg->quarantine_max = cfg_getint(file_cfg, QUARANTINE_MAX);
+	cfg->fd_cache_size = cfg_getint(file_cfg, FD_CACHE_SIZE);
+	if ((cfg->write_window = cfg_getint(file_cfg, WRITE_WINDOW)) < 0 ||
+	    cfg->write_window >= 1000000)
+		errxl(1, "bad '" WRITE_WINDOW "': %ld", cfg->write_window);
+	cfg->durability = cfg_getint(file_cfg, DURABILITY);
+	cfg->journal = cfg_getbool(file_cfg, JOURNAL);
+
+	radix_init(&cfg->blocked);
+	for (i = 0; i < cfg_size(file_cfg, BLOCKED_NETWORKS); ++i)
+		config_parse_network(&cfg->blocked,
+		    cfg_getnstr(file_cfg, BLOCKED_NETWORKS, i));
 
 	comment_cfg = cfg_getsec(file_cfg, COMMENT);
-	cfg_set_validate_func(comment_cfg, CVALIDATE, config_validate_natural);
 
 	n = cfg->comment.verbs.n = cfg_size(comment_cfg, CVERBS);
 	if (n > 0) {
@@ -191,12 +398,35 @@ config_parse(struct config *cfg, int argc, char *const *argv)
 			    cfg_getnstr(comment_cfg, CVERBS, i));
 	}
 
-	cfg->comment.lines_max = cfg_getint(comment_cfg, CLINES_MAX);
-	cfg->comment.username_max = cfg_getint(comment_cfg, CUSERNAME_MAX);
+	cfg->comment.lines_max = config_getnatural(comment_cfg, CLINES_MAX);
+	cfg->comment.username_max = config_getnatural(comment_cfg,
+	    CUSERNAME_MAX);
 
 	cfg->comment.allow_links = cfg_getbool(comment_cfg, CALLOW_LINKS);
+
+	if (!format_compile(&cfg->comment.format,
+	    cfg_getstr(comment_cfg, CFORMAT), &errstr))
+		errxl(1, "bad '" COMMENT "." CFORMAT "': %s", errstr);
+
 	cfg->comment.auth = cfg_getint(comment_cfg, CAUTH);
 
+	config_getratelimit(comment_cfg, CPOST_INTERVAL, CPOST_BURST,
+	    &cfg->comment.post_limit);
+	config_getratelimit(comment_cfg, CFAIL_INTERVAL, CFAIL_BURST,
+	    &cfg->comment.failure_limit);
+
+	if ((cfg->comment.prefix_v4 = cfg_getint(comment_cfg, CPREFIX_V4)) > 32)
+		errxl(1, "bad '" COMMENT "." CPREFIX_V4 "': %u",
+		    cfg->comment.prefix_v4);
+	if ((cfg->comment.prefix_v6 = cfg_getint(comment_cfg, CPREFIX_V6)) > 128)
+		errxl(1, "bad '" COMMENT "." CPREFIX_V6 "': %u",
+		    cfg->comment.prefix_v6);
+
+	config_getratelimit(comment_cfg, CPPOST_INTERVAL, CPPOST_BURST,
+	    &cfg->comment.prefix_post_limit);
+	config_getratelimit(comment_cfg, CPFAIL_INTERVAL, CPFAIL_BURST,
+	    &cfg->comment.prefix_failure_limit);
+
 	if (cfg_size(file_cfg, TCP) > 0) {
 		tcp_cfg = cfg_getsec(file_cfg, TCP);
 		host = cfg_getstr(tcp_cfg, THOST);
@@ -221,6 +451,31 @@ config_parse(struct config *cfg, int argc, char *const *argv)
 		errxl(1,
 		    "'" TCP "' section or '" RUNTIME_DIR "' option required");
 
+	if (cfg_size(file_cfg, METRICS) > 0) {
+		metrics_cfg = cfg_getsec(file_cfg, METRICS);
+
+		if ((host = cfg_getstr(metrics_cfg, MSOCKET))) {
+			cfg->metrics.af = AF_UNIX;
+			cfg->metrics.path = strdup(host);
+		} else {
+			host = cfg_getstr(metrics_cfg, MHOST);
+
+			if (inet_pton(AF_INET, host, &cfg->metrics.ip.v4) == 1)
+				cfg->metrics.af = AF_INET;
+			else if (inet_pton(AF_INET6, host,
+			    &cfg->metrics.ip.v6) == 1)
+				cfg->metrics.af = AF_INET6;
+			else
+				errxl(1, "bad '" METRICS "." MHOST "': %s",
+				    host);
+
+			if ((cfg->metrics.port = cfg_getint(metrics_cfg,
+			    MPORT)) == 0)
+				errxl(1, "'" METRICS "." MPORT
+				    "' unspecified");
+		}
+	}
+
 	if (!cfg->comments_dir)
 		errxl(1, "'" COMMENTS_DIR "' unset");
 	if (!cfg->uri_subpath)
@@ -239,6 +494,7 @@ config_free(struct config *c)
 	free(c->uri_subpath);
 	free(c->comments_dir);
 	free(c->persistent_dir);
+	free(c->journald_socket);
 
 	if (c->help_template)
 		free(c->help_template);
@@ -246,6 +502,9 @@ config_free(struct config *c)
 	if (c->af == AF_UNIX && c->listen.runtime_dir)
 		free(c->listen.runtime_dir);
 
+	if (c->metrics.af == AF_UNIX)
+		free(c->metrics.path);
+
 	if (c->comment.verbs.p) {
 		for (i = 0; i < c->comment.verbs.n; ++i)
 			if (c->comment.verbs.p[i])
@@ -254,5 +513,8 @@ config_free(struct config *c)
 		free(c->comment.verbs.p);
 	}
 
+	radix_free(&c->blocked, free);
+	format_free(&c->comment.format);
+
 	memset(c, 0, sizeof(struct config));
 }
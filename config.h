@@ -20,8 +20,13 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <time.h>
 #include <netinet/in.h>
 
+#include "format.h"
+#include "radix.h"
+#include "ratelimit.h"
+
 struct config {
 	char *uri_subpath;
 	char *comments_dir;
@@ -29,6 +34,22 @@ struct config {
 
 	char *help_template;
 
+	size_t workers;
+	size_t max_connections;
+	size_t max_requests;
+
+	time_t quarantine_ttl;
+	size_t quarantine_max;
+	struct radix blocked;		// values are the networks as given
+
+	size_t fd_cache_size;
+	long write_window;		// microseconds
+	enum durability {
+		DURABILITY_NONE, DURABILITY_BATCHED, DURABILITY_ALWAYS
+	} durability;
+	bool journal;
+	char *journald_socket;		// NULL to log to stdout
+
 	sa_family_t af;
 	union {
 		char *runtime_dir;
@@ -41,6 +62,16 @@ struct config {
 		} tcp;
 	} listen;
 
+	struct {
+		sa_family_t af;		// AF_UNSPEC if not served
+		char *path;
+		union {
+			struct in_addr  v4;
+			struct in6_addr v6;
+		} ip;
+		unsigned short port;
+	} metrics;
+
 	struct {
 		struct {
 			size_t n;
@@ -51,9 +82,16 @@ struct config {
 		size_t username_max;
 
 		bool allow_links;
+		struct format format;
 		enum authmode {
 			NONE, REQUIRE_USERNAME, REQUIRE_CERT
 		} auth;
+
+		struct ratelimit post_limit;
+		struct ratelimit failure_limit;
+		unsigned prefix_v4, prefix_v6;
+		struct ratelimit prefix_post_limit;	// of whole networks
+		struct ratelimit prefix_failure_limit;
 	} comment;
 
 	bool danger_no_sandbox;
@@ -0,0 +1,438 @@
+/**
+ * gmlgcd - the gemlog comment daemon
+ * Copyright (C) 2024 github.com/Sir-Photch
+ *
+ * This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "dirindex.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#if defined(__linux__)
+#include <sys/inotify.h>
+
+#define DIRINDEX_EVENTS (IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | \
+    IN_DELETE | IN_DELETE_SELF | IN_MOVED_FROM | IN_MOVED_TO | \
+    IN_MOVE_SELF | IN_DONT_FOLLOW | IN_ONLYDIR)
+#endif
+
+#include "log.h"
+#include "util.h"
+
+struct dirindex_watch {
+	int wd;
+	char *dir;			// relative to the root, "" for the root
+};
+
+static uint32_t
+dirindex_hash(const char *path)
+{
+	uint32_t h = 2166136261u;
+
+	while (*path) {
+		h ^= (unsigned char)*path++;
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+static struct dirindex_entry *
+dirindex_find(const struct dirindex_table *files, const char *path,
+    uint32_t hash)
+{
+	struct dirindex_entry *e;
+
+	TAILQ_FOREACH(e, &files->buckets[hash % DIRINDEX_BUCKETS], entries) {
+		if (e->hash == hash && strcmp(e->path, path) == 0)
+			return e;
+	}
+
+	return NULL;
+}
+
+static void
+dirindex_remove(struct dirindex_table *files, struct dirindex_entry *e)
+{
+	TAILQ_REMOVE(&files->buckets[e->hash % DIRINDEX_BUCKETS], e, entries);
+	files->n--;
+
+	free(e->path);
+	free(e);
+}
+
+static struct dirindex_table *
+dirindex_table_new(void)
+{
+	struct dirindex_table *files;
+	size_t i;
+
+	if (!(files = calloc(1, sizeof(struct dirindex_table))))
+		errl(1, "dirindex_table_new");
+
+	for (i = 0; i < DIRINDEX_BUCKETS; ++i)
+		TAILQ_INIT(&files->buckets[i]);
+
+	return files;
+}
+
+static void
+dirindex_table_free(struct dirindex_table *files)
+{
+	struct dirindex_entry *e;
+	size_t i;
+
+	for (i = 0; i < DIRINDEX_BUCKETS; ++i) {
+		while ((e = TAILQ_FIRST(&files->buckets[i])))
+			dirindex_remove(files, e);
+	}
+
+	free(files);
+}
+
+/*
+ * Brings the entry of path, relative to the root, up to date.
+ */
+static void
+dirindex_refresh(const struct dirindex *idx, struct dirindex_table *files,
+    const char *path)
+{
+	char full[PATH_MAX];
+	struct dirindex_entry *e;
+	struct stat sb;
+	uint32_t hash;
+
+	hash = dirindex_hash(path);
+	e = dirindex_find(files, path, hash);
+
+	if (!path_combine(full, sizeof(full), idx->root, path) ||
+	    stat(full, &sb) == -1 || !S_ISREG(sb.st_mode)) {
+		if (e)
+			dirindex_remove(files, e);
+		return;
+	}
+
+	if (!e) {
+		if (!(e = calloc(1, sizeof(*e))) || !(e->path = strdup(path)))
+			errl(1, "dirindex_refresh");
+
+		e->hash = hash;
+		TAILQ_INSERT_TAIL(&files->buckets[hash % DIRINDEX_BUCKETS], e,
+		    entries);
+		files->n++;
+	}
+
+	e->writable = access(full, W_OK) == 0;
+}
+
+static void
+dirindex_watch(struct dirindex *idx, const char *dir)
+{
+#if defined(__linux__)
+	char full[PATH_MAX];
+	struct dirindex_watch *w;
+	int wd;
+
+	if (idx->fd == -1)
+		return;
+
+	if (!path_combine(full, sizeof(full), idx->root, dir) ||
+	    (wd = inotify_add_watch(idx->fd, full, DIRINDEX_EVENTS)) == -1) {
+		warnl("inotify_add_watch(%s)", full);
+		return;
+	}
+
+	w = reallocarray(idx->watches, idx->n_watches + 1, sizeof(*w));
+	if (!w || !(w[idx->n_watches].dir = strdup(dir)))
+		errl(1, "dirindex_watch");
+
+	w[idx->n_watches].wd = wd;
+	idx->watches = w;
+	idx->n_watches++;
+#else
+	(void)idx;
+	(void)dir;
+#endif
+}
+
+static void
+dirindex_unwatch(struct dirindex *idx)
+{
+	size_t i;
+
+	for (i = 0; i < idx->n_watches; ++i) {
+#if defined(__linux__)
+		inotify_rm_watch(idx->fd, idx->watches[i].wd);
+#endif
+		free(idx->watches[i].dir);
+	}
+
+	free(idx->watches);
+	idx->watches = NULL;
+	idx->n_watches = 0;
+}
+
+static void
+dirindex_scan(struct dirindex *idx, struct dirindex_table *files,
+    const char *dir)
+{
+	char full[PATH_MAX], path[PATH_MAX];
+	struct dirent *de;
+	struct stat sb;
+	DIR *d;
+
+	if (!path_combine(full, sizeof(full), idx->root, dir) ||
+	    !(d = opendir(full))) {
+		warnl("opendir(%s)", full);
+		return;
+	}
+
+	dirindex_watch(idx, dir);
+
+	while ((de = readdir(d))) {
+		if (strcmp(de->d_name, ".") == 0 ||
+		    strcmp(de->d_name, "..") == 0)
+			continue;
+
+		if (!path_combine(path, sizeof(path), *dir ? dir : NULL,
+		    de->d_name) ||
+		    !path_combine(full, sizeof(full), idx->root, path))
+			continue;
+
+		// symlinked directories aren't followed, they could loop
+		if (lstat(full, &sb) == -1)
+			continue;
+
+		if (S_ISDIR(sb.st_mode))
+			dirindex_scan(idx, files, path);
+		else
+			dirindex_refresh(idx, files, path);
+	}
+
+	closedir(d);
+}
+
+/*
+ * Scans into a new table, lookups go on in the old one meanwhile.
+ */
+static void
+dirindex_rebuild(struct dirindex *idx)
+{
+	struct dirindex_table *files, *old;
+	struct stat sb;
+
+	files = dirindex_table_new();
+
+	if (stat(idx->root, &sb) == -1) {
+		idx->dev = 0;
+		idx->ino = 0;
+	} else {
+		idx->dev = sb.st_dev;
+		idx->ino = sb.st_ino;
+	}
+
+	dirindex_unwatch(idx);
+	dirindex_scan(idx, files, "");
+
+	pthread_rwlock_wrlock(&idx->lock);
+	old = idx->files;
+	idx->files = files;
+	pthread_rwlock_unlock(&idx->lock);
+
+	if (old)
+		dirindex_table_free(old);
+
+	dbgxl("%s: %lu files", idx->root, files->n);
+}
+
+struct dirindex *
+dirindex_new(const char *root)
+{
+	struct dirindex *idx;
+
+	if (!(idx = calloc(1, sizeof(struct dirindex))))
+		return NULL;
+
+	if (!(idx->root = strdup(root))) {
+		free(idx);
+		return NULL;
+	}
+
+	if ((errno = pthread_rwlock_init(&idx->lock, NULL)) != 0) {
+		free(idx->root);
+		free(idx);
+		return NULL;
+	}
+
+#if defined(__linux__)
+	if ((idx->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1)
+		warnl("inotify_init1, rescanning %s periodically", root);
+#else
+	idx->fd = -1;
+#endif
+
+	dirindex_rebuild(idx);
+
+	return idx;
+}
+
+void
+dirindex_free(struct dirindex **idx)
+{
+	dirindex_table_free((*idx)->files);
+	dirindex_unwatch(*idx);
+
+	if ((*idx)->fd != -1)
+		close((*idx)->fd);
+
+	pthread_rwlock_destroy(&(*idx)->lock);
+	free((*idx)->root);
+	free(*idx);
+	*idx = NULL;
+}
+
+/*
+ * Whether the root is another directory than the one last scanned, as
+ * after it was removed and created again. Its watch won't tell while
+ * anyone, like the writer, holds the old one open.
+ */
+static bool
+dirindex_root_changed(const struct dirindex *idx)
+{
+	struct stat sb;
+
+	if (stat(idx->root, &sb) == -1)
+		return idx->ino != 0;
+
+	return sb.st_dev != idx->dev || sb.st_ino != idx->ino;
+}
+
+#if defined(__linux__)
+static const char *
+dirindex_watch_dir(struct dirindex *idx, int wd)
+{
+	size_t i;
+
+	for (i = 0; i < idx->n_watches; ++i) {
+		if (idx->watches[i].wd == wd)
+			return idx->watches[i].dir;
+	}
+
+	return NULL;
+}
+
+/*
+ * Applies pending inotify events. Changes to directories other than new
+ * ones showing up are rare, those just trigger a rebuild. So does losing
+ * a watch, unless it was removed by the last rebuild.
+ */
+static void
+dirindex_read_events(struct dirindex *idx)
+{
+	char buf[4096]
+	    __attribute__((aligned(__alignof__(struct inotify_event))));
+	char path[PATH_MAX];
+	const struct inotify_event *ev;
+	const char *dir;
+	ssize_t len;
+	char *p;
+	bool rebuild = false;
+
+	pthread_rwlock_wrlock(&idx->lock);
+
+	while ((len = read(idx->fd, buf, sizeof(buf))) > 0) {
+		for (p = buf; p < buf + len;
+		    p += sizeof(struct inotify_event) + ev->len) {
+			ev = (const struct inotify_event *)p;
+
+			if (ev->mask & IN_Q_OVERFLOW) {
+				rebuild = true;
+				continue;
+			}
+
+			if (!(dir = dirindex_watch_dir(idx, ev->wd)))
+				continue;
+
+			// the directory itself is gone, or its watch
+			if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF |
+			    IN_IGNORED)) {
+				rebuild = true;
+				continue;
+			}
+
+			if (!ev->len || !path_combine(path, sizeof(path),
+			    *dir ? dir : NULL, ev->name))
+				continue;
+
+			if (!(ev->mask & IN_ISDIR))
+				dirindex_refresh(idx, idx->files, path);
+			else if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+				dirindex_scan(idx, idx->files, path);
+			else if (ev->mask & (IN_DELETE | IN_MOVED_FROM))
+				rebuild = true;
+		}
+	}
+
+	pthread_rwlock_unlock(&idx->lock);
+
+	if (len == -1 && errno != EAGAIN)
+		warnl("read(inotify)");
+
+	if (rebuild)
+		dirindex_rebuild(idx);
+}
+#endif
+
+/*
+ * Called when the inotify descriptor is readable and every
+ * DIRINDEX_RESCAN seconds.
+ */
+void
+dirindex_update(struct dirindex *idx)
+{
+#if defined(__linux__)
+	if (idx->fd != -1) {
+		dirindex_read_events(idx);
+
+		if (dirindex_root_changed(idx))
+			dirindex_rebuild(idx);
+		return;
+	}
+#endif
+
+	dirindex_rebuild(idx);
+}
+
+enum dirindex_status
+dirindex_lookup(struct dirindex *idx, const char *path)
+{
+	struct dirindex_entry *e;
+	enum dirindex_status status;
+
+	pthread_rwlock_rdlock(&idx->lock);
+
+	if (!(e = dirindex_find(idx->files, path, dirindex_hash(path))))
+		status = DIRINDEX_MISSING;
+	else
+		status = e->writable ? DIRINDEX_WRITABLE : DIRINDEX_READONLY;
+
+	pthread_rwlock_unlock(&idx->lock);
+
+	return status;
+}
@@ -0,0 +1,78 @@
+/**
+ * gmlgcd - the gemlog comment daemon
+ * Copyright (C) 2024 github.com/Sir-Photch
+ *
+ * This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "platform.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define DIRINDEX_BUCKETS	1024
+#define DIRINDEX_RESCAN		5	// seconds, without inotify
+
+enum dirindex_status {
+	DIRINDEX_MISSING,
+	DIRINDEX_READONLY,
+	DIRINDEX_WRITABLE
+};
+
+struct dirindex_entry {
+	char *path;			// relative to the root
+	uint32_t hash;
+	bool writable;
+	TAILQ_ENTRY(dirindex_entry) entries;
+};
+
+TAILQ_HEAD(dirindex_list, dirindex_entry);
+
+struct dirindex_table {
+	struct dirindex_list buckets[DIRINDEX_BUCKETS];
+	size_t n;
+};
+
+struct dirindex_watch;
+
+/*
+ * The regular files below a directory and whether they are writable.
+ * With inotify, the index is kept current as events come in, everywhere
+ * else by rescanning every DIRINDEX_RESCAN seconds.
+ *
+ * One thread keeps the index up to date with dirindex_update(), any
+ * thread may look files up. Rebuilds fill a new table and swap it in,
+ * so lookups only wait for single updates and the swap.
+ */
+struct dirindex {
+	char *root;
+	dev_t dev;			// of the root as last scanned,
+	ino_t ino;			// 0 if it was missing
+	struct dirindex_table *files;
+	pthread_rwlock_t lock;		// of files
+
+	int fd;				// inotify, -1 if unavailable
+	struct dirindex_watch *watches;	// updating thread only
+	size_t n_watches;
+};
+
+struct dirindex      *dirindex_new(const char *);
+void                  dirindex_free(struct dirindex **);
+void                  dirindex_update(struct dirindex *);
+enum dirindex_status  dirindex_lookup(struct dirindex *, const char *);
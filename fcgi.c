@@ -18,9 +18,11 @@
 
 #include "fcgi.h"
 #include "log.h"
+#include "probes.h"
 
-static bool
-fcgi_end_request(struct evbuffer *out, unsigned short rid)
+bool
+fcgi_end_request(struct evbuffer *out, unsigned short rid,
+    unsigned char protocol_status)
 {
 	struct fcgi_record_end_request record = {
 		.header = {
@@ -31,7 +33,7 @@ fcgi_end_request(struct evbuffer *out, unsigned short rid)
 			.contentLengthB0 = sizeof(struct fcgi_body_end_request)
 		},
 		.body = {
-			.protocolStatus = FCGI_REQUEST_COMPLETE,
+			.protocolStatus = protocol_status,
 		},
 	};
 
@@ -43,97 +45,331 @@ fcgi_end_request(struct evbuffer *out, unsigned short rid)
 	return true;
 }
 
-bool
+/*
+ * Peeks at the next record without consuming it, so that a record
+ * spread over several reads is only handled once it is complete.
+ */
+enum fcgi_record_status
 fcgi_check_header(struct evbuffer *in, struct fcgi_header *out)
 {
-	if (evbuffer_remove(in, out, FCGI_HEADER_LEN) < FCGI_HEADER_LEN) {
-		warnxl("evbuffer_remove");
-		return false;
+	size_t len;
+
+	if ((len = evbuffer_get_length(in)) < FCGI_HEADER_LEN)
+		return RECORD_INCOMPLETE;
+
+	if (evbuffer_copyout(in, out, FCGI_HEADER_LEN) < FCGI_HEADER_LEN) {
+		warnxl("evbuffer_copyout");
+		return RECORD_BAD;
 	}
 
 	if (out->version != FCGI_VERSION_1) {
 		warnxl("FCGI version %d is not supported", out->version);
+		return RECORD_BAD;
+	}
+
+	if (len < fcgi_record_length(out))
+		return RECORD_INCOMPLETE;
+
+	PROBE3(record, out->type, (out->requestIdB1 << 8) | out->requestIdB0,
+	    (out->contentLengthB1 << 8) | out->contentLengthB0);
+
+	return RECORD_COMPLETE;
+}
+
+static bool
+fcgi_parse_length(const unsigned char *buf, size_t len, size_t *off,
+    size_t *out)
+{
+	if (*off >= len)
 		return false;
+
+	if (buf[*off] >> 7 == 0) {
+		*out = buf[(*off)++];
+		return true;
 	}
 
+	if (*off + 4 > len)
+		return false;
+
+	*out = ((size_t)(buf[*off] & 0x7f) << 24) | (buf[*off + 1] << 16) |
+	    (buf[*off + 2] << 8) | buf[*off + 3];
+	*off += 4;
+
 	return true;
 }
 
-bool
-fcgi_read_param(struct evbuffer *in, struct fcgi_params_entry *entry)
+/*
+ * Decodes the name-value pair at the start of buf in place.
+ * Returns the size of the pair, 0 if buf does not hold all of it yet,
+ * or -1 if the pair can never fit into a FCGI_PARAMS stream.
+ */
+ssize_t
+fcgi_parse_param(const unsigned char *buf, size_t len, struct fcgi_param *p)
 {
-	int32_t name_len, val_len;
-	bool long_name_len, long_val_len;
+	size_t off = 0;
 
-	unsigned char bytes[8];
-	size_t i;
+	if (!fcgi_parse_length(buf, len, &off, &p->name_len) ||
+	    !fcgi_parse_length(buf, len, &off, &p->value_len))
+		return 0;
 
-	entry->name = entry->value = NULL;
+	if (p->name_len + p->value_len > FCGI_PARAMS_MAX)
+		return -1;
 
-	if (evbuffer_remove(in, bytes, 2) < 2)
-		return false;
+	if (off + p->name_len + p->value_len > len)
+		return 0;
 
-	long_name_len = bytes[0] >> 7 == 1;
+	p->name = (const char *)buf + off;
+	p->value = p->name + p->name_len;
 
-	if (long_name_len) {
-		i = 2;
+	return off + p->name_len + p->value_len;
+}
 
-		if (evbuffer_remove(in, bytes + i, 3) < 3)
-			return false;
+/*
+ * Number of bytes the pair starting in buf needs, as far as known yet.
+ */
+static size_t
+fcgi_param_need(const unsigned char *buf, size_t len)
+{
+	size_t off = 0, name_len, value_len;
+
+	if (!fcgi_parse_length(buf, len, &off, &name_len) ||
+	    !fcgi_parse_length(buf, len, &off, &value_len))
+		return len + 1;
 
-		i += 3;
+	return off + name_len + value_len;
+}
+
+/*
+ * Completes the pair carried over from previous records with bytes from
+ * data. Returns the number of bytes taken from data, or -1 on error.
+ */
+static ssize_t
+fcgi_feed_carry(struct fcgi_request *r, const unsigned char *data, size_t len,
+    fcgi_param_cb cb, void *arg)
+{
+	struct fcgi_param p;
+	unsigned char *grown;
+	size_t cap, n, need, taken;
+	ssize_t parsed;
+
+	taken = 0;
+
+	while ((parsed = fcgi_parse_param(r->carry, r->carry_len, &p)) == 0 &&
+	    taken < len) {
+		need = fcgi_param_need(r->carry, r->carry_len);
+
+		if (need > r->carry_cap) {
+			cap = need < 8 ? 8 : need;
+			if (!(grown = arena_alloc(&r->arena, cap)))
+				return -1;
+			if (r->carry_len > 0)
+				memcpy(grown, r->carry, r->carry_len);
+			r->carry = grown;
+			r->carry_cap = cap;
+		}
+
+		if ((n = need - r->carry_len) > len - taken)
+			n = len - taken;
+
+		memcpy(r->carry + r->carry_len, data + taken, n);
+		r->carry_len += n;
+		taken += n;
 	}
 
-	long_val_len = bytes[long_name_len ? 4 : 1] >> 7 == 1;
+	if (parsed < 0)
+		return -1;
+
+	if (parsed > 0) {
+		if (!cb(r, &p, arg))
+			return -1;
+		r->carry_len = 0;
+	}
+
+	return taken;
+}
+
+/*
+ * Hands every name-value pair of a FCGI_PARAMS record to cb. The views
+ * passed to cb are only valid during the call. Pairs spanning records
+ * are put together in the request's arena.
+ */
+bool
+fcgi_feed_params(struct fcgi_request *r, const unsigned char *data, size_t len,
+    fcgi_param_cb cb, void *arg)
+{
+	struct fcgi_param p;
+	size_t off;
+	ssize_t n;
 
-	if (long_val_len) {
-		i = long_name_len ? 5 : 2;
+	off = 0;
 
-		if (evbuffer_remove(in, bytes + i, 3) < 3)
+	if (r->carry_len > 0) {
+		if ((n = fcgi_feed_carry(r, data, len, cb, arg)) < 0)
 			return false;
+		off = n;
 	}
 
-	if (long_name_len) {
-		name_len = ((bytes[0] & 0x7f) << 24) | (bytes[1] << 16) |
-		    (bytes[2] << 8) | bytes[3];
+	while (off < len) {
+		if ((n = fcgi_parse_param(data + off, len - off, &p)) < 0)
+			return false;
 
-		if (long_val_len) {
-			val_len = ((bytes[4] & 0x7f) << 24) | (bytes[5] << 16) |
-			    (bytes[6] << 8) | bytes[7];
-		} else {
-			val_len = bytes[4];
+		if (n == 0) {
+			r->carry_len = 0;
+			return fcgi_feed_carry(r, data + off, len - off, cb,
+			    arg) == (ssize_t)(len - off);
 		}
-	} else {
-		name_len = bytes[0];
 
-		if (long_val_len) {
-			val_len = ((bytes[1] & 0x7f) << 24) | (bytes[2] << 16) |
-			    (bytes[3] << 8) | bytes[4];
-		} else {
-			val_len = bytes[1];
-		}
+		if (!cb(r, &p, arg))
+			return false;
+
+		off += n;
 	}
 
-	entry->name = calloc(name_len + 1, sizeof(char));
+	return true;
+}
 
-	if (evbuffer_remove(in, entry->name, name_len) < name_len) {
-		warnxl("evbuffer_remove");
-		free(entry->name);
-		return false;
+static bool
+fcgi_write_length(struct evbuffer *out, size_t len)
+{
+	unsigned char bytes[4];
+
+	if (len < 0x80) {
+		bytes[0] = len;
+		return evbuffer_add(out, bytes, 1) == 0;
 	}
 
-	entry->value = calloc(val_len + 1, sizeof(char));
+	bytes[0] = (len >> 24) | 0x80;
+	bytes[1] = len >> 16;
+	bytes[2] = len >> 8;
+	bytes[3] = len;
+
+	return evbuffer_add(out, bytes, 4) == 0;
+}
+
+bool
+fcgi_write_param(struct evbuffer *out, const char *name, size_t name_len,
+    const char *value, size_t val_len)
+{
+	return fcgi_write_length(out, name_len) &&
+	    fcgi_write_length(out, val_len) &&
+	    evbuffer_add(out, name, name_len) == 0 &&
+	    evbuffer_add(out, value, val_len) == 0;
+}
+
+/*
+ * Moves all of content into a single record.
+ */
+bool
+fcgi_write_record(struct evbuffer *out, unsigned char type, unsigned short rid,
+    struct evbuffer *content)
+{
+	size_t len = evbuffer_get_length(content);
+	struct fcgi_header header = {
+		.version = FCGI_VERSION_1,
+		.type = type,
+		.requestIdB1 = rid >> 8,
+		.requestIdB0 = rid & 0xFF,
+		.contentLengthB1 = len >> 8,
+		.contentLengthB0 = len & 0xFF,
+	};
+
+	if (len > 0xffff) {
+		warnxli(rid, "record content too long: %lu", len);
+		return false;
+	}
 
-	if (evbuffer_remove(in, entry->value, val_len) < val_len) {
-		warnxl("evbuffer_remove");
-		free(entry->name);
-		free(entry->value);
+	if (evbuffer_add(out, &header, FCGI_HEADER_LEN) < 0 ||
+	    evbuffer_add_buffer(out, content) < 0) {
+		warnxli(rid, "evbuffer_add");
 		return false;
 	}
 
 	return true;
 }
 
+void
+fcgi_requests_init(struct fcgi_request_table *t)
+{
+	size_t i;
+
+	for (i = 0; i < FCGI_REQUEST_BUCKETS; ++i)
+		TAILQ_INIT(&t->buckets[i]);
+	TAILQ_INIT(&t->unused);
+	t->n = 0;
+}
+
+static void
+fcgi_request_list_free(struct fcgi_request_list *l)
+{
+	struct fcgi_request *r;
+
+	while ((r = TAILQ_FIRST(l))) {
+		TAILQ_REMOVE(l, r, entries);
+		arena_free(&r->arena);
+		free(r);
+	}
+}
+
+void
+fcgi_requests_free(struct fcgi_request_table *t)
+{
+	size_t i;
+
+	for (i = 0; i < FCGI_REQUEST_BUCKETS; ++i)
+		fcgi_request_list_free(&t->buckets[i]);
+	fcgi_request_list_free(&t->unused);
+	t->n = 0;
+}
+
+struct fcgi_request *
+fcgi_request_find(struct fcgi_request_table *t, unsigned short rid)
+{
+	struct fcgi_request *r;
+
+	TAILQ_FOREACH(r, &t->buckets[rid % FCGI_REQUEST_BUCKETS], entries) {
+		if (r->rid == rid)
+			return r;
+	}
+
+	return NULL;
+}
+
+struct fcgi_request *
+fcgi_request_add(struct fcgi_request_table *t, unsigned short rid)
+{
+	struct fcgi_request *r;
+
+	if ((r = TAILQ_FIRST(&t->unused))) {
+		TAILQ_REMOVE(&t->unused, r, entries);
+	} else {
+		if (!(r = calloc(1, sizeof(struct fcgi_request))))
+			return NULL;
+
+		arena_init(&r->arena);
+	}
+
+	memset(&r->cgi, 0, sizeof(r->cgi));
+	r->carry = NULL;
+	r->carry_len = r->carry_cap = r->params_len = 0;
+	r->rid = rid;
+	r->keep_conn = r->params_done = false;
+
+	TAILQ_INSERT_TAIL(&t->buckets[rid % FCGI_REQUEST_BUCKETS], r, entries);
+	t->n++;
+
+	return r;
+}
+
+void
+fcgi_request_remove(struct fcgi_request_table *t, struct fcgi_request *r)
+{
+	TAILQ_REMOVE(&t->buckets[r->rid % FCGI_REQUEST_BUCKETS], r, entries);
+	t->n--;
+
+	arena_reset(&r->arena);
+	TAILQ_INSERT_HEAD(&t->unused, r, entries);
+}
+
 bool
 fcgi_write_stdout(struct evbuffer *out, unsigned short rid,
     const char *str,
@@ -158,5 +394,5 @@ fcgi_write_stdout(struct evbuffer *out, unsigned short rid,
 	header.contentLengthB0 = header.contentLengthB1 = 0;
 
 	return evbuffer_add(out, &header, FCGI_HEADER_LEN) == 0 &&
-	    fcgi_end_request(out, rid);
+	    fcgi_end_request(out, rid, FCGI_REQUEST_COMPLETE);
 }
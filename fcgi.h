@@ -4,6 +4,11 @@
 
 #include <event2/buffer.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "arena.h"
+#include "cgi.h"
 
 // https://fastcgi-archives.github.io/FastCGI_Specification.html#S8
 
@@ -24,6 +29,16 @@ struct fcgi_header {
  */
 #define FCGI_HEADER_LEN  8
 
+/*
+ * Largest possible record: header, 16-bit content length and padding.
+ */
+#define FCGI_RECORD_MAX (FCGI_HEADER_LEN + 0xffff + 0xff)
+
+/*
+ * Upper bound for the whole FCGI_PARAMS stream of a single request.
+ */
+#define FCGI_PARAMS_MAX (1 << 16)
+
 /*
  * Value for version component of FCGI_Header
  */
@@ -113,14 +128,92 @@ struct fcgi_record_unknown_type {
 	struct fcgi_body_unknown_type body;
 };
 
-struct fcgi_params_entry {
-	char *name, *value;
-	TAILQ_ENTRY(fcgi_params_entry) entries;
+/*
+ * A name-value pair as it appears in FCGI_PARAMS or FCGI_GET_VALUES
+ * content. Neither name nor value are NUL-terminated.
+ */
+struct fcgi_param {
+	const char *name, *value;
+	size_t name_len, value_len;
 };
 
-TAILQ_HEAD(fcgi_params_head, fcgi_params_entry);
+/*
+ * State of a request whose records may arrive over several reads.
+ * Everything a request needs is carved from its arena, which is reset
+ * once the request is done.
+ */
+struct fcgi_request {
+	struct arena arena;
+	struct cgi_params cgi;
+	unsigned char *carry;		// pair split across FCGI_PARAMS records
+	size_t carry_len, carry_cap;
+	size_t params_len;		// FCGI_PARAMS stream read so far
+	unsigned short rid;
+	bool keep_conn;
+	bool params_done;
+	uint64_t begun, queued;		// metrics_now(), for latencies
+	TAILQ_ENTRY(fcgi_request) entries;
+};
 
-bool fcgi_check_header(struct evbuffer *, struct fcgi_header *);
-bool fcgi_read_param(struct evbuffer *, struct fcgi_params_entry *);
+typedef bool (*fcgi_param_cb)(struct fcgi_request *,
+    const struct fcgi_param *, void *);
+
+TAILQ_HEAD(fcgi_request_list, fcgi_request);
+
+#define FCGI_REQUEST_BUCKETS 16
+
+/*
+ * Requests multiplexed over one connection, keyed by request id.
+ * Finished requests are kept around for reuse.
+ */
+struct fcgi_request_table {
+	struct fcgi_request_list buckets[FCGI_REQUEST_BUCKETS];
+	struct fcgi_request_list unused;
+	size_t n;
+};
+
+enum fcgi_record_status {
+	RECORD_BAD,
+	RECORD_INCOMPLETE,
+	RECORD_COMPLETE
+};
+
+static inline unsigned short
+fcgi_request_id(const struct fcgi_header *h)
+{
+	return (h->requestIdB1 << 8) | h->requestIdB0;
+}
+
+static inline unsigned short
+fcgi_content_length(const struct fcgi_header *h)
+{
+	return (h->contentLengthB1 << 8) | h->contentLengthB0;
+}
+
+static inline size_t
+fcgi_record_length(const struct fcgi_header *h)
+{
+	return FCGI_HEADER_LEN + fcgi_content_length(h) + h->paddingLength;
+}
+
+enum fcgi_record_status fcgi_check_header(struct evbuffer *,
+    struct fcgi_header *);
+ssize_t fcgi_parse_param(const unsigned char *, size_t, struct fcgi_param *);
+bool fcgi_feed_params(struct fcgi_request *, const unsigned char *, size_t,
+    fcgi_param_cb, void *);
+bool fcgi_write_param(struct evbuffer *, const char *, size_t, const char *,
+    size_t);
+bool fcgi_write_record(struct evbuffer *, unsigned char, unsigned short,
+    struct evbuffer *);
+bool fcgi_end_request(struct evbuffer *, unsigned short, unsigned char);
+
+void                 fcgi_requests_init(struct fcgi_request_table *);
+void                 fcgi_requests_free(struct fcgi_request_table *);
+struct fcgi_request *fcgi_request_find(struct fcgi_request_table *,
+    unsigned short);
+struct fcgi_request *fcgi_request_add(struct fcgi_request_table *,
+    unsigned short);
+void                 fcgi_request_remove(struct fcgi_request_table *,
+    struct fcgi_request *);
 bool fcgi_write_stdout(struct evbuffer *, unsigned short, const char *,
     unsigned short);
@@ -0,0 +1,206 @@
+/**
+ * gmlgcd - the gemlog comment daemon
+ * Copyright (C) 2024 github.com/Sir-Photch
+ *
+ * This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "fdcache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "log.h"
+#include "util.h"
+
+static uint32_t
+fdcache_hash(const char *path)
+{
+	uint32_t h = 2166136261u;
+
+	while (*path) {
+		h ^= (unsigned char)*path++;
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+static void
+fdcache_entry_free(struct fdcache *c, struct fdcache_entry *e)
+{
+	TAILQ_REMOVE(&c->buckets[e->hash % FDCACHE_BUCKETS], e, bucket);
+	TAILQ_REMOVE(&c->lru, e, lru);
+	c->free_slots[c->max - c->n--] = e->slot;
+
+	if (close(e->fd) == -1)
+		warnl("close(%s)", e->path);
+
+	free(e->path);
+	free(e);
+}
+
+static struct fdcache_entry *
+fdcache_find(struct fdcache *c, const char *path, uint32_t hash)
+{
+	struct fdcache_entry *e;
+
+	TAILQ_FOREACH(e, &c->buckets[hash % FDCACHE_BUCKETS], bucket) {
+		if (e->hash == hash && strcmp(e->path, path) == 0)
+			return e;
+	}
+
+	return NULL;
+}
+
+/*
+ * True if path still names the file the entry has open.
+ */
+static bool
+fdcache_valid(struct fdcache_entry *e, int dirfd)
+{
+	struct stat sb;
+
+	if (fstatat(dirfd, e->path, &sb, 0) == -1)
+		return false;
+
+	return sb.st_dev == e->dev && sb.st_ino == e->ino;
+}
+
+struct fdcache *
+fdcache_new(size_t max)
+{
+	struct fdcache *c;
+	size_t i;
+
+	if (!(c = calloc(1, sizeof(struct fdcache))))
+		return NULL;
+
+	if (!(c->free_slots = calloc(max, sizeof(size_t)))) {
+		free(c);
+		return NULL;
+	}
+
+	for (i = 0; i < FDCACHE_BUCKETS; ++i)
+		TAILQ_INIT(&c->buckets[i]);
+	TAILQ_INIT(&c->lru);
+	c->max = max;
+
+	for (i = 0; i < max; ++i)
+		c->free_slots[i] = max - i - 1;
+
+	return c;
+}
+
+void
+fdcache_free(struct fdcache **c)
+{
+	struct fdcache_entry *e;
+
+	while ((e = TAILQ_FIRST(&(*c)->lru)))
+		fdcache_entry_free(*c, e);
+
+	free((*c)->free_slots);
+	free(*c);
+	*c = NULL;
+}
+
+/*
+ * Returns the entry of path beneath dirfd, open for appending, or NULL with
+ * errno set. The entry belongs to the cache and stays valid until the next
+ * call.
+ */
+struct fdcache_entry *
+fdcache_get(struct fdcache *c, int dirfd, const char *path, time_t now)
+{
+	struct fdcache_entry *e;
+	struct stat sb;
+	uint32_t hash;
+	int fd, saved_errno;
+
+	hash = fdcache_hash(path);
+
+	if ((e = fdcache_find(c, path, hash))) {
+		if (now - e->checked < FDCACHE_REVALIDATE ||
+		    fdcache_valid(e, dirfd)) {
+			e->checked = now;
+
+			TAILQ_REMOVE(&c->lru, e, lru);
+			TAILQ_INSERT_HEAD(&c->lru, e, lru);
+
+			return e;
+		}
+
+		dbgxl("%s changed, reopening", path);
+		fdcache_entry_free(c, e);
+	}
+
+	if ((fd = open_beneath(dirfd, path, O_WRONLY | O_APPEND | O_CLOEXEC)) ==
+	    -1)
+		return NULL;
+
+	e = NULL;
+	if (fstat(fd, &sb) == -1 || !(e = calloc(1, sizeof(*e))) ||
+	    !(e->path = strdup(path))) {
+		saved_errno = errno;
+		free(e);
+		close(fd);
+		errno = saved_errno;
+		return NULL;
+	}
+
+	e->hash = hash;
+	e->fd = fd;
+	e->dev = sb.st_dev;
+	e->ino = sb.st_ino;
+	e->checked = now;
+	e->serial = ++c->serial;
+
+	if (c->n >= c->max)
+		fdcache_entry_free(c, TAILQ_LAST(&c->lru, fdcache_list));
+
+	e->slot = c->free_slots[c->max - ++c->n];
+
+	TAILQ_INSERT_HEAD(&c->buckets[hash % FDCACHE_BUCKETS], e, bucket);
+	TAILQ_INSERT_HEAD(&c->lru, e, lru);
+
+	return e;
+}
+
+/*
+ * Like fdcache_get(), but returns the descriptor, or -1.
+ */
+int
+fdcache_open(struct fdcache *c, int dirfd, const char *path, time_t now)
+{
+	struct fdcache_entry *e;
+
+	return (e = fdcache_get(c, dirfd, path, now)) ? e->fd : -1;
+}
+
+/*
+ * Drops the descriptor of path, if cached.
+ */
+void
+fdcache_close(struct fdcache *c, const char *path)
+{
+	struct fdcache_entry *e;
+
+	if ((e = fdcache_find(c, path, fdcache_hash(path))))
+		fdcache_entry_free(c, e);
+}
@@ -0,0 +1,67 @@
+/**
+ * gmlgcd - the gemlog comment daemon
+ * Copyright (C) 2024 github.com/Sir-Photch
+ *
+ * This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "platform.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+#define FDCACHE_BUCKETS		64
+#define FDCACHE_REVALIDATE	1	// seconds between stat() checks
+
+struct fdcache_entry {
+	char *path;
+	uint32_t hash;
+	int fd;
+	size_t slot;			// unique among cached descriptors
+	uint64_t serial;		// unique among all opened so far
+	dev_t dev;
+	ino_t ino;
+	time_t checked;
+	TAILQ_ENTRY(fdcache_entry) bucket;
+	TAILQ_ENTRY(fdcache_entry) lru;
+};
+
+TAILQ_HEAD(fdcache_list, fdcache_entry);
+
+/*
+ * Descriptors of comment files opened for appending, by path relative to
+ * the directory they were opened beneath. Least recently used ones get
+ * closed beyond max. A cached descriptor is checked against its
+ * path at most every FDCACHE_REVALIDATE seconds, so renamed, replaced or
+ * deleted files get reopened. Each cached descriptor holds one of max slots,
+ * for whoever wants to mirror the cache in a table of its own.
+ */
+struct fdcache {
+	struct fdcache_list buckets[FDCACHE_BUCKETS];
+	struct fdcache_list lru;	// most recently used first
+	size_t n, max;
+	size_t *free_slots;		// max - n of them
+	uint64_t serial;
+};
+
+struct fdcache *fdcache_new(size_t);
+void            fdcache_free(struct fdcache **);
+int             fdcache_open(struct fdcache *, int, const char *, time_t);
+struct fdcache_entry *fdcache_get(struct fdcache *, int, const char *, time_t);
+void            fdcache_close(struct fdcache *, const char *);
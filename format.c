@@ -0,0 +1,232 @@
+/**
+ * gmlgcd - the gemlog comment daemon
+ * Copyright (C) 2024 github.com/Sir-Photch
+ *
+ * This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "format.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static const char *FORMAT_NAMES[FORMAT_FIELDS] = {
+	[FORMAT_USER] = "user",
+	[FORMAT_HASH] = "hash",
+	[FORMAT_VERB] = "verb",
+	[FORMAT_MESSAGE] = "message",
+	[FORMAT_DATE] = "date",
+};
+
+/*
+ * Compiles s into f. On failure, errstr says what's wrong with it.
+ */
+bool
+format_compile(struct format *f, const char *s, const char **errstr)
+{
+	struct format_op *op, *group = NULL;
+	const char *end;
+	char *lit;
+	size_t i, len;
+
+	memset(f, 0, sizeof(*f));
+
+	// neither can outgrow s
+	len = strlen(s);
+	if (!(f->ops = calloc(len + 1, sizeof(struct format_op))) ||
+	    !(f->literals = malloc(len + 1))) {
+		*errstr = "out of memory";
+		goto fail;
+	}
+
+	lit = f->literals;
+	op = NULL;
+
+	while (*s) {
+		if ((*s == '{' || *s == '}' || *s == '[' || *s == ']') &&
+		    s[1] == *s) {
+			// escaped, falls through to literal below
+			s++;
+		} else if (*s == '{') {
+			if (!(end = strchr(s, '}'))) {
+				*errstr = "unterminated '{'";
+				goto fail;
+			}
+
+			for (i = 0; i < FORMAT_FIELDS; ++i) {
+				if (strlen(FORMAT_NAMES[i]) ==
+				    (size_t)(end - s - 1) &&
+				    strncmp(FORMAT_NAMES[i], s + 1,
+				    end - s - 1) == 0)
+					break;
+			}
+
+			if (i == FORMAT_FIELDS) {
+				*errstr = "unknown field";
+				goto fail;
+			}
+
+			f->ops[f->n++].type = i;
+			if (group)
+				group->fields |= 1u << i;
+
+			s = end + 1;
+			op = NULL;
+			continue;
+		} else if (*s == '[') {
+			if (group) {
+				*errstr = "nested '['";
+				goto fail;
+			}
+
+			group = &f->ops[f->n++];
+			group->type = FORMAT_OPTIONAL;
+
+			s++;
+			op = NULL;
+			continue;
+		} else if (*s == ']') {
+			if (!group) {
+				*errstr = "unmatched ']'";
+				goto fail;
+			}
+
+			group->skip = f->ops + f->n - group - 1;
+			group = NULL;
+
+			s++;
+			op = NULL;
+			continue;
+		} else if (*s == '}') {
+			*errstr = "unmatched '}'";
+			goto fail;
+		}
+
+		// literals are merged into one op while they last
+		if (!op) {
+			op = &f->ops[f->n++];
+			op->type = FORMAT_LITERAL;
+			op->s = lit;
+		}
+
+		*lit++ = *s++;
+		op->len++;
+	}
+
+	if (group) {
+		*errstr = "unterminated '['";
+		goto fail;
+	}
+
+	return true;
+
+ fail:
+	format_free(f);
+	return false;
+}
+
+void
+format_free(struct format *f)
+{
+	free(f->ops);
+	free(f->literals);
+	memset(f, 0, sizeof(*f));
+}
+
+/*
+ * Renders f with values into buf, truncating at n - 1 bytes. Returns the
+ * length the result would have had, like snprintf().
+ */
+size_t
+format_render(const struct format *f, char *buf, size_t n,
+    const struct format_value values[FORMAT_FIELDS])
+{
+	const struct format_op *op, *end = f->ops + f->n;
+	const char *s;
+	size_t len, total = 0, i;
+	unsigned empty = 0;
+
+	for (i = 0; i < FORMAT_FIELDS; ++i)
+		if (values[i].len == 0)
+			empty |= 1u << i;
+
+	for (op = f->ops; op < end; ++op) {
+		switch (op->type) {
+		case FORMAT_OPTIONAL:
+			if (op->fields & empty)
+				op += op->skip;
+			continue;
+		case FORMAT_LITERAL:
+			s = op->s;
+			len = op->len;
+			break;
+		default:
+			s = values[op->type].s;
+			len = values[op->type].len;
+			break;
+		}
+
+		if (total < n)
+			memcpy(buf + total, s, total + len < n ? len :
+			    n - total);
+
+		total += len;
+	}
+
+	if (n > 0)
+		buf[total < n ? total : n - 1] = '\0';
+
+	return total;
+}
+
+static char *
+format_number(char *p, int v, int width)
+{
+	char digits[12];
+	int i = 0;
+
+	do {
+		digits[i++] = '0' + v % 10;
+		v /= 10;
+	} while (v > 0 && i < (int)sizeof(digits));
+
+	while (i < width--)
+		*p++ = '0';
+	while (i > 0)
+		*p++ = digits[--i];
+
+	return p;
+}
+
+/*
+ * Writes the date as in "2024-01-31 9:05", without the printf machinery.
+ */
+size_t
+format_date(char buf[FORMAT_DATE_MAX], const struct tm *utc)
+{
+	char *p = buf;
+
+	p = format_number(p, utc->tm_year + 1900, 0);
+	*p++ = '-';
+	p = format_number(p, utc->tm_mon + 1, 2);
+	*p++ = '-';
+	p = format_number(p, utc->tm_mday, 2);
+	*p++ = ' ';
+	p = format_number(p, utc->tm_hour, 0);
+	*p++ = ':';
+	p = format_number(p, utc->tm_min, 2);
+	*p = '\0';
+
+	return p - buf;
+}
@@ -0,0 +1,66 @@
+/**
+ * gmlgcd - the gemlog comment daemon
+ * Copyright (C) 2024 github.com/Sir-Photch
+ *
+ * This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+#define FORMAT_DEFAULT \
+    "### {user} [({hash}) ]{verb}:\n{message}\n--- {date} (UTC)\n\n"
+
+#define FORMAT_DATE_MAX	32
+
+enum format_field {
+	FORMAT_USER, FORMAT_HASH, FORMAT_VERB, FORMAT_MESSAGE, FORMAT_DATE,
+	FORMAT_FIELDS,
+	FORMAT_LITERAL = FORMAT_FIELDS,
+	FORMAT_OPTIONAL,
+};
+
+struct format_op {
+	enum format_field type;
+	const char *s;			// FORMAT_LITERAL
+	size_t len;
+	size_t skip;			// FORMAT_OPTIONAL: ops in the group
+	unsigned fields;		// FORMAT_OPTIONAL: 1 << field, of those
+};
+
+/*
+ * A comment template, compiled from a string such as FORMAT_DEFAULT:
+ * fields in braces are replaced, groups in brackets are left out if any
+ * of their fields is empty, and doubled braces or brackets stand for
+ * themselves.
+ */
+struct format {
+	struct format_op *ops;
+	size_t n;
+	char *literals;			// the ops' text
+};
+
+struct format_value {
+	const char *s;
+	size_t len;
+};
+
+bool   format_compile(struct format *, const char *, const char **);
+void   format_free(struct format *);
+size_t format_render(const struct format *, char *, size_t,
+    const struct format_value [FORMAT_FIELDS]);
+size_t format_date(char [FORMAT_DATE_MAX], const struct tm *);
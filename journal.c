@@ -0,0 +1,401 @@
+/**
+ * gmlgcd - the gemlog comment daemon
+ * Copyright (C) 2024 github.com/Sir-Photch
+ *
+ * This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "journal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "log.h"
+#include "util.h"
+
+#define JOURNAL_HEADER	18	// length, crc, offset, path length
+#define JOURNAL_CHECKED	10	// bytes of the header covered by the crc
+
+static uint32_t
+journal_crc(const char *p, size_t n)
+{
+	uint32_t crc = 0xffffffff;
+	int i;
+
+	while (n--) {
+		crc ^= (unsigned char)*p++;
+		for (i = 0; i < 8; ++i)
+			crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+	}
+
+	return ~crc;
+}
+
+static uint32_t
+journal_hash(const char *path)
+{
+	uint32_t h = 2166136261u;
+
+	while (*path) {
+		h ^= (unsigned char)*path++;
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+/*
+ * Remembers path to be synced at the next checkpoint.
+ */
+static bool
+journal_touch(struct journal *j, const char *path)
+{
+	struct journal_path *p;
+	uint32_t hash;
+
+	hash = journal_hash(path);
+
+	TAILQ_FOREACH(p, &j->buckets[hash % JOURNAL_BUCKETS], entries) {
+		if (p->hash == hash && strcmp(p->path, path) == 0)
+			return true;
+	}
+
+	if (!(p = calloc(1, sizeof(*p))) || !(p->path = strdup(path))) {
+		free(p);
+		return false;
+	}
+
+	p->hash = hash;
+	TAILQ_INSERT_TAIL(&j->buckets[hash % JOURNAL_BUCKETS], p, entries);
+
+	return true;
+}
+
+static bool
+journal_write(int fd, const char *p, size_t n)
+{
+	ssize_t written;
+
+	while (n > 0) {
+		if ((written = write(fd, p, n)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+
+		p += written;
+		n -= written;
+	}
+
+	return true;
+}
+
+/*
+ * Brings path up to offset + len, unless it's there already.
+ */
+static void
+journal_apply(struct journal *j, int dirfd, const char *path,
+    uint64_t offset, const char *data, size_t len)
+{
+	struct stat sb;
+	uint64_t size;
+	int fd;
+
+	if ((fd = open_beneath(dirfd, path, O_WRONLY | O_APPEND | O_CLOEXEC)) ==
+	    -1) {
+		warnl("journal: open(%s)", path);
+		return;
+	}
+
+	if (fstat(fd, &sb) == -1) {
+		warnl("journal: fstat(%s)", path);
+		goto out;
+	}
+
+	size = sb.st_size;
+
+	if (size < offset) {
+		warnxl("journal: %s is shorter than expected, skipping", path);
+		goto out;
+	}
+
+	if (size >= offset + len)
+		goto out;
+
+	dbgxl("journal: %s: restoring %lu bytes", path, offset + len - size);
+
+	if (!journal_write(fd, data + (size - offset), offset + len - size))
+		warnl("journal: write(%s)", path);
+	else if (!journal_touch(j, path))
+		warnl("journal: calloc");
+
+ out:
+	close(fd);
+}
+
+struct journal *
+journal_open(const char *path)
+{
+	struct journal *j;
+	struct stat sb;
+	size_t i;
+
+	if (!(j = calloc(1, sizeof(struct journal))))
+		return NULL;
+
+	for (i = 0; i < JOURNAL_BUCKETS; ++i)
+		TAILQ_INIT(&j->buckets[i]);
+
+	if ((j->fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC,
+	    0600)) == -1 || fstat(j->fd, &sb) == -1) {
+		if (j->fd != -1)
+			close(j->fd);
+		free(j);
+		return NULL;
+	}
+
+	j->size = sb.st_size;
+
+	return j;
+}
+
+void
+journal_free(struct journal **j)
+{
+	struct journal_path *p;
+	size_t i;
+
+	for (i = 0; i < JOURNAL_BUCKETS; ++i) {
+		while ((p = TAILQ_FIRST(&(*j)->buckets[i]))) {
+			TAILQ_REMOVE(&(*j)->buckets[i], p, entries);
+			free(p->path);
+			free(p);
+		}
+	}
+
+	close((*j)->fd);
+	free((*j)->buf);
+	free(*j);
+	*j = NULL;
+}
+
+/*
+ * Applies what the comment files are missing of the journal, up to the
+ * first torn or corrupt record, and checkpoints.
+ */
+bool
+journal_replay(struct journal *j, int dirfd)
+{
+	char *buf, *path, *rec;
+	uint32_t len, crc;
+	uint64_t offset;
+	uint16_t path_len;
+	size_t pos, n;
+	ssize_t got;
+
+	if (j->size == 0)
+		return true;
+
+	if (!(buf = malloc(j->size)))
+		return false;
+
+	for (pos = 0; pos < j->size; pos += got) {
+		if ((got = pread(j->fd, buf + pos, j->size - pos, pos)) <= 0) {
+			if (got == -1 && errno == EINTR) {
+				got = 0;
+				continue;
+			}
+			free(buf);
+			return false;
+		}
+	}
+
+	for (pos = 0, n = 0; j->size - pos >= JOURNAL_HEADER; ++n) {
+		rec = buf + pos;
+		memcpy(&len, rec, sizeof(len));
+		memcpy(&crc, rec + 4, sizeof(crc));
+
+		if (len < JOURNAL_CHECKED || len > j->size - pos - 8 ||
+		    journal_crc(rec + 8, len) != crc)
+			break;
+
+		memcpy(&offset, rec + 8, sizeof(offset));
+		memcpy(&path_len, rec + 16, sizeof(path_len));
+
+		if (path_len == 0 || path_len > len - JOURNAL_CHECKED ||
+		    memchr(rec + JOURNAL_HEADER, '\0', path_len))
+			break;
+
+		if (!(path = strndup(rec + JOURNAL_HEADER, path_len))) {
+			free(buf);
+			return false;
+		}
+
+		journal_apply(j, dirfd, path, offset,
+		    rec + JOURNAL_HEADER + path_len,
+		    len - JOURNAL_CHECKED - path_len);
+
+		free(path);
+		pos += 8 + len;
+	}
+
+	if (pos < j->size)
+		warnxl("journal: dropping %lu bytes after record %lu",
+		    j->size - pos, n);
+
+	msgl("journal: replayed %lu records", n);
+
+	free(buf);
+
+	return journal_checkpoint(j, dirfd);
+}
+
+/*
+ * Queues a record of len bytes of data going to offset of path.
+ */
+bool
+journal_add(struct journal *j, const char *path, uint64_t offset,
+    const char *data, size_t len)
+{
+	size_t path_len, rec_len, cap;
+	uint32_t checked_len, crc;
+	uint16_t plen;
+	char *rec;
+
+	path_len = strlen(path);
+	rec_len = JOURNAL_HEADER + path_len + len;
+
+	if (path_len == 0 || path_len > UINT16_MAX ||
+	    rec_len - 8 > UINT32_MAX) {
+		errno = EINVAL;
+		return false;
+	}
+
+	if (j->len + rec_len > j->cap) {
+		for (cap = j->cap ? j->cap : 4096; cap < j->len + rec_len;)
+			cap *= 2;
+		if (!(rec = realloc(j->buf, cap)))
+			return false;
+		j->buf = rec;
+		j->cap = cap;
+	}
+
+	if (!journal_touch(j, path))
+		return false;
+
+	rec = j->buf + j->len;
+	checked_len = rec_len - 8;
+	plen = path_len;
+
+	memcpy(rec, &checked_len, sizeof(checked_len));
+	memcpy(rec + 8, &offset, sizeof(offset));
+	memcpy(rec + 16, &plen, sizeof(plen));
+	memcpy(rec + JOURNAL_HEADER, path, path_len);
+	memcpy(rec + JOURNAL_HEADER + path_len, data, len);
+
+	crc = journal_crc(rec + 8, checked_len);
+	memcpy(rec + 4, &crc, sizeof(crc));
+
+	j->len += rec_len;
+
+	return true;
+}
+
+/*
+ * Forgets the queued records.
+ */
+void
+journal_discard(struct journal *j)
+{
+	j->len = 0;
+}
+
+/*
+ * Appends the queued records, and makes sure they're on disk if sync is set.
+ * On failure, the journal is left as it was.
+ */
+bool
+journal_commit(struct journal *j, bool sync)
+{
+	if (j->len == 0)
+		return true;
+
+	if (!journal_write(j->fd, j->buf, j->len) ||
+	    (sync && fdatasync(j->fd) == -1)) {
+		warnl("journal: write");
+		if (ftruncate(j->fd, j->size) == -1)
+			warnl("journal: ftruncate");
+		j->len = 0;
+		return false;
+	}
+
+	j->size += j->len;
+	j->len = 0;
+
+	return true;
+}
+
+bool
+journal_due(const struct journal *j)
+{
+	return j->size >= JOURNAL_CHECKPOINT_SIZE;
+}
+
+/*
+ * Syncs the comment files written since the last checkpoint, then empties
+ * the journal. Should truncating not make it to disk, replaying it again
+ * does no harm.
+ */
+bool
+journal_checkpoint(struct journal *j, int dirfd)
+{
+	struct journal_path *p;
+	size_t i;
+	int fd;
+
+	for (i = 0; i < JOURNAL_BUCKETS; ++i) {
+		while ((p = TAILQ_FIRST(&j->buckets[i]))) {
+			if ((fd = open_beneath(dirfd, p->path,
+			    O_WRONLY | O_APPEND | O_CLOEXEC)) == -1) {
+				// moved away, nothing to sync it by
+				warnl("journal: open(%s)", p->path);
+			} else if (fdatasync(fd) == -1) {
+				warnl("journal: fdatasync(%s)", p->path);
+				close(fd);
+				return false;
+			} else {
+				close(fd);
+			}
+
+			TAILQ_REMOVE(&j->buckets[i], p, entries);
+			free(p->path);
+			free(p);
+		}
+	}
+
+	if (j->size > 0 && ftruncate(j->fd, 0) == -1) {
+		warnl("journal: ftruncate");
+		return false;
+	}
+
+	dbgxl("journal: checkpoint after %lu bytes", j->size);
+
+	j->size = 0;
+
+	return true;
+}
@@ -0,0 +1,66 @@
+/**
+ * gmlgcd - the gemlog comment daemon
+ * Copyright (C) 2024 github.com/Sir-Photch
+ *
+ * This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "platform.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define JOURNAL_FILENAME		"journal"
+#define JOURNAL_BUCKETS			64
+#define JOURNAL_CHECKPOINT_SIZE		(1 << 20)	// bytes
+#define JOURNAL_CHECKPOINT_INTERVAL	60		// seconds
+
+struct journal_path {
+	char *path;
+	uint32_t hash;
+	TAILQ_ENTRY(journal_path) entries;
+};
+
+TAILQ_HEAD(journal_path_list, journal_path);
+
+/*
+ * Write-ahead log of comments, in persistent-dir. A record holds the path
+ * of a comment file, the offset the comment goes to in it and the comment
+ * itself. Records are synced before their comments are appended to the
+ * files, which in turn are only synced at checkpoints, after which the
+ * journal starts over. Replaying skips what's already in the files.
+ *
+ * On disk, a record is its length and crc32 (of what follows), the
+ * offset, the path length, the path and the comment, in host byte order.
+ */
+struct journal {
+	int fd;
+	size_t size;			// on disk
+	char *buf;			// records not yet committed
+	size_t len, cap;
+	struct journal_path_list buckets[JOURNAL_BUCKETS];	// since checkpoint
+};
+
+struct journal *journal_open(const char *);
+void            journal_free(struct journal **);
+bool            journal_replay(struct journal *, int);
+bool            journal_add(struct journal *, const char *, uint64_t,
+    const char *, size_t);
+void            journal_discard(struct journal *);
+bool            journal_commit(struct journal *, bool);
+bool            journal_due(const struct journal *);
+bool            journal_checkpoint(struct journal *, int);
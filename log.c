@@ -16,60 +16,555 @@
  *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#if defined(__linux__)
+#define _GNU_SOURCE			// sendmmsg()
+#endif
+
 #include "platform.h"
 
+#include <pthread.h>
+#include <semaphore.h>
 #include <stdarg.h>
-#ifdef DEBUG_BUILD
-#	include <errno.h>
-#endif
+#include <stdatomic.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include "log.h"
 
+#define LOG_RING_SIZE	1024		// lines, a power of two
+#define LOG_LINE_MAX	512		// longer ones are cut
+#define LOG_ENTRY_MAX	1024		// with journald fields
+#define LOG_FIELD_MAX	128		// longer values are cut
+#define LOG_OUT_MAX	(LOG_LINE_MAX + 256)	// with name and error
+#define LOG_BATCH_MAX	(16 * 1024)
+#define LOG_SEND_MAX	64		// datagrams per sendmmsg()
+
 bool __log_verbose;
+enum log_level __log_level = LOG_LEVEL_MESSAGE;
+_Thread_local struct log_context __log_context = { .rid = -1 };
 
-void
-msg(const char *fmt, ...)
+struct log_entry {
+	atomic_size_t seq;
+	enum log_level level;
+	int errnum;
+	bool native;			// data is a journald datagram
+	size_t len;
+	size_t msg;			// where the message starts, if native
+	char data[LOG_ENTRY_MAX];	// the line or a journald datagram
+};
+
+/*
+ * Lines are formatted by whoever logs them, but written out by the log
+ * thread, so a full pipe on stdout never holds up the event loops. The
+ * ring is a bounded queue after Vyukov: an entry's sequence number tells
+ * whether it's free for the producer at that position or ready for the
+ * consumer, so producers only contend on head. When the ring is full,
+ * lines are counted and dropped instead.
+ */
+static struct {
+	struct log_entry entries[LOG_RING_SIZE];
+	atomic_size_t head;		// next to claim
+	size_t tail;			// next to write out, log thread only
+	atomic_ulong dropped;
+	atomic_bool running, stopping;
+	atomic_bool native;		// lines are rendered for journald
+	int journald;			// -1 for stdout and stderr
+	sem_t ready;
+	pthread_t thread;
+} ring = { .journald = -1 };
+
+static int
+log_fd(enum log_level level)
 {
-	va_list ap;
-	va_start(ap, fmt);
+	return level <= LOG_LEVEL_WARNING ? STDERR_FILENO : STDOUT_FILENO;
+}
 
-	printf("%s: ", getprogname());
-	vprintf(fmt, ap);
-	printf("\n");
+static size_t
+log_format(char *buf, size_t size, int errnum, const char *text, size_t len)
+{
+	int n;
 
-	va_end(ap);
+	n = snprintf(buf, size, "%s: %.*s%s%s\n", getprogname(), (int)len,
+	    text, errnum != -1 ? ": " : "",
+	    errnum != -1 ? strerror(errnum) : "");
+
+	if (n < 0)
+		return 0;
+
+	return (size_t)n < size ? (size_t)n : size - 1;
 }
 
-void
-dbg(const char *fmt, ...)
+static void
+log_output(int fd, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = write(fd, buf, len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+
+		buf += n;
+		len -= n;
+	}
+}
+
+static size_t
+log_render_text(char *buf, const char *fmt, va_list ap)
+{
+	int n;
+
+	n = vsnprintf(buf, LOG_LINE_MAX, fmt, ap);
+
+	if (n < 0)
+		return 0;
+
+	return n < LOG_LINE_MAX ? (size_t)n : LOG_LINE_MAX - 1;
+}
+
+#if defined(__linux__)
+
+static int
+journald_open(const char *path)
+{
+	struct sockaddr_un sun = { .sun_family = AF_UNIX };
+	int fd;
+
+	if (strlcpy(sun.sun_path, path, sizeof(sun.sun_path)) >=
+	    sizeof(sun.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	if ((fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0)) == -1)
+		return -1;
+
+	if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+ * Appends a field in the binary form of the native protocol, which takes
+ * any value, newlines included.
+ */
+static size_t
+journald_field(char *buf, size_t size, const char *name, const char *value)
+{
+	size_t len, name_len;
+	int i;
+
+	if (!value)
+		return 0;
+
+	len = strnlen(value, LOG_FIELD_MAX);
+	name_len = strlen(name);
+
+	if (name_len + len + 10 > size)
+		return 0;
+
+	memcpy(buf, name, name_len);
+	buf[name_len] = '\n';
+	for (i = 0; i < 8; ++i)		// little endian
+		buf[name_len + 1 + i] = (uint64_t)len >> (8 * i);
+	memcpy(buf + name_len + 9, value, len);
+	buf[name_len + 9 + len] = '\n';
+
+	return name_len + len + 10;
+}
+
+/*
+ * Renders a datagram for journald: the level, the request the thread is
+ * working on and, last, the message, cut to what's left of LOG_ENTRY_MAX.
+ * *msg is set to where the message starts.
+ */
+static size_t
+journald_render(char *buf, size_t *msg, enum log_level level, int errnum,
+    const char *fmt, va_list ap)
+{
+	static const char priorities[] = { '3', '4', '6', '7' };
+	static const char message[] = "MESSAGE\n";
+	const struct log_context *ctx = &__log_context;
+	const size_t size = LOG_ENTRY_MAX;
+	size_t len, text_len, n;
+	int i, m;
+
+	len = snprintf(buf, size, "PRIORITY=%c\nSYSLOG_IDENTIFIER=%s\n",
+	    priorities[level], getprogname());
+
+	if (errnum != -1)
+		len += snprintf(buf + len, size - len, "ERRNO=%d\n", errnum);
+	if (ctx->rid != -1)
+		len += snprintf(buf + len, size - len, "REQUEST_ID=%d\n",
+		    ctx->rid);
+
+	len += journald_field(buf + len, size - len, "RHOST", ctx->rhost);
+	len += journald_field(buf + len, size - len, "SERVER_NAME",
+	    ctx->server_name);
+	len += journald_field(buf + len, size - len, "COMMENT_FILE",
+	    ctx->file);
+	len += journald_field(buf + len, size - len, "OUTCOME", ctx->outcome);
+
+	n = len + sizeof(message) - 1 + 8;
+
+	// the terminating nul makes room for the newline
+	m = vsnprintf(buf + n, size - n, fmt, ap);
+	text_len = m < 0 ? 0 : (size_t)m < size - n ? (size_t)m : size - n - 1;
+
+	if (errnum != -1 && n + text_len < size - 1) {
+		m = snprintf(buf + n + text_len, size - n - text_len, ": %s",
+		    strerror(errnum));
+		text_len += m < 0 ? 0 : (size_t)m < size - n - text_len ?
+		    (size_t)m : size - n - text_len - 1;
+	}
+
+	memcpy(buf + len, message, sizeof(message) - 1);
+	for (i = 0; i < 8; ++i)
+		buf[len + sizeof(message) - 1 + i] = (uint64_t)text_len >>
+		    (8 * i);
+	buf[n + text_len] = '\n';
+
+	*msg = n;
+	return n + text_len + 1;
+}
+
+#endif
+
+/*
+ * Writes a line of the log thread's own, in whatever form is in use.
+ */
+static void
+log_internal(enum log_level level, const char *fmt, ...)
 {
-#ifdef DEBUG_BUILD
+	char line[LOG_ENTRY_MAX], out[LOG_OUT_MAX];
 	va_list ap;
+#if defined(__linux__)
+	va_list aq;
+	size_t len, msg;
+#endif
+
 	va_start(ap, fmt);
 
-	printf("%s: ", getprogname());
-	vprintf(fmt, ap);
-	printf(":%s\n", strerror(errno));
+#if defined(__linux__)
+	if (ring.journald != -1) {
+		va_copy(aq, ap);
+		len = journald_render(line, &msg, level, -1, fmt, aq);
+		va_end(aq);
+
+		if (send(ring.journald, line, len, 0) != -1) {
+			va_end(ap);
+			return;
+		}
+	}
+#endif
+
+	log_output(log_fd(level), out, log_format(out, sizeof(out), -1,
+	    line, log_render_text(line, fmt, ap)));
 
 	va_end(ap);
+}
+
+static struct log_entry *
+log_ready(size_t pos)
+{
+	struct log_entry *e = &ring.entries[pos & (LOG_RING_SIZE - 1)];
+
+	if (atomic_load_explicit(&e->seq, memory_order_acquire) != pos + 1)
+		return NULL;
+
+	return e;
+}
+
+static void
+log_release(struct log_entry *e)
+{
+	atomic_store_explicit(&e->seq, ring.tail + LOG_RING_SIZE,
+	    memory_order_release);
+	ring.tail++;
+}
+
+static void
+log_drain_text(void)
+{
+	static char out[LOG_BATCH_MAX];
+	struct log_entry *e;
+	size_t len = 0;
+	int fd = -1;
+
+	while ((e = log_ready(ring.tail))) {
+		if (len > 0 && (log_fd(e->level) != fd ||
+		    sizeof(out) - len < LOG_OUT_MAX)) {
+			log_output(fd, out, len);
+			len = 0;
+		}
+
+		fd = log_fd(e->level);
+		if (e->native)	// rendered before falling back
+			len += log_format(out + len, sizeof(out) - len, -1,
+			    e->data + e->msg, e->len - e->msg - 1);
+		else
+			len += log_format(out + len, sizeof(out) - len,
+			    e->errnum, e->data, e->len);
+
+		log_release(e);
+	}
+
+	if (len > 0)
+		log_output(fd, out, len);
+}
+
+#if defined(__linux__)
+
+/*
+ * Gives up on journald for good, the rest is written to stdout and stderr.
+ */
+static void
+log_journald_lost(int errnum)
+{
+	close(ring.journald);
+	ring.journald = -1;
+	atomic_store(&ring.native, false);
+
+	log_internal(LOG_LEVEL_WARNING,
+	    "[WRN %s()]: journald: %s, logging to stdout instead", __func__,
+	    strerror(errnum));
+}
+
+/*
+ * Returns false if journald is gone, the rest is up to log_drain_text().
+ */
+static bool
+log_drain_journald(void)
+{
+	struct mmsghdr msgs[LOG_SEND_MAX];
+	struct iovec iov[LOG_SEND_MAX];
+	struct log_entry *e;
+	size_t i, n, j;
+	int sent, lost;
+
+	lost = 0;
+
+	do {
+		memset(msgs, 0, sizeof(msgs));
+
+		for (n = 0; n < LOG_SEND_MAX && (e = log_ready(ring.tail + n));
+		    ++n) {
+			iov[n].iov_base = e->data;
+			iov[n].iov_len = e->len;
+			msgs[n].msg_hdr.msg_iov = &iov[n];
+			msgs[n].msg_hdr.msg_iovlen = 1;
+		}
+
+		for (i = 0; i < n && !lost; i += sent) {
+			if ((sent = sendmmsg(ring.journald, msgs + i, n - i,
+			    0)) != -1)
+				continue;
+
+			sent = 0;
+
+			if (errno == EAGAIN || errno == ENOBUFS ||
+			    errno == EMSGSIZE) {
+				// skip the one that failed
+				sent = 1;
+				atomic_fetch_add(&ring.dropped, 1);
+			} else if (errno != EINTR) {
+				lost = errno;
+			}
+		}
+
+		// what's left is written out as text
+		for (j = 0; j < i; ++j)
+			log_release(&ring.entries[ring.tail &
+			    (LOG_RING_SIZE - 1)]);
+	} while (n == LOG_SEND_MAX && !lost);
+
+	if (lost) {
+		log_journald_lost(lost);
+		return false;
+	}
+
+	return true;
+}
+
+#endif
+
+/*
+ * Writes out what's ready, in as few writes as possible.
+ */
+static void
+log_drain(void)
+{
+	unsigned long dropped;
+
+	if ((dropped = atomic_exchange(&ring.dropped, 0)) > 0)
+		log_internal(LOG_LEVEL_WARNING, "[WRN %s()]: %lu lines dropped",
+		    __func__, dropped);
+
+#if defined(__linux__)
+	if (ring.journald != -1 && log_drain_journald())
+		return;
+#endif
+
+	log_drain_text();
+}
+
+static void *
+log_loop(void *arg)
+{
+	(void)arg;
+
+	while (!atomic_load(&ring.stopping)) {
+		while (sem_wait(&ring.ready) == -1 && errno == EINTR)
+			;
+
+		log_drain();
+	}
+
+	return NULL;
+}
+
+/*
+ * journald_socket is the path of journald's native socket, or NULL to log
+ * to stdout and stderr. The latter is also what's used if it's missing,
+ * or once journald stops taking lines.
+ */
+void
+log_start(const char *journald_socket)
+{
+	size_t i;
+
+	if (journald_socket) {
+#if defined(__linux__)
+		if ((ring.journald = journald_open(journald_socket)) == -1)
+			warnl("%s, logging to stdout instead", journald_socket);
+		else
+			atomic_store(&ring.native, true);
 #else
-	(void)fmt;
+		warnxl("no journald here, logging to stdout instead");
 #endif
+	}
+
+	for (i = 0; i < LOG_RING_SIZE; ++i)
+		atomic_init(&ring.entries[i].seq, i);
+
+	if (sem_init(&ring.ready, 0, 0) == -1)
+		errl(1, "sem_init");
+
+	if ((errno = pthread_create(&ring.thread, NULL, log_loop, NULL)) != 0)
+		errl(1, "pthread_create");
+
+	atomic_store(&ring.running, true);
+
+	// for errl() and friends
+	atexit(log_stop);
+}
+
+/*
+ * Writes out what's left. Lines logged afterwards are written right away.
+ */
+void
+log_stop(void)
+{
+	if (!atomic_load(&ring.running))
+		return;
+
+	atomic_store(&ring.stopping, true);
+	sem_post(&ring.ready);
+	pthread_join(ring.thread, NULL);
+
+	atomic_store(&ring.running, false);
+	log_drain();
+
+	sem_destroy(&ring.ready);
+
+	if (ring.journald != -1) {
+		close(ring.journald);
+		ring.journald = -1;
+	}
 }
 
 void
-dbgx(const char *fmt, ...)
+log_context_reset(void)
 {
-#ifdef DEBUG_BUILD
+	memset(&__log_context, 0, sizeof(__log_context));
+	__log_context.rid = -1;
+}
+
+static struct log_entry *
+log_claim(size_t *pos)
+{
+	struct log_entry *e;
+	size_t seq;
+
+	*pos = atomic_load_explicit(&ring.head, memory_order_relaxed);
+
+	for (;;) {
+		e = &ring.entries[*pos & (LOG_RING_SIZE - 1)];
+		seq = atomic_load_explicit(&e->seq, memory_order_acquire);
+
+		if (seq == *pos) {
+			if (atomic_compare_exchange_weak_explicit(&ring.head,
+			    pos, *pos + 1, memory_order_relaxed,
+			    memory_order_relaxed))
+				return e;
+		} else if ((ssize_t)(seq - *pos) < 0)
+			return NULL;	// not written out yet, full
+		else
+			*pos = atomic_load_explicit(&ring.head,
+			    memory_order_relaxed);
+	}
+}
+
+void
+log_emit(enum log_level level, int errnum, const char *fmt, ...)
+{
+	char line[LOG_LINE_MAX], out[LOG_OUT_MAX];
+	struct log_entry *e;
 	va_list ap;
+	size_t pos;
+
 	va_start(ap, fmt);
 
-	printf("%s: ", getprogname());
-	vprintf(fmt, ap);
-	printf("\n");
+	if (atomic_load_explicit(&ring.running, memory_order_acquire)) {
+		if ((e = log_claim(&pos))) {
+			e->native = atomic_load_explicit(&ring.native,
+			    memory_order_relaxed);
+#if defined(__linux__)
+			if (e->native)
+				e->len = journald_render(e->data, &e->msg,
+				    level, errnum, fmt, ap);
+			else
+#endif
+				e->len = log_render_text(e->data, fmt, ap);
+			e->level = level;
+			e->errnum = errnum;
+
+			atomic_store_explicit(&e->seq, pos + 1,
+			    memory_order_release);
+			sem_post(&ring.ready);
+
+			va_end(ap);
+			return;
+		}
+
+		// errors are worth the wait, they end the program anyway
+		if (level != LOG_LEVEL_ERROR) {
+			atomic_fetch_add(&ring.dropped, 1);
+			va_end(ap);
+			return;
+		}
+	}
+
+	log_output(log_fd(level), out, log_format(out, sizeof(out), errnum,
+	    line, log_render_text(line, fmt, ap)));
 
 	va_end(ap);
-#else
-	(void)fmt;
-#endif
 }
@@ -20,73 +20,118 @@
 
 #include "platform.h"
 
+#include <errno.h>
 #include <stdbool.h>
 
+enum log_level {
+	LOG_LEVEL_ERROR, LOG_LEVEL_WARNING, LOG_LEVEL_MESSAGE, LOG_LEVEL_DEBUG
+};
+
+/*
+ * The request a thread is working on, for journald to keep in fields of
+ * their own. Strings must outlive the lines logged while they're set.
+ */
+struct log_context {
+	int rid;			// -1 for none
+	const char *rhost;
+	const char *server_name;
+	const char *file;
+	const char *outcome;
+};
+
 extern bool __log_verbose;
+extern enum log_level __log_level;
+extern _Thread_local struct log_context __log_context;
 
-void msg(const char *, ...)
-	__attribute__((__format__(__printf__, 1, 2)));
+void log_start(const char *);
+void log_stop(void);
+void log_context_reset(void);
 
-void dbg(const char *, ...)
-	__attribute__((__format__(__printf__, 1, 2)));
+/*
+ * errnum is appended as by strerror(), if not -1. Lines are queued for the
+ * log thread once it's started, and dropped when it falls behind.
+ */
+void log_emit(enum log_level, int, const char *, ...)
+	__attribute__((__format__(__printf__, 3, 4)));
 
-void dbgx(const char *, ...)
-	__attribute__((__format__(__printf__, 1, 2)));
+#ifdef DEBUG_BUILD
+#define LOG_ENABLED(level) (__log_level >= (level))
+#else
+#define LOG_ENABLED(level) ((level) < LOG_LEVEL_DEBUG && __log_level >= (level))
+#endif
 
 #define warnl(fmt, ...) do {						\
-    if (__log_verbose) warn("[WRN %s:%d %s()]: " fmt, __FILE_NAME__, __LINE__, __func__, ##__VA_ARGS__);\
-    else warn("[WRN %s()]: " fmt, __func__, ##__VA_ARGS__);		\
+    if (!LOG_ENABLED(LOG_LEVEL_WARNING)) break;				\
+    if (__log_verbose) log_emit(LOG_LEVEL_WARNING, errno, "[WRN %s:%d %s()]: " fmt, __FILE_NAME__, __LINE__, __func__, ##__VA_ARGS__);\
+    else log_emit(LOG_LEVEL_WARNING, errno, "[WRN %s()]: " fmt, __func__, ##__VA_ARGS__);\
 } while (0)
 
 #define warnxl(fmt, ...) do {						\
-    if (__log_verbose) warnx("[WRN %s:%d %s()]: " fmt, __FILE_NAME__, __LINE__, __func__, ##__VA_ARGS__);\
-    else warnx("[WRN %s()]: " fmt, __func__, ##__VA_ARGS__);		\
+    if (!LOG_ENABLED(LOG_LEVEL_WARNING)) break;				\
+    if (__log_verbose) log_emit(LOG_LEVEL_WARNING, -1, "[WRN %s:%d %s()]: " fmt, __FILE_NAME__, __LINE__, __func__, ##__VA_ARGS__);\
+    else log_emit(LOG_LEVEL_WARNING, -1, "[WRN %s()]: " fmt, __func__, ##__VA_ARGS__);\
 } while (0)
 
 #define errl(status, fmt, ...) do {					\
-    if (__log_verbose) err(status, "[%s:%d %s()]: " fmt, __FILE_NAME__, __LINE__, __func__, ##__VA_ARGS__);\
-    else err(status, "[%s()]: " fmt, __func__, ##__VA_ARGS__);		\
+    if (__log_verbose) log_emit(LOG_LEVEL_ERROR, errno, "[%s:%d %s()]: " fmt, __FILE_NAME__, __LINE__, __func__, ##__VA_ARGS__);\
+    else log_emit(LOG_LEVEL_ERROR, errno, "[%s()]: " fmt, __func__, ##__VA_ARGS__);\
+    exit(status);							\
 } while (0)
 
 #define errxl(status, fmt, ...) do {					\
-    if (__log_verbose) errx(status, "[%s:%d %s()]: " fmt, __FILE_NAME__, __LINE__, __func__, ##__VA_ARGS__);\
-    else errx(status, "[%s()]: " fmt, __func__, ##__VA_ARGS__);		\
+    if (__log_verbose) log_emit(LOG_LEVEL_ERROR, -1, "[%s:%d %s()]: " fmt, __FILE_NAME__, __LINE__, __func__, ##__VA_ARGS__);\
+    else log_emit(LOG_LEVEL_ERROR, -1, "[%s()]: " fmt, __func__, ##__VA_ARGS__);\
+    exit(status);							\
 } while (0)
 
 #define msgl(fmt, ...) do {						\
-    if (__log_verbose) msg("[MSG %s:%d %s()]: " fmt, __FILE_NAME__, __LINE__, __func__, ##__VA_ARGS__);\
-    else msg("[MSG %s()]: " fmt, __func__, ##__VA_ARGS__);		\
+    if (!LOG_ENABLED(LOG_LEVEL_MESSAGE)) break;				\
+    if (__log_verbose) log_emit(LOG_LEVEL_MESSAGE, -1, "[MSG %s:%d %s()]: " fmt, __FILE_NAME__, __LINE__, __func__, ##__VA_ARGS__);\
+    else log_emit(LOG_LEVEL_MESSAGE, -1, "[MSG %s()]: " fmt, __func__, ##__VA_ARGS__);\
 } while (0)
 
 #define warnli(msgid, fmt, ...) do {					\
-    if (__log_verbose) warn("[WRN #%d %s:%d %s()]: " fmt, msgid, __FILE_NAME__, __LINE__, __func__, ##__VA_ARGS__);\
-    else warn("[WRN #%d %s()]: " fmt, msgid, __func__, ##__VA_ARGS__);	\
+    if (!LOG_ENABLED(LOG_LEVEL_WARNING)) break;				\
+    if (__log_verbose) log_emit(LOG_LEVEL_WARNING, errno, "[WRN #%d %s:%d %s()]: " fmt, msgid, __FILE_NAME__, __LINE__, __func__, ##__VA_ARGS__);\
+    else log_emit(LOG_LEVEL_WARNING, errno, "[WRN #%d %s()]: " fmt, msgid, __func__, ##__VA_ARGS__);\
 } while (0)
 
 #define warnxli(msgid, fmt, ...) do {					\
-    if (__log_verbose) warnx("[WRN #%d %s:%d %s()]: " fmt, msgid, __FILE_NAME__, __LINE__, __func__, ##__VA_ARGS__);\
-    else warnx("[WRN #%d %s()]: " fmt, msgid, __func__, ##__VA_ARGS__);	\
+    if (!LOG_ENABLED(LOG_LEVEL_WARNING)) break;				\
+    if (__log_verbose) log_emit(LOG_LEVEL_WARNING, -1, "[WRN #%d %s:%d %s()]: " fmt, msgid, __FILE_NAME__, __LINE__, __func__, ##__VA_ARGS__);\
+    else log_emit(LOG_LEVEL_WARNING, -1, "[WRN #%d %s()]: " fmt, msgid, __func__, ##__VA_ARGS__);\
 } while (0)
 
 #define errli(msgid, status, fmt, ...) do {				\
-    if (__log_verbose) err(status, "[#%d %s:%d %s()]: " fmt, msgid, __FILE_NAME__, __LINE__, __func__, ##__VA_ARGS__);\
-    else err(status, "[#%d %s()]: " fmt, msgid, __func__, ##__VA_ARGS__);\
+    if (__log_verbose) log_emit(LOG_LEVEL_ERROR, errno, "[#%d %s:%d %s()]: " fmt, msgid, __FILE_NAME__, __LINE__, __func__, ##__VA_ARGS__);\
+    else log_emit(LOG_LEVEL_ERROR, errno, "[#%d %s()]: " fmt, msgid, __func__, ##__VA_ARGS__);\
+    exit(status);							\
 } while (0)
 
 #define errxli(msgid, status, fmt, ...) do {				\
-    if (__log_verbose) errx(status, "[#%d %s:%d %s()]: " fmt, msgid, __FILE_NAME__, __LINE__, __func__, ##__VA_ARGS__);\
-    else errx(status, "[#%d %s()]: " fmt, msgid, __func__, ##__VA_ARGS__);\
+    if (__log_verbose) log_emit(LOG_LEVEL_ERROR, -1, "[#%d %s:%d %s()]: " fmt, msgid, __FILE_NAME__, __LINE__, __func__, ##__VA_ARGS__);\
+    else log_emit(LOG_LEVEL_ERROR, -1, "[#%d %s()]: " fmt, msgid, __func__, ##__VA_ARGS__);\
+    exit(status);							\
 } while (0)
 
 #define msgli(msgid, fmt, ...) do {					\
-    if (__log_verbose) msg("[MSG #%d %s:%d %s()]: " fmt, msgid, __FILE_NAME__, __LINE__, __func__, ##__VA_ARGS__);\
-    else msg("[MSG #%d %s()]: " fmt, msgid, __func__, ##__VA_ARGS__);	\
+    if (!LOG_ENABLED(LOG_LEVEL_MESSAGE)) break;				\
+    if (__log_verbose) log_emit(LOG_LEVEL_MESSAGE, -1, "[MSG #%d %s:%d %s()]: " fmt, msgid, __FILE_NAME__, __LINE__, __func__, ##__VA_ARGS__);\
+    else log_emit(LOG_LEVEL_MESSAGE, -1, "[MSG #%d %s()]: " fmt, msgid, __func__, ##__VA_ARGS__);\
 } while (0)
 
-#define dbgxl(fmt, ...) dbgx("[DBG %s()]: " fmt, __func__, ##__VA_ARGS__)
+#define dbgxl(fmt, ...) do {						\
+    if (LOG_ENABLED(LOG_LEVEL_DEBUG)) log_emit(LOG_LEVEL_DEBUG, -1, "[DBG %s()]: " fmt, __func__, ##__VA_ARGS__);\
+} while (0)
 
-#define dbgxli(msgid, fmt, ...) dbgx("[DBG #%d %s()]: " fmt, msgid, __func__, ##__VA_ARGS__)
+#define dbgxli(msgid, fmt, ...) do {					\
+    if (LOG_ENABLED(LOG_LEVEL_DEBUG)) log_emit(LOG_LEVEL_DEBUG, -1, "[DBG #%d %s()]: " fmt, msgid, __func__, ##__VA_ARGS__);\
+} while (0)
 
-#define dbgl(fmt, ...) dbg("[DBG %s()]: " fmt, __func__, ##__VA_ARGS__)
+#define dbgl(fmt, ...) do {						\
+    if (LOG_ENABLED(LOG_LEVEL_DEBUG)) log_emit(LOG_LEVEL_DEBUG, errno, "[DBG %s()]: " fmt, __func__, ##__VA_ARGS__);\
+} while (0)
 
-#define dbgli(msgid, fmt, ...) dbg("[DBG #%d %s()]: " fmt, msgid, __func__, ##__VA_ARGS__)
+#define dbgli(msgid, fmt, ...) do {					\
+    if (LOG_ENABLED(LOG_LEVEL_DEBUG)) log_emit(LOG_LEVEL_DEBUG, errno, "[DBG #%d %s()]: " fmt, msgid, __func__, ##__VA_ARGS__);\
+} while (0)
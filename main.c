@@ -21,8 +21,10 @@
 #include <sys/socket.h>
 #include <sys/uio.h>
 #include <sys/un.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <event2/bufferevent.h>
 #include <event2/event.h>
 #include <event2/util.h>
@@ -33,78 +35,194 @@
 #include <arpa/inet.h>
 
 #include "comment.h"
+#include "dirindex.h"
 #include "fcgi.h"
 #include "log.h"
+#include "metrics.h"
+#include "probes.h"
 #include "quarantine.h"
 #include "replies.h"
 #include "appstate.h"
 #include "sandbox.h"
 #include "util.h"
+#include "writer.h"
 #include "config.h"
 
 #define PROJECT_NAME 	"gmlgcd"
 #define SOCK_FILE 		"fcgi.sock"
-#define MAX_LINE     	(2 << 14)
+#define READ_HIGHWATER    	(2 * FCGI_RECORD_MAX)
+
+#if defined(__linux__) && defined(SO_REUSEPORT)
+#	define LISTEN_REUSEPORT
+#endif
+
+struct connection {
+	struct bufferevent *bev;
+	struct worker *w;
+	struct fcgi_request_table requests;
+	uint64_t unflushed;		// metrics_now() of the oldest reply
+					// not flushed yet, 0 if none
+	bool close_when_idle;
+	bool closing;
+};
+
+static void comment_written(bool, void *, void *);
 
 static bool
 check_url_path(const char *gemini_url_path, unsigned short rid,
-    char *commenting_path, size_t cpath_len, const char **requested_file,
-    const char **errstr, const struct config *cfg)
+    const char **requested_file, const char **errstr,
+    struct dirindex *index)
 {
 	const char *slash;
 
 	if (!(slash = strchr(gemini_url_path, '/'))) {
+		__log_context.outcome = "invalid";
 		warnxli(rid, "bad GEMINI_URL_PATH: %s", gemini_url_path);
 
 		*errstr = BAD_REQUEST;
 		return false;
 	}
 
-	if (!path_combine(commenting_path, cpath_len, cfg->comments_dir,
-	    (*requested_file = slash) + 1)) {
-		warnxli(rid, "requested path exceeds %lu: %s", cpath_len,
-		    *requested_file);
-
-		*errstr = BAD_REQUEST;
-		return false;
-	}
+	*requested_file = slash;
+	__log_context.file = slash;
 
 	msgli(rid, "requesting %s", *requested_file);
 
-	if (access(commenting_path, F_OK) != 0) {
-		msgli(rid, "Commentfile not available: %s", commenting_path);
+	switch (dirindex_lookup(index, *requested_file + 1)) {
+	case DIRINDEX_MISSING:
+		__log_context.outcome = "unavailable";
+		msgli(rid, "Commentfile not available: %s", *requested_file);
 
 		*errstr = COMMENTS_NOT_ENABLED;
 		return false;
-	}
-
-	if (access(commenting_path, W_OK) != 0) {
-		msgli(rid, "Commentfile not writeable: %s", commenting_path);
+	case DIRINDEX_READONLY:
+		__log_context.outcome = "unavailable";
+		msgli(rid, "Commentfile not writeable: %s", *requested_file);
 
 		*errstr = COMMENTS_NOT_ALLOWED;
 		return false;
+	case DIRINDEX_WRITABLE:
+		break;
 	}
 
 	*errstr = NULL;
 	return true;
 }
 
+/*
+ * Returns the quarantine entry of a user, adding one if there's none yet.
+ * The lock of the shard has to be held.
+ */
+static struct quarantine_entry *
+track_user(struct quarantine_list *q, const struct user_id *id, time_t now,
+    uint32_t tick)
+{
+	struct quarantine_entry *qent;
+
+	if (!(qent = quarantine_get_entry(q, id))) {
+		qent = quarantine_add(q, id, now);
+		qent->post_tat = qent->failure_tat = tick;
+	}
+
+	quarantine_touch(q, qent, now);
+
+	return qent;
+}
+
+static void
+record_failure(const struct config *cfg, struct quarantine_shard *shard,
+    const struct user_id *id, time_t now, uint32_t tick)
+{
+	struct quarantine_entry *qent;
+	struct quarantine_prefix *prefix;
+
+	pthread_mutex_lock(&shard->lock);
+
+	qent = track_user(shard->list, id, now, tick);
+	qent->failures++;
+
+	ratelimit_take(&cfg->comment.failure_limit, &qent->failure_tat, tick);
+
+	if ((prefix = quarantine_add_prefix(shard->list, id, tick)))
+		ratelimit_take(&cfg->comment.prefix_failure_limit,
+		    &prefix->failure_tat, tick);
+
+	pthread_mutex_unlock(&shard->lock);
+}
+
+/*
+ * Takes a token from the post buckets of a user and their network, from
+ * both or from neither.
+ */
 static bool
-generate_response(struct evbuffer *out, unsigned short rid,
-    struct fcgi_params_head *params, struct appstate *s)
+take_post(const struct config *cfg, struct quarantine_shard *shard,
+    const struct user_id *id, time_t now, uint32_t tick)
 {
-	char commenting_path[PATH_MAX + 1];
+	struct quarantine_entry *qent;
+	struct quarantine_prefix *prefix;
+	bool allowed;
+
+	pthread_mutex_lock(&shard->lock);
+
+	qent = track_user(shard->list, id, now, tick);
+	prefix = quarantine_add_prefix(shard->list, id, tick);
+
+	if ((allowed = ratelimit_allows(&cfg->comment.post_limit,
+	    qent->post_tat, tick) && (!prefix ||
+	    ratelimit_allows(&cfg->comment.prefix_post_limit,
+	    prefix->post_tat, tick)))) {
+		ratelimit_take(&cfg->comment.post_limit, &qent->post_tat,
+		    tick);
+		if (prefix)
+			ratelimit_take(&cfg->comment.prefix_post_limit,
+			    &prefix->post_tat, tick);
+
+		qent->failures = 0;
+	}
+
+	pthread_mutex_unlock(&shard->lock);
+
+	return allowed;
+}
+
+/*
+ * Writes a reply to a request, counting it by its status code.
+ */
+static bool
+respond(struct connection *c, struct fcgi_request *req, const char *reply,
+    size_t len)
+{
+	metrics_reply(c->w->metrics, reply);
+
+	if (c->unflushed == 0)
+		c->unflushed = metrics_now();
+
+	return fcgi_write_stdout(bufferevent_get_output(c->bev), req->rid,
+	    reply, len);
+}
+
+/*
+ * Answers a request. Replies to comments are deferred until the comment
+ * has been written, *deferred is set in that case.
+ */
+static bool
+generate_response(struct connection *c, struct fcgi_request *req,
+    bool *deferred)
+{
+	struct cgi_params *cgi = &req->cgi;
+	struct worker *w = c->w;
+	struct appstate *s = w->state;
+	unsigned short rid = req->rid;
 	char formatted_comment[COMMENTS_MAX];
-	char redirection_reply[512];
+	struct quarantine_shard *shard;
 	struct quarantine_entry *qent;
-	struct fcgi_params_entry *p;
+	struct quarantine_prefix *prefix;
 	struct user_input user;
-	const char *errstr;
-	FILE *f;
+	uint8_t key[RADIX_KEY_BITS / 8];
+	const char *colon, *errstr, *method, *network, *proto;
 	time_t now;
-	double expired_min;
-	size_t body_len, hash_len;
-	int commenting_fd;
+	uint32_t failures, tick;
+	size_t comment_len, hash_len;
 
 	const char *server_name = NULL,
 		   *gemini_url_path = NULL,
@@ -113,58 +231,45 @@ generate_response(struct evbuffer *out, unsigned short rid,
 		   *hash = NULL;
 
 	bool valid_proto = false,
-	     valid_request = false;
+	     valid_request = false,
+	     user_limited, network_limited;
 
-	memset(commenting_path, 0, sizeof(commenting_path));
 	memset(&user, 0, sizeof(user));
 
-	TAILQ_FOREACH(p, params, entries) {
-		if (!rhost &&
-		    (strcmp("REMOTE_ADDR", p->name) == 0 ||
-		     strcmp("REMOTE_HOST", p->name) == 0)) {
-			rhost = p->value;
-			if (inet_pton(AF_INET, rhost, &user.id.rhost.v4) == 1)
-				user.id.af = AF_INET;
-			else if (inet_pton(AF_INET6, rhost,
-			    &user.id.rhost.v6) == 1)
-				user.id.af = AF_INET6;
-			else
-				rhost = NULL;
-		} else if (!valid_proto &&
-		    strcmp("SERVER_PROTOCOL", p->name) == 0) {
-			valid_proto = strcmp("GEMINI", p->value) == 0;
-		} else if (!valid_request &&
-		    strcmp("REQUEST_METHOD", p->name) == 0) {
-			valid_request = strcmp("GET", p->value) == 0;
-		} else if (commenting_path[0] == '\0' &&
-		    strcmp("GEMINI_URL_PATH", p->name) == 0) {
-			gemini_url_path = p->value;
-		} else if (!user.gemini_search_string &&
-		    strcmp("GEMINI_SEARCH_STRING", p->name) == 0) {
-			user.gemini_search_string = p->value;
-		} else if (!server_name &&
-		    strcmp("SERVER_NAME", p->name) == 0) {
-			server_name = p->value;
-		} else if (!user.name &&
-		    strcmp("REMOTE_USER", p->name) == 0) {
-			user.name = p->value;
-		} else if (!hash &&
-		    strcmp("TLS_CLIENT_HASH", p->name) == 0) {
-			// strip 'SHA256:'
-			if ((hash = strchr(p->value, ':')))
-				hash += 1;
-			else
-				hash = p->value;
-
-			if ((hash_len = strlcpy(user.id.hash, hash,
-			    USER_HASH_LEN)) < USER_HASH_LEN - 1) {
-				warnxli(rid, "very short hash: %s", hash);
-				hash = NULL;
-			}
+	if ((rhost = cgi->vars[CGI_REMOTE_ADDR].value) &&
+	    inet_pton(AF_INET, rhost, &user.id.rhost.v4) == 1)
+		user.id.af = AF_INET;
+	else if (rhost && inet_pton(AF_INET6, rhost, &user.id.rhost.v6) == 1)
+		user.id.af = AF_INET6;
+	else if ((rhost = cgi->vars[CGI_REMOTE_HOST].value) &&
+	    inet_pton(AF_INET, rhost, &user.id.rhost.v4) == 1)
+		user.id.af = AF_INET;
+	else if (rhost && inet_pton(AF_INET6, rhost, &user.id.rhost.v6) == 1)
+		user.id.af = AF_INET6;
+	else
+		rhost = NULL;
+
+	valid_proto = (proto = cgi->vars[CGI_SERVER_PROTOCOL].value) &&
+	    strcmp("GEMINI", proto) == 0;
+	valid_request = (method = cgi->vars[CGI_REQUEST_METHOD].value) &&
+	    strcmp("GET", method) == 0;
+
+	gemini_url_path = cgi->vars[CGI_GEMINI_URL_PATH].value;
+	user.gemini_search_string = cgi->vars[CGI_GEMINI_SEARCH_STRING].value;
+	user.gemini_search_string_len = cgi->vars[CGI_GEMINI_SEARCH_STRING].len;
+	server_name = cgi->vars[CGI_SERVER_NAME].value;
+	user.name = cgi->vars[CGI_REMOTE_USER].value;
+
+	if ((hash = cgi->vars[CGI_TLS_CLIENT_HASH].value)) {
+		// strip 'SHA256:'
+		if ((colon = strchr(hash, ':')))
+			hash = colon + 1;
+
+		if ((hash_len = strlcpy(user.id.hash, hash,
+		    USER_HASH_LEN)) < USER_HASH_LEN - 1) {
+			warnxli(rid, "very short hash: %s", hash);
+			hash = NULL;
 		}
-//		  else if (strcmp("TLS_CLIENT_NOT_BEFORE", p->name) == 0) {
-//			bool success = strptime(p->value, "%FT%TZ", &tm);
-//		}
 	}
 
 	if (!rhost) {
@@ -177,6 +282,9 @@ generate_response(struct evbuffer *out, unsigned short rid,
 		return false;
 	}
 
+	__log_context.rhost = rhost;
+	__log_context.server_name = server_name;
+
 	msgli(rid, "request from %s via %s", rhost, server_name);
 
 	if (!valid_proto) {
@@ -189,314 +297,641 @@ generate_response(struct evbuffer *out, unsigned short rid,
 		return false;
 	}
 
+	if ((network = radix_match(&s->cfg.blocked, key, radix_addr_key(key,
+	    user.id.af, &user.id.rhost) + (user.id.af == AF_INET ? 32 : 128)))) {
+		__log_context.outcome = "blocked";
+		msgli(rid, "blocked: %s", network);
+		return respond(c, req, BLOCKED, strlen(BLOCKED));
+	}
+
 	if (!hash && s->cfg.comment.auth == REQUIRE_CERT) {
+		__log_context.outcome = "certificate-required";
 		msgli(rid, "missing certificate");
-		return fcgi_write_stdout(out, rid, CERTIFICATE_REQUIRED,
+		return respond(c, req, CERTIFICATE_REQUIRED,
 		    sizeof(CERTIFICATE_REQUIRED));
 	}
 
-	if (hash) {
-		qent = quarantine_get_entry(s->quarantine, user.id);
-		time(&now);
-	}
+	// anonymous users are told apart by their address only
+	if (!hash)
+		memset(user.id.hash, 0, sizeof(user.id.hash));
 
-	if (qent) {
-		expired_min = difftime(now,
-		    qent->last_failure) / 60.0;
+	timecache_update(&w->clock);
+	now = w->clock.now;
+	tick = w->clock.tick;
 
-		if (qent->failures > 5 && expired_min < 5.0) {
-			qent->last_failure = now;
-			qent->failures++;
+	shard = quarantine_shard(s->quarantine, s->cfg.workers, &user.id);
 
-			msgli(rid, "ratelimited: %lu failures",
-			    qent->failures);
+	pthread_mutex_lock(&shard->lock);
 
-			return fcgi_write_stdout(out, rid, SLOW_DOWN,
-			    sizeof(SLOW_DOWN));
-		}
+	if ((qent = quarantine_get_entry(shard->list, &user.id)))
+		metrics_add(w->metrics, quarantine_hits, 1);
+
+	PROBE2(quarantine_lookup, rid, qent != NULL);
+
+	failures = qent ? qent->failures : 0;
+	user_limited = qent && !ratelimit_allows(
+	    &s->cfg.comment.failure_limit, qent->failure_tat, tick);
+	network_limited = (prefix = quarantine_get_prefix(shard->list,
+	    &user.id)) && !ratelimit_allows(
+	    &s->cfg.comment.prefix_failure_limit, prefix->failure_tat, tick);
+
+	pthread_mutex_unlock(&shard->lock);
+
+	if (user_limited) {
+		__log_context.outcome = "ratelimited";
+		msgli(rid, "ratelimited: %lu failures",
+		    (unsigned long)failures);
+
+		return respond(c, req, SLOW_DOWN, strlen(SLOW_DOWN));
 	}
 
-	if (!check_url_path(gemini_url_path, rid, commenting_path,
-	    sizeof(commenting_path), &requested_file, &errstr, &s->cfg)) {
-		if (hash) {
-			if (!qent)
-				qent = quarantine_add(s->quarantine, &user.id);
+	if (network_limited) {
+		__log_context.outcome = "ratelimited";
+		msgli(rid, "ratelimited: too many failures from network");
 
-			qent->last_failure = now;
-			qent->failures++;
-		}
+		return respond(c, req, SLOW_DOWN, strlen(SLOW_DOWN));
+	}
+
+	if (!check_url_path(gemini_url_path, rid, &requested_file, &errstr,
+	    s->index)) {
+		record_failure(&s->cfg, shard, &user.id, now, tick);
 
-		return fcgi_write_stdout(out, rid, errstr, strlen(errstr));
+		return respond(c, req, errstr, strlen(errstr));
 	}
 
+	// format_comment() only logs why it rejects a comment
+	__log_context.outcome = "rejected";
+
 	errstr = NULL;
 	if (user.gemini_search_string &&
-	    format_comment(formatted_comment, &s->cfg, rid, user,
-	    s->cfg.comment.allow_links, &errstr)) {
-		if ((commenting_fd = open(commenting_path,
-		    O_WRONLY | O_APPEND)) == -1) {
-			errli(rid, 1, "open(%s, O_WRONLY | O_APPEND)",
-			    commenting_path);
+	    format_comment(formatted_comment, &comment_len, &s->cfg,
+	    &w->clock, rid, user, s->cfg.comment.allow_links, &errstr)) {
+		if (!take_post(&s->cfg, shard, &user.id, now, tick)) {
+			__log_context.outcome = "ratelimited";
+			msgli(rid, "ratelimited: posting too fast");
+
+			return respond(c, req, SLOW_DOWN, strlen(SLOW_DOWN));
 		}
 
-		f = fdopen(commenting_fd, "a");
-		if (!f)
-			errli(rid, 1, "fdopen");
+		if (!writer_append(w->writer, requested_file + 1,
+		    formatted_comment, comment_len, comment_written, c, req)) {
+			__log_context.outcome = "failed";
+			warnxli(rid, "writer_append");
+			return false;
+		}
 
-		fputs(formatted_comment, f);
+		req->queued = metrics_now();
 
-		fclose(f);
-		commenting_fd = -1;
+		__log_context.outcome = "queued";
+		msgli(rid, "queued %lu bytes", comment_len);
 
-		msgli(rid, "Wrote %lu bytes",
-		    strnlen(formatted_comment, COMMENTS_MAX));
+		*deferred = true;
+		return true;
+	}
 
-		memset(redirection_reply, 0, sizeof(redirection_reply));
+	if (errstr) {
+		record_failure(&s->cfg, shard, &user.id, now, tick);
 
-		body_len = snprintf(redirection_reply,
-		    sizeof(redirection_reply), "30 gemini://%s/%s%s\r\n",
-		    server_name, s->cfg.uri_subpath, requested_file);
+		return respond(c, req, errstr, strlen(errstr));
+	}
 
-		if (qent) {
-			quarantine_remove(s->quarantine, qent);
-			quarantine_entry_free(&qent);
-		}
+	__log_context.outcome = "input";
+	msgli(rid, "empty query, requesting input");
+
+	return respond(c, req, REQUEST_INPUT, sizeof(REQUEST_INPUT));
+}
+
+static void
+conn_free(struct connection *c)
+{
+	struct appstate *s = c->w->state;
+
+	atomic_fetch_sub(&s->requests, c->requests.n);
+	atomic_fetch_sub(&s->connections, 1);
+
+	writer_cancel(c->w->writer, c, NULL);
+
+	bufferevent_free(c->bev);
+	fcgi_requests_free(&c->requests);
+	free(c);
+}
 
-		return fcgi_write_stdout(out, rid, redirection_reply, body_len);
+/*
+ * Closes the connection once all pending output has been written.
+ */
+static void
+conn_close(struct connection *c)
+{
+	c->closing = true;
+	bufferevent_disable(c->bev, EV_READ);
+}
+
+/*
+ * Without FCGI_KEEP_CONN, the connection is closed after the request,
+ * but only once other requests multiplexed over it are done as well.
+ */
+static void
+request_finish(struct connection *c, struct fcgi_request *req)
+{
+	if (!req->keep_conn)
+		c->close_when_idle = true;
+
+	fcgi_request_remove(&c->requests, req);
+	atomic_fetch_sub(&c->w->state->requests, 1);
+
+	if (c->close_when_idle && c->requests.n == 0)
+		conn_close(c);
+}
+
+/*
+ * Redirects back to the comment file once the comment is on disk.
+ */
+static void
+comment_written(bool ok, void *owner, void *arg)
+{
+	struct connection *c = owner;
+	struct fcgi_request *req = arg;
+	const char *requested_file;
+	char redirection_reply[512];
+	int body_len;
+
+	// both were checked before the comment was queued
+	requested_file = strchr(req->cgi.vars[CGI_GEMINI_URL_PATH].value, '/');
+
+	__log_context.rid = req->rid;
+	__log_context.rhost = req->cgi.vars[CGI_REMOTE_ADDR].value ?
+	    req->cgi.vars[CGI_REMOTE_ADDR].value :
+	    req->cgi.vars[CGI_REMOTE_HOST].value;
+	__log_context.server_name = req->cgi.vars[CGI_SERVER_NAME].value;
+	__log_context.file = requested_file;
+
+	metrics_observe(c->w->metrics, METRICS_PERSIST, req->queued);
+
+	if (!ok) {
+		__log_context.outcome = "write-failed";
+		warnxli(req->rid, "comment not written");
+
+		respond(c, req, WRITE_FAILED, strlen(WRITE_FAILED));
+		log_context_reset();
+		request_finish(c, req);
+		return;
 	}
 
-	if (errstr) {
-		if (!qent)
-			qent = quarantine_add(s->quarantine, &user.id);
+	__log_context.outcome = "written";
+	msgli(req->rid, "comment written");
 
-		qent->last_failure = now;
-		qent->failures++;
+	body_len = snprintf(redirection_reply, sizeof(redirection_reply),
+	    "30 gemini://%s/%s%s\r\n", req->cgi.vars[CGI_SERVER_NAME].value,
+	    c->w->state->cfg.uri_subpath, requested_file);
 
-		return fcgi_write_stdout(out, rid, errstr, strlen(errstr));
+	if (body_len < 0 || (size_t)body_len >= sizeof(redirection_reply)) {
+		warnxli(req->rid, "redirection reply truncated");
+		body_len = strlen(redirection_reply);
 	}
 
-	if (qent) {
-		quarantine_remove(s->quarantine, qent);
-		quarantine_entry_free(&qent);
+	respond(c, req, redirection_reply, body_len);
+	log_context_reset();
+	request_finish(c, req);
+}
+
+static bool
+handle_request(struct connection *c, struct fcgi_request *req)
+{
+	struct metrics *m = c->w->metrics;
+	bool deferred, success;
+	uint64_t begun;
+
+	metrics_add(m, requests, 1);
+	metrics_observe(m, METRICS_PARSE, req->begun);
+
+	deferred = false;
+	__log_context.rid = req->rid;
+	begun = metrics_now();
+	PROBE1(response_start, req->rid);
+	success = generate_response(c, req, &deferred);
+
+	metrics_observe(m, METRICS_VALIDATE, begun);
+
+	if (!success) {
+		__log_context.outcome = "failed";
+		warnxli(req->rid, "generating response failed");
 	}
 
-	msgli(rid, "empty query, requesting input");
+	PROBE3(response_done, req->rid, success, __log_context.outcome);
+	log_context_reset();
+
+	if (!deferred)
+		request_finish(c, req);
 
-	return fcgi_write_stdout(out, rid, REQUEST_INPUT,
-	    sizeof(REQUEST_INPUT));
+	return success;
 }
 
+/*
+ * Copies the values of interesting parameters into their slots and
+ * skips everything else.
+ */
 static bool
-handle_request(struct evbuffer *in, struct evbuffer *out,
-    struct fcgi_header header, bool *keep_conn,
-    struct appstate *s)
+collect_param(struct fcgi_request *req, const struct fcgi_param *p,
+    void *arg)
 {
-	struct fcgi_body_begin_request body;
-	bool got_params, got_stdin, success;
-	unsigned short content_len, rid;
+	(void)arg;
 
-	struct fcgi_params_head params;
-	struct fcgi_params_entry *_entry, *entry;
+	enum cgi_var var;
 
-	success = true;
-	got_stdin = got_params = false;
+	PROBE3(param, req->rid, p->name_len, p->value_len);
 
-	if (evbuffer_remove(in, &body, sizeof(body)) < (int)sizeof(body)) {
-		warnxl("evbuffer_remove");
-		return false;
+	if ((var = cgi_lookup(p->name, p->name_len)) == CGI_VARS) {
+		dbgxli(req->rid, "FCGI_PARAMS: skipping %.*s",
+		    (int)p->name_len, p->name);
+		return true;
 	}
 
-	if (body.roleB0 != FCGI_RESPONDER) {
-		warnxl("only FCGI_RESPONDER role is supported");
+	if (req->cgi.vars[var].value)
+		return true;
+
+	if (!(req->cgi.vars[var].value = arena_strndup(&req->arena, p->value,
+	    p->value_len))) {
+		warnxli(req->rid, "arena_strndup");
 		return false;
 	}
+	req->cgi.vars[var].len = p->value_len;
+
+	dbgxli(req->rid, "FCGI_PARAMS: %.*s=%s", (int)p->name_len, p->name,
+	    req->cgi.vars[var].value);
 
-	*keep_conn = body.flags & FCGI_KEEP_CONN;
+	return true;
+}
 
-	TAILQ_INIT(&params);
+static bool
+handle_begin_request(struct connection *c, unsigned short rid,
+    unsigned short content_len)
+{
+	struct fcgi_body_begin_request body;
+	struct fcgi_request *req;
+	struct evbuffer *in, *out;
+	struct appstate *s;
 
-	while (fcgi_check_header(in, &header)) {
-		content_len = (header.contentLengthB1 << 8) |
-		    header.contentLengthB0;
-		rid = (header.requestIdB1 << 8) | header.requestIdB0;
+	s = c->w->state;
+	in = bufferevent_get_input(c->bev);
+	out = bufferevent_get_output(c->bev);
 
-		switch (header.type) {
-		case FCGI_PARAMS:
-			if (got_params) {
-				warnxli(rid,
-				    "received params after stream was closed");
-				success = false;
-				goto free;
-			}
+	if (content_len < sizeof(body) ||
+	    evbuffer_remove(in, &body, sizeof(body)) < (int)sizeof(body)) {
+		warnxli(rid, "bad FCGI_BEGIN_REQUEST");
+		return false;
+	}
 
-			if (content_len == 0) {
-				dbgxli(rid, "FCGI_PARAMS end");
-				got_params = true;
-				break;
-			}
+	if (fcgi_request_find(&c->requests, rid)) {
+		warnxli(rid, "request is already active");
+		return false;
+	}
 
-			entry = calloc(1, sizeof(struct fcgi_params_entry));
+	if (((body.roleB1 << 8) | body.roleB0) != FCGI_RESPONDER) {
+		warnxli(rid, "only FCGI_RESPONDER role is supported");
+		return fcgi_end_request(out, rid, FCGI_UNKNOWN_ROLE);
+	}
 
-			if (!fcgi_read_param(in, entry)) {
-				warnxli(rid, "bad FCGI_PARAMS");
-				free(entry);
-				success = false;
-				goto free;
-			}
+	if (atomic_fetch_add(&s->requests, 1) >= s->cfg.max_requests) {
+		atomic_fetch_sub(&s->requests, 1);
+		warnxli(rid, "too many concurrent requests");
+		return fcgi_end_request(out, rid, FCGI_OVERLOADED);
+	}
 
-			dbgxli(rid, "FCGI_PARAMS: %s=%s", entry->name,
-			    entry->value);
+	if (!(req = fcgi_request_add(&c->requests, rid))) {
+		atomic_fetch_sub(&s->requests, 1);
+		warnxli(rid, "fcgi_request_add");
+		return false;
+	}
 
-			TAILQ_INSERT_TAIL(&params, entry, entries);
+	req->keep_conn = body.flags & FCGI_KEEP_CONN;
+	req->begun = metrics_now();
 
-			break;
+	return true;
+}
 
-		case FCGI_STDIN:
-			if (got_stdin) {
-				warnxli(rid,
-				    "received stdin after stream was closed");
-				success = false;
-				goto free;
-			}
+static bool
+handle_unknown_type(struct connection *c, unsigned char type)
+{
+	struct fcgi_record_unknown_type response = {
+		.header = {
+			.version = FCGI_VERSION_1,
+			.type = FCGI_UNKNOWN_TYPE,
+			.requestIdB0 = FCGI_NULL_REQUEST_ID,
+			.contentLengthB0 = sizeof(struct fcgi_body_unknown_type)
+		},
+		.body = {
+			.type = type,
+		},
+	};
+
+	return evbuffer_add(bufferevent_get_output(c->bev), &response,
+	    sizeof(response)) == 0;
+}
 
-			if (!got_stdin && content_len > 0) {
-				warnxli(rid, "not handling stdin");
-				if (evbuffer_drain(in, content_len) == -1) {
-					warnxli(rid, "evbuffer_drain");
-					success = false;
-					goto free;
-				}
-				break;
-			}
+/*
+ * Answers FCGI_GET_VALUES queries from the configured limits; variables
+ * we don't know are left out of the result, as the spec demands.
+ */
+static bool
+handle_get_values(struct connection *c, unsigned short content_len)
+{
+	struct fcgi_param p;
+	struct evbuffer *result;
+	const struct config *cfg;
+	const unsigned char *data;
+	char value[32];
+	size_t off;
+	ssize_t n;
+	bool success;
+
+	cfg = &c->w->state->cfg;
+	success = true;
 
-			got_stdin = true;
+	if (!(result = evbuffer_new())) {
+		warnxl("evbuffer_new");
+		return false;
+	}
 
-			if (!generate_response(out, rid, &params, s)) {
-				warnxli(rid, "generating response failed");
-				success = false;
-			} else {
-				success = true;
-			}
+	if (!(data = evbuffer_pullup(bufferevent_get_input(c->bev),
+	    content_len)) && content_len > 0) {
+		warnxl("evbuffer_pullup");
+		success = false;
+		goto free;
+	}
 
-			goto free;
-		default:
-			warnxli(rid, "received unexpected FCGI header type: %x",
-			    header.type);
+	for (off = 0; off < content_len; off += n) {
+		if ((n = fcgi_parse_param(data + off, content_len - off,
+		    &p)) <= 0) {
+			warnxl("bad FCGI_GET_VALUES");
 			success = false;
-
-			struct fcgi_record_unknown_type response = {
-				.header = {
-					.version = FCGI_VERSION_1,
-					.type = FCGI_UNKNOWN_TYPE,
-					.requestIdB0 = FCGI_NULL_REQUEST_ID,
-					.contentLengthB0 = sizeof(struct fcgi_body_unknown_type)
-				},
-				.body = {
-					.type = header.type,
-				},
-			};
-
-			evbuffer_add(out, &response, sizeof(response));
 			goto free;
 		}
 
-		if (evbuffer_drain(in, header.paddingLength) == -1) {
-			warnxli(rid, "evbuffer_drain");
-			success = false;
+#define IS(var) (p.name_len == sizeof(var) - 1 &&			\
+    memcmp(var, p.name, sizeof(var) - 1) == 0)
+
+		if (IS(FCGI_MAX_CONNS))
+			snprintf(value, sizeof(value), "%lu",
+			    cfg->max_connections);
+		else if (IS(FCGI_MAX_REQS))
+			snprintf(value, sizeof(value), "%lu", cfg->max_requests);
+		else if (IS(FCGI_MPXS_CONNS))
+			strlcpy(value, "1", sizeof(value));
+		else
+			continue;
+
+#undef IS
+
+		dbgxl("FCGI_GET_VALUES: %.*s=%s", (int)p.name_len, p.name,
+		    value);
+
+		if (!(success = fcgi_write_param(result, p.name, p.name_len,
+		    value, strlen(value))))
 			goto free;
-		}
 	}
 
+	success = fcgi_write_record(bufferevent_get_output(c->bev),
+	    FCGI_GET_VALUES_RESULT, FCGI_NULL_REQUEST_ID, result);
+
  free:
-	entry = TAILQ_FIRST(&params);
-	while (entry != NULL) {
-		_entry = TAILQ_NEXT(entry, entries);
-		free(entry->name);
-		free(entry->value);
-		free(entry);
-		entry = _entry;
-	}
+	evbuffer_free(result);
+
 	return success;
 }
 
+static bool
+handle_management_record(struct connection *c,
+    const struct fcgi_header *header)
+{
+	switch (header->type) {
+	case FCGI_GET_VALUES:
+		return handle_get_values(c, fcgi_content_length(header));
+	default:
+		warnxl("received unexpected management record: %x",
+		    header->type);
+		return handle_unknown_type(c, header->type);
+	}
+}
+
+/*
+ * Handles a single, complete record whose header has already been
+ * consumed. Content that is not consumed here is skipped by the caller.
+ */
+static bool
+handle_record(struct connection *c, const struct fcgi_header *header)
+{
+	struct fcgi_request *req;
+	struct evbuffer *in;
+	const unsigned char *data;
+	unsigned short content_len, rid;
+
+	in = bufferevent_get_input(c->bev);
+	content_len = fcgi_content_length(header);
+	rid = fcgi_request_id(header);
+
+	if (rid == FCGI_NULL_REQUEST_ID)
+		return handle_management_record(c, header);
+
+	if (header->type == FCGI_BEGIN_REQUEST)
+		return handle_begin_request(c, rid, content_len);
+
+	if (!(req = fcgi_request_find(&c->requests, rid))) {
+		dbgxli(rid, "ignoring record for inactive request");
+		return true;
+	}
+
+	switch (header->type) {
+	case FCGI_ABORT_REQUEST:
+		dbgxli(rid, "FCGI_ABORT_REQUEST");
+		writer_cancel(c->w->writer, c, req);
+		request_finish(c, req);
+		return fcgi_end_request(bufferevent_get_output(c->bev), rid,
+		    FCGI_REQUEST_COMPLETE);
+
+	case FCGI_PARAMS:
+		if (req->params_done) {
+			warnxli(rid, "received params after stream was closed");
+			return false;
+		}
+
+		if (content_len == 0) {
+			dbgxli(rid, "FCGI_PARAMS end");
+			if (req->carry_len > 0) {
+				warnxli(rid, "FCGI_PARAMS stream truncated");
+				return false;
+			}
+			req->params_done = true;
+			return true;
+		}
+
+		if ((req->params_len += content_len) > FCGI_PARAMS_MAX) {
+			warnxli(rid, "FCGI_PARAMS exceed %d bytes",
+			    FCGI_PARAMS_MAX);
+			return false;
+		}
+
+		if (!(data = evbuffer_pullup(in, content_len)) ||
+		    !fcgi_feed_params(req, data, content_len, collect_param,
+		    NULL)) {
+			warnxli(rid, "bad FCGI_PARAMS");
+			return false;
+		}
+
+		return true;
+
+	case FCGI_STDIN:
+		if (!req->params_done) {
+			warnxli(rid, "received stdin before params were closed");
+			return false;
+		}
+
+		if (content_len > 0) {
+			warnxli(rid, "not handling stdin");
+			return true;
+		}
+
+		return handle_request(c, req);
+
+	default:
+		warnxli(rid, "received unexpected FCGI header type: %x",
+		    header->type);
+		handle_unknown_type(c, header->type);
+		return false;
+	}
+}
+
 static void
 read_cb(struct bufferevent *bev, void *ctx)
 {
-	struct appstate *state;
-	struct evbuffer *in, *out;
-	bool keep_conn, success;
+	struct connection *c;
+	struct evbuffer *in;
+	struct fcgi_header header;
+	size_t rest;
 
-	state = ctx;
+	c = ctx;
 	in = bufferevent_get_input(bev);
-	out = bufferevent_get_output(bev);
 
-	struct fcgi_header header;
+	while (!c->closing) {
+		switch (fcgi_check_header(in, &header)) {
+		case RECORD_INCOMPLETE:
+			return;
+		case RECORD_BAD:
+			warnxl("bad FCGI header");
+			conn_free(c);
+			return;
+		case RECORD_COMPLETE:
+			break;
+		}
 
-	if (!fcgi_check_header(in, &header)) {
-		warnxl("bad FCGI header");
-		bufferevent_free(bev);
+		rest = evbuffer_get_length(in) - fcgi_record_length(&header);
+		evbuffer_drain(in, FCGI_HEADER_LEN);
+
+		if (!handle_record(c, &header)) {
+			warnxl("handling request failed");
+			conn_free(c);
+			return;
+		}
+
+		if (evbuffer_drain(in, evbuffer_get_length(in) - rest) == -1) {
+			warnxl("evbuffer_drain");
+			conn_free(c);
+			return;
+		}
 	}
 
-	if (header.type == FCGI_BEGIN_REQUEST) {
-		success = handle_request(in, out, header,
-		    &keep_conn, state);
+	if (evbuffer_get_length(bufferevent_get_output(bev)) == 0)
+		conn_free(c);
+}
 
-		if (!success)
-			warnxl("handling request failed");
+static void
+write_cb(struct bufferevent *bev, void *ctx)
+{
+	(void)bev;
 
-		if (!keep_conn || !success)
-			bufferevent_free(bev);
+	struct connection *c = ctx;
 
-		return;
+	PROBE1(flushed, c);
+
+	if (c->unflushed != 0) {
+		metrics_observe(c->w->metrics, METRICS_RESPOND, c->unflushed);
+		c->unflushed = 0;
 	}
+
+	if (c->closing)
+		conn_free(c);
 }
 
 void
 error_cb(struct bufferevent *bev, short error, void *ctx)
 {
-	(void)ctx;
+	(void)bev;
 
 	if (error & BEV_EVENT_EOF)
 		dbgxl("connection closed");
 	else if (error & BEV_EVENT_ERROR)
 		warnl("error_cb");
 
-	bufferevent_free(bev);
+	conn_free(ctx);
 }
 
 void
 accept_cb(evutil_socket_t listener, short event, void *arg)
 {
 	(void)event;
-	struct bufferevent *bev;
-	struct appstate *state;
+	struct connection *c;
+	struct worker *w;
+	struct appstate *s;
 	struct sockaddr_un client;
 	socklen_t client_len;
 	int client_fd;
 
-	state = arg;
+	w = arg;
+	s = w->state;
 	client_len = sizeof(client);
 
 	client_fd = accept(listener, (struct sockaddr *)&client, &client_len);
 
 	if (client_fd < 0) {
-		warnl("accept");
+		// another worker was faster on a shared listener
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			warnl("accept");
 		return;
 	}
 
+	PROBE2(accept, w->id, client_fd);
+
 	if (FD_SETSIZE < client_fd) {
 		warnxl("FD_SETSIZE < client_fd");
 		close(client_fd);
 		return;
 	}
 
+	if (atomic_fetch_add(&s->connections, 1) >= s->cfg.max_connections) {
+		atomic_fetch_sub(&s->connections, 1);
+		warnxl("too many connections");
+		close(client_fd);
+		return;
+	}
+
 	evutil_make_socket_nonblocking(client_fd);
-	bev = bufferevent_socket_new(state->evbase, client_fd,
+
+	c = calloc(1, sizeof(struct connection));
+	c->w = w;
+	fcgi_requests_init(&c->requests);
+	c->bev = bufferevent_socket_new(w->evbase, client_fd,
 	    BEV_OPT_CLOSE_ON_FREE);
 
-	bufferevent_setcb(bev, read_cb, NULL, error_cb, state);
-	bufferevent_setwatermark(bev, EV_READ, 0, MAX_LINE);
-	bufferevent_enable(bev, EV_READ | EV_WRITE);
+	if (!c->bev) {
+		warnxl("bufferevent_socket_new");
+		atomic_fetch_sub(&s->connections, 1);
+		close(client_fd);
+		free(c);
+		return;
+	}
+
+	bufferevent_setcb(c->bev, read_cb, write_cb, error_cb, c);
+	bufferevent_setwatermark(c->bev, EV_READ, 0, READ_HIGHWATER);
+	bufferevent_enable(c->bev, EV_READ | EV_WRITE);
 }
 
 void
@@ -523,9 +958,8 @@ signal_handler(evutil_socket_t listener, short event, void *arg)
 {
 	(void)listener;
 
-	char pathbuf[PATH_MAX];
 	struct appstate *state;
-	FILE *quarantine_file;
+	size_t i;
 
 	if (!(event & EV_SIGNAL)) {
 		warnxl("unexpected event");
@@ -536,25 +970,133 @@ signal_handler(evutil_socket_t listener, short event, void *arg)
 
 	msgl("quitting...");
 
-	if (state->cfg.persistent_dir &&
-	    path_combine(pathbuf, PATH_MAX, state->cfg.persistent_dir,
+	for (i = 0; i < state->cfg.workers; ++i)
+		event_active(state->workers[i].stop_event, EV_READ, 0);
+
+	event_free(state->int_event);
+	event_free(state->term_event);
+
+	state->int_event = state->term_event = NULL;
+
+	if (state->metrics_event) {
+		event_free(state->metrics_event);
+		state->metrics_event = NULL;
+	}
+}
+
+static void
+save_quarantine(struct appstate *state)
+{
+	char pathbuf[PATH_MAX];
+	FILE *quarantine_file;
+
+	if (!state->cfg.persistent_dir ||
+	    !path_combine(pathbuf, PATH_MAX, state->cfg.persistent_dir,
 	    QUARANTINE_FILENAME)) {
-		if ((quarantine_file = fopen(pathbuf, "w"))) {
-			quarantine_serialize(state->quarantine,
-			    quarantine_file);
-			fclose(quarantine_file);
-		} else {
-			warnl("fopen(quarantine_file)");
-		}
-	} else {
 		warnxl("PATH_MAX exceeded! what??");
+		return;
 	}
 
-	event_free(state->sock_event);
-	event_free(state->int_event);
-	event_free(state->term_event);
+	if (!(quarantine_file = fopen(pathbuf, "w"))) {
+		warnl("fopen(quarantine_file)");
+		return;
+	}
+
+	quarantine_serialize(state->quarantine, state->cfg.workers,
+	    quarantine_file);
+
+	fclose(quarantine_file);
+}
+
+static evutil_socket_t
+listener_new(sa_family_t af, const struct sockaddr *saddr, socklen_t slen,
+    bool reuseport)
+{
+	evutil_socket_t fd;
+	int one = 1;
+
+	if ((fd = socket(af, SOCK_STREAM, 0)) < 0)
+		errl(1, "socket");
+
+	evutil_make_socket_nonblocking(fd);
+
+#ifdef LISTEN_REUSEPORT
+	if (reuseport &&
+	    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0)
+		errl(1, "setsockopt(SO_REUSEPORT)");
+#else
+	(void)reuseport;
+	(void)one;
+#endif
+
+	if (bind(fd, saddr, slen) < 0)
+		errl(1, "bind");
+
+	if (listen(fd, 16) < 0)
+		errl(1, "listen");
+
+	return fd;
+}
+
+/*
+ * Set up before entering the sandbox, which only has room for the
+ * FastCGI listener.
+ */
+static evutil_socket_t
+metrics_listener_new(const struct config *cfg)
+{
+	union sockaddrs sock;
+	struct sockaddr *saddr;
+	socklen_t slen;
+
+	memset(&sock, 0, sizeof(sock));
+
+	switch (cfg->metrics.af) {
+	case AF_UNIX:
+		sock.un.sun_family = AF_UNIX;
+		if (strlcpy(sock.un.sun_path, cfg->metrics.path,
+		    sizeof(sock.un.sun_path)) >= sizeof(sock.un.sun_path))
+			errxl(1, "metrics path too long: %s",
+			    cfg->metrics.path);
+
+		unlink(cfg->metrics.path);
+
+		saddr = (struct sockaddr *)&sock.un;
+		slen = sizeof(sock.un);
+		break;
+	case AF_INET:
+		sock.in.sin_family = AF_INET;
+		sock.in.sin_addr = cfg->metrics.ip.v4;
+		sock.in.sin_port = htons(cfg->metrics.port);
+
+		saddr = (struct sockaddr *)&sock.in;
+		slen = sizeof(sock.in);
+		break;
+	case AF_INET6:
+		sock.in6.sin6_family = AF_INET6;
+		sock.in6.sin6_addr = cfg->metrics.ip.v6;
+		sock.in6.sin6_port = htons(cfg->metrics.port);
 
-	state->sock_event = state->int_event = state->term_event = NULL;
+		saddr = (struct sockaddr *)&sock.in6;
+		slen = sizeof(sock.in6);
+		break;
+	default:
+		__builtin_unreachable();
+	}
+
+	return listener_new(cfg->metrics.af, saddr, slen, false);
+}
+
+static void *
+worker_loop(void *arg)
+{
+	struct worker *w = arg;
+
+	dbgxl("worker %lu running", w->id);
+
+	event_base_dispatch(w->evbase);
+
+	return NULL;
 }
 
 int
@@ -563,12 +1105,14 @@ main(int argc, char **argv)
 	(void)argc;
 	(void)argv;
 
-	evutil_socket_t sock_listener;
 	union sockaddrs sock;
 	struct sockaddr *saddr;
 	socklen_t slen;
 	struct appstate *state;
+	struct worker *w;
 	char sockpath[PATH_MAX], strbuf[1024];
+	size_t i;
+	bool reuseport;
 
 	setprogname(PROJECT_NAME);
 
@@ -576,7 +1120,12 @@ main(int argc, char **argv)
 
 	state = appstate_new(argc, argv);
 
-	enter_the_sandbox(&state->cfg);
+	log_start(state->cfg.journald_socket);
+
+	if (state->cfg.metrics.af != AF_UNSPEC)
+		state->metrics_listener = metrics_listener_new(&state->cfg);
+
+	enter_the_sandbox(&state->cfg, state->comments_fd);
 
 	switch (state->cfg.af) {
 	case AF_UNIX:
@@ -612,47 +1161,99 @@ main(int argc, char **argv)
 		__builtin_unreachable();
 	}
 
-	sock_listener = socket(state->cfg.af, SOCK_STREAM, 0);
-
-	evutil_make_socket_nonblocking(sock_listener);
-
-	if (bind(sock_listener, saddr, slen) < 0)
-		errl(1, "bind");
-
-	if (listen(sock_listener, 16) < 0)
-		errl(1, "listen");
-
-	state->sock_event = event_new(state->evbase, sock_listener,
-	    EV_READ | EV_PERSIST, accept_cb, state);
-
-	if (!state->sock_event)
-		errxl(1, "sock_event");
+	/*
+	 * tcp workers get a listener each and let the kernel balance
+	 * connections, otherwise all workers poll on the same listener.
+	 */
+#ifdef LISTEN_REUSEPORT
+	reuseport = state->cfg.af != AF_UNIX && state->cfg.workers > 1;
+#else
+	reuseport = false;
+#endif
+
+	for (i = 0; i < state->cfg.workers; ++i) {
+		w = &state->workers[i];
+
+		if (i == 0 || reuseport)
+			w->listener = listener_new(state->cfg.af, saddr, slen,
+			    reuseport);
+		else
+			w->listener = state->workers[0].listener;
+
+		w->sock_event = event_new(w->evbase, w->listener,
+		    EV_READ | EV_PERSIST, accept_cb, w);
+
+		if (!w->sock_event)
+			errxl(1, "sock_event");
+
+		if (event_add(w->sock_event, NULL) < 0)
+			errxl(1, "event_add");
+	}
 
-	if (event_add(state->sock_event, NULL) < 0)
-		errxl(1, "event_add");
+	w = &state->workers[0];
 
-	state->int_event = event_new(state->evbase, SIGINT, EV_SIGNAL,
+	state->int_event = event_new(w->evbase, SIGINT, EV_SIGNAL,
 	    signal_handler, state);
-	state->term_event = event_new(state->evbase, SIGTERM, EV_SIGNAL,
+	state->term_event = event_new(w->evbase, SIGTERM, EV_SIGNAL,
 	    signal_handler, state);
 
 	if (!state->int_event || event_add(state->int_event, NULL) ||
 	    !state->term_event || event_add(state->term_event, NULL))
 		warnl("failed to register signals");
 
+	if (state->metrics_listener != -1) {
+		state->metrics_event = event_new(w->evbase,
+		    state->metrics_listener, EV_READ | EV_PERSIST,
+		    metrics_accept_cb, state);
+
+		if (!state->metrics_event ||
+		    event_add(state->metrics_event, NULL) < 0)
+			errxl(1, "metrics_event");
+	}
+
 	sockaddrs_to_str(memset(strbuf, 0, sizeof(strbuf)), sizeof(strbuf),
 	    &sock, state->cfg.af);
 
-	msgl("listening on %s ...", strbuf);
+	msgl("listening on %s with %lu worker(s) ...", strbuf,
+	    state->cfg.workers);
 
-	event_base_dispatch(state->evbase);
+	if (!writer_start(state->writer))
+		errl(1, "pthread_create");
 
-	close(sock_listener);
+	for (i = 1; i < state->cfg.workers; ++i) {
+		w = &state->workers[i];
+		if ((errno = pthread_create(&w->thread, NULL, worker_loop,
+		    w)) != 0)
+			errl(1, "pthread_create");
+	}
+
+	worker_loop(&state->workers[0]);
+
+	for (i = 1; i < state->cfg.workers; ++i)
+		pthread_join(state->workers[i].thread, NULL);
+
+	writer_stop(state->writer);
+
+	save_quarantine(state);
+
+	for (i = 0; i < state->cfg.workers; ++i)
+		if (i == 0 || reuseport)
+			close(state->workers[i].listener);
 
 	if (state->cfg.af == AF_UNIX)
 		unlink(sockpath);
 
+	if (state->metrics_listener != -1) {
+		close(state->metrics_listener);
+
+		// the sandbox may not let us
+		if (state->cfg.metrics.af == AF_UNIX)
+			unlink(state->cfg.metrics.path);
+	}
+
 	appstate_free(&state);
 
+	log_stop();
+
 	return 0;
 }
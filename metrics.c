@@ -0,0 +1,313 @@
+/**
+ * gmlgcd - the gemlog comment daemon
+ * Copyright (C) 2024 github.com/Sir-Photch
+ *
+ * This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "metrics.h"
+
+#include <sys/socket.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+
+#include "appstate.h"
+#include "log.h"
+#include "quarantine.h"
+
+#define METRICS_REQUEST_MAX	4096	// bytes of http request headers
+#define METRICS_TIMEOUT		5	// seconds
+
+#define PREFIX "gmlgcd_"
+
+static const char *const stage_names[METRICS_STAGES] = {
+	[METRICS_PARSE] = "parse",
+	[METRICS_VALIDATE] = "validate",
+	[METRICS_PERSIST] = "persist",
+	[METRICS_RESPOND] = "respond",
+};
+
+/*
+ * Microseconds of the monotonic clock.
+ */
+uint64_t
+metrics_now(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		errl(1, "clock_gettime");
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Counts a reply by the status code it starts with.
+ */
+void
+metrics_reply(struct metrics *m, const char *reply)
+{
+	if (isdigit((unsigned char)reply[0]) &&
+	    isdigit((unsigned char)reply[1]))
+		metrics_add(m, replies[(reply[0] - '0') * 10 + reply[1] - '0'],
+		    1);
+}
+
+static size_t
+histogram_bucket(uint64_t us)
+{
+	int bits;
+
+	if (us < HISTOGRAM_SUB)
+		return us;
+
+	if ((bits = 63 - __builtin_clzll(us)) >= HISTOGRAM_MAX_BITS)
+		return HISTOGRAM_BUCKETS;
+
+	return (bits - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB +
+	    (us >> (bits - HISTOGRAM_SUB_BITS)) - HISTOGRAM_SUB;
+}
+
+/*
+ * The largest value that falls into bucket i.
+ */
+static uint64_t
+histogram_bound(size_t i)
+{
+	int bits;
+
+	if (i < HISTOGRAM_SUB)
+		return i;
+
+	bits = i / HISTOGRAM_SUB + HISTOGRAM_SUB_BITS - 1;
+
+	return ((uint64_t)(HISTOGRAM_SUB + i % HISTOGRAM_SUB + 1) <<
+	    (bits - HISTOGRAM_SUB_BITS)) - 1;
+}
+
+/*
+ * Records the time since, as of metrics_now(), for a stage.
+ */
+void
+metrics_observe(struct metrics *m, enum metrics_stage stage, uint64_t since)
+{
+	struct histogram *h = &m->stages[stage];
+	uint64_t us;
+	size_t i;
+
+	us = metrics_now() - since;
+
+	if ((i = histogram_bucket(us)) < HISTOGRAM_BUCKETS)
+		metrics_add(h, buckets[i], 1);
+
+	metrics_add(h, count, 1);
+	metrics_add(h, sum, us);
+}
+
+/*
+ * Adds up a field, given as it is in the first shard, over all shards.
+ */
+static uint64_t
+metrics_sum(const struct metrics *shards, size_t n,
+    const _Atomic uint64_t *field)
+{
+	size_t offset = (const char *)field - (const char *)shards, i;
+	uint64_t sum = 0;
+
+	for (i = 0; i < n; ++i)
+		sum += atomic_load_explicit((const _Atomic uint64_t *)
+		    ((const char *)&shards[i] + offset), memory_order_relaxed);
+
+	return sum;
+}
+
+#define SUM(field) metrics_sum(shards, n, &shards->field)
+
+static void
+metrics_render_value(struct evbuffer *buf, const char *name,
+    const char *type, const char *help, uint64_t value)
+{
+	evbuffer_add_printf(buf,
+	    "# HELP " PREFIX "%s %s\n"
+	    "# TYPE " PREFIX "%s %s\n"
+	    PREFIX "%s %llu\n", name, help, name, type, name,
+	    (unsigned long long)value);
+}
+
+/*
+ * Renders the n shards in Prometheus' text format.
+ */
+void
+metrics_render(struct evbuffer *buf, const struct metrics *shards, size_t n,
+    size_t connections, size_t quarantined)
+{
+	uint64_t value, cumulative;
+	size_t code, stage, b;
+
+	metrics_render_value(buf, "requests_total", "counter",
+	    "Requests handled.", SUM(requests));
+
+	evbuffer_add_printf(buf,
+	    "# HELP " PREFIX "replies_total Replies by status code.\n"
+	    "# TYPE " PREFIX "replies_total counter\n");
+	for (code = 0; code < METRICS_CODES; ++code)
+		if ((value = SUM(replies[code])) > 0)
+			evbuffer_add_printf(buf,
+			    PREFIX "replies_total{code=\"%02lu\"} %llu\n",
+			    (unsigned long)code, (unsigned long long)value);
+
+	metrics_render_value(buf, "quarantine_hits_total", "counter",
+	    "Requests from users in quarantine.", SUM(quarantine_hits));
+	metrics_render_value(buf, "written_bytes_total", "counter",
+	    "Bytes of comments written.", SUM(bytes_written));
+	metrics_render_value(buf, "connections", "gauge",
+	    "Open connections.", connections);
+	metrics_render_value(buf, "quarantine_entries", "gauge",
+	    "Users in quarantine.", quarantined);
+	metrics_render_value(buf, "buffered_bytes", "gauge",
+	    "Bytes of comments queued for writing.", SUM(bytes_buffered));
+
+	evbuffer_add_printf(buf,
+	    "# HELP " PREFIX "stage_seconds Time spent in each stage.\n"
+	    "# TYPE " PREFIX "stage_seconds histogram\n");
+	for (stage = 0; stage < METRICS_STAGES; ++stage) {
+		cumulative = 0;
+		for (b = 0; b < HISTOGRAM_BUCKETS; ++b) {
+			cumulative += SUM(stages[stage].buckets[b]);
+			value = histogram_bound(b);
+			evbuffer_add_printf(buf, PREFIX "stage_seconds_bucket"
+			    "{stage=\"%s\",le=\"%llu.%06llu\"} %llu\n",
+			    stage_names[stage],
+			    (unsigned long long)(value / 1000000),
+			    (unsigned long long)(value % 1000000),
+			    (unsigned long long)cumulative);
+		}
+
+		// buckets may be ahead of count while being updated
+		if ((value = SUM(stages[stage].count)) < cumulative)
+			value = cumulative;
+		evbuffer_add_printf(buf, PREFIX "stage_seconds_bucket"
+		    "{stage=\"%s\",le=\"+Inf\"} %llu\n", stage_names[stage],
+		    (unsigned long long)value);
+		evbuffer_add_printf(buf, PREFIX "stage_seconds_count"
+		    "{stage=\"%s\"} %llu\n", stage_names[stage],
+		    (unsigned long long)value);
+
+		value = SUM(stages[stage].sum);
+		evbuffer_add_printf(buf, PREFIX "stage_seconds_sum"
+		    "{stage=\"%s\"} %llu.%06llu\n", stage_names[stage],
+		    (unsigned long long)(value / 1000000),
+		    (unsigned long long)(value % 1000000));
+	}
+}
+
+static void
+metrics_write_cb(struct bufferevent *bev, void *arg)
+{
+	(void)arg;
+
+	bufferevent_free(bev);
+}
+
+static void
+metrics_error_cb(struct bufferevent *bev, short events, void *arg)
+{
+	(void)events;
+	(void)arg;
+
+	bufferevent_free(bev);
+}
+
+/*
+ * Answers any http request, once its headers are in, with the metrics.
+ */
+static void
+metrics_read_cb(struct bufferevent *bev, void *arg)
+{
+	struct appstate *s = arg;
+	struct evbuffer *in, *body;
+	struct evbuffer_ptr end;
+	size_t i, quarantined;
+
+	in = bufferevent_get_input(bev);
+	end = evbuffer_search(in, "\r\n\r\n", 4, NULL);
+
+	if (end.pos == -1) {
+		if (evbuffer_get_length(in) > METRICS_REQUEST_MAX)
+			bufferevent_free(bev);
+		return;
+	}
+
+	if (!(body = evbuffer_new())) {
+		warnxl("evbuffer_new");
+		bufferevent_free(bev);
+		return;
+	}
+
+	for (i = 0, quarantined = 0; i < s->cfg.workers; ++i) {
+		pthread_mutex_lock(&s->quarantine[i].lock);
+		quarantined += quarantine_size(s->quarantine[i].list);
+		pthread_mutex_unlock(&s->quarantine[i].lock);
+	}
+
+	metrics_render(body, s->metrics, s->cfg.workers,
+	    atomic_load(&s->connections), quarantined);
+
+	bufferevent_disable(bev, EV_READ);
+	evbuffer_add_printf(bufferevent_get_output(bev),
+	    "HTTP/1.0 200 OK\r\n"
+	    "Content-Type: text/plain; version=0.0.4\r\n"
+	    "Content-Length: %lu\r\n"
+	    "Connection: close\r\n\r\n",
+	    (unsigned long)evbuffer_get_length(body));
+	evbuffer_add_buffer(bufferevent_get_output(bev), body);
+	evbuffer_free(body);
+
+	bufferevent_setcb(bev, NULL, metrics_write_cb, metrics_error_cb, s);
+}
+
+void
+metrics_accept_cb(evutil_socket_t listener, short event, void *arg)
+{
+	(void)event;
+
+	struct timeval timeout = { METRICS_TIMEOUT, 0 };
+	struct appstate *s = arg;
+	struct bufferevent *bev;
+	evutil_socket_t fd;
+
+	if ((fd = accept(listener, NULL, NULL)) < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			warnl("accept");
+		return;
+	}
+
+	evutil_make_socket_nonblocking(fd);
+
+	if (!(bev = bufferevent_socket_new(event_get_base(s->metrics_event),
+	    fd, BEV_OPT_CLOSE_ON_FREE))) {
+		warnxl("bufferevent_socket_new");
+		close(fd);
+		return;
+	}
+
+	bufferevent_setcb(bev, metrics_read_cb, NULL, metrics_error_cb, s);
+	bufferevent_set_timeouts(bev, &timeout, &timeout);
+	bufferevent_enable(bev, EV_READ);
+}
@@ -0,0 +1,79 @@
+/**
+ * gmlgcd - the gemlog comment daemon
+ * Copyright (C) 2024 github.com/Sir-Photch
+ *
+ * This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <event2/buffer.h>
+#include <event2/util.h>
+
+#define METRICS_CODES		100	// gemini status codes
+
+/*
+ * Latencies in microseconds, in buckets of HDR histograms: each power of
+ * two is split into HISTOGRAM_SUB buckets, so a bucket's width is at most
+ * a quarter of its values. Beyond 2^HISTOGRAM_MAX_BITS, only count and
+ * sum are kept.
+ */
+#define HISTOGRAM_SUB_BITS	2
+#define HISTOGRAM_SUB		(1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_MAX_BITS	26	// a bit over a minute
+#define HISTOGRAM_BUCKETS \
+    ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB)
+
+enum metrics_stage {
+	METRICS_PARSE,		// from FCGI_BEGIN_REQUEST to the last record
+	METRICS_VALIDATE,	// generating the response
+	METRICS_PERSIST,	// from queueing a comment until it's written
+	METRICS_RESPOND,	// from queueing replies until they're flushed
+	METRICS_STAGES
+};
+
+struct histogram {
+	_Atomic uint64_t buckets[HISTOGRAM_BUCKETS];
+	_Atomic uint64_t count, sum;
+};
+
+/*
+ * A worker's shard of the metrics. Only the worker writes to it, so
+ * updates are relaxed loads and stores; scrapes add up all shards.
+ */
+struct metrics {
+	_Atomic uint64_t requests;
+	_Atomic uint64_t replies[METRICS_CODES];
+	_Atomic uint64_t quarantine_hits;
+	_Atomic uint64_t bytes_written;
+	_Atomic uint64_t bytes_buffered;	// gauge
+	struct histogram stages[METRICS_STAGES];
+};
+
+#define metrics_add(m, field, n)					\
+    atomic_store_explicit(&(m)->field, atomic_load_explicit(&(m)->field, \
+	memory_order_relaxed) + (n), memory_order_relaxed)
+
+#define metrics_set(m, field, v)					\
+    atomic_store_explicit(&(m)->field, (v), memory_order_relaxed)
+
+uint64_t metrics_now(void);
+void     metrics_reply(struct metrics *, const char *);
+void     metrics_observe(struct metrics *, enum metrics_stage, uint64_t);
+void     metrics_render(struct evbuffer *, const struct metrics *, size_t,
+    size_t, size_t);
+void     metrics_accept_cb(evutil_socket_t, short, void *);
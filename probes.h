@@ -0,0 +1,40 @@
+/**
+ * gmlgcd - the gemlog comment daemon
+ * Copyright (C) 2024 github.com/Sir-Photch
+ *
+ * This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+/*
+ * USDT probes of provider gmlgcd, for bpftrace, perf and friends. With
+ * -Dusdt=enabled, each is a nop the tracer patches when attaching;
+ * otherwise nothing is compiled in, not even the arguments.
+ */
+#ifdef HAVE_USDT
+
+#include <sys/sdt.h>
+
+#define PROBE1(name, a)			DTRACE_PROBE1(gmlgcd, name, a)
+#define PROBE2(name, a, b)		DTRACE_PROBE2(gmlgcd, name, a, b)
+#define PROBE3(name, a, b, c)		DTRACE_PROBE3(gmlgcd, name, a, b, c)
+
+#else
+
+#define PROBE1(name, a)			do {} while (0)
+#define PROBE2(name, a, b)		do {} while (0)
+#define PROBE3(name, a, b, c)		do {} while (0)
+
+#endif
@@ -21,44 +21,228 @@
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <limits.h>
+#include <stdalign.h>
+#include <stdint.h>
 
 #include "log.h"
 #include "user.h"
 
-#define SERIALIZED_QUARANTINE_FMT "%s|%s|%d|%d" // rhost, hash, last_t, n_failed
+#define QUARANTINE_CAP_MIN	64
+#define SLOT_USED		0x80000000u
+#define SLOT_NIL		UINT32_MAX
 
-TAILQ_HEAD(quarantine_list, quarantine_entry);
-
-static bool
-quarantine_entry_equals(struct quarantine_entry a, struct quarantine_entry b)
+/*
+ * Open addressing with linear probing. Each slot fills one cache line,
+ * so a lookup usually touches a single line.
+ *
+ * Used slots are also linked into a list ordered by last_seen, oldest
+ * first, which serves both for LRU eviction and for expiry.
+ */
+struct quarantine_slot {
+	struct quarantine_entry e;
+	uint32_t hash;			// 0 if unused, SLOT_USED set otherwise
+	uint32_t prev, next;		// slot indices, SLOT_NIL at the ends
+} __attribute__((aligned(64)));
+
+struct quarantine_list {
+	struct quarantine_slot *slots;
+	size_t cap;			// power of two
+	size_t n;
+	size_t max;
+	uint32_t head, tail;
+	uint64_t seed;
+
+	struct radix prefixes;		// of struct quarantine_prefix
+	unsigned prefix_v4, prefix_v6;	// 0 if not aggregated
+};
+
+/*
+ * Packs an id into its binary key: unused address bytes, the bytes after
+ * the hash and all padding are zero, so keys compare with memcmp.
+ */
+static void
+quarantine_key(const struct user_id *id, struct user_id *key)
 {
-	sa_family_t af = a.user.af;
+	memset(key, 0, sizeof(*key));
 
-	if (af != b.user.af)
-		return false;
+	key->af = id->af;
 
-	switch (af) {
+	switch (id->af) {
 	case AF_INET:
-		if (a.user.rhost.v4.s_addr != b.user.rhost.v4.s_addr)
-			return false;
+		key->rhost.v4 = id->rhost.v4;
 		break;
 	case AF_INET6:
-		if (memcmp(&a.user.rhost.v6, &b.user.rhost.v6,
-		    sizeof(struct in6_addr)) != 0)
-			return false;
+		key->rhost.v6 = id->rhost.v6;
 		break;
 	}
 
-	return strcmp(a.user.hash, b.user.hash) == 0;
+	memcpy(key->hash, id->hash, strnlen(id->hash, USER_HASH_LEN - 1));
+}
+
+static uint64_t
+mix(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+/*
+ * Keyed with a random seed, so clients can't pick colliding keys.
+ */
+static uint32_t
+quarantine_hash(const struct quarantine_list *q, const struct user_id *key)
+{
+	const unsigned char *p = (const unsigned char *)key;
+	uint64_t h, w;
+	size_t i;
+
+	h = q->seed;
+
+	for (i = 0; i + sizeof(w) <= sizeof(*key); i += sizeof(w)) {
+		memcpy(&w, p + i, sizeof(w));
+		h = mix(h ^ w);
+	}
+
+	if (i < sizeof(*key)) {
+		w = 0;
+		memcpy(&w, p + i, sizeof(*key) - i);
+		h = mix(h ^ w);
+	}
+
+	return (uint32_t)h | SLOT_USED;
+}
+
+static struct quarantine_slot *
+quarantine_slots_new(size_t cap)
+{
+	void *slots;
+
+	if (posix_memalign(&slots, alignof(struct quarantine_slot),
+	    cap * sizeof(struct quarantine_slot)) != 0)
+		return NULL;
+
+	return memset(slots, 0, cap * sizeof(struct quarantine_slot));
+}
+
+static struct quarantine_slot *
+quarantine_find_slot(struct quarantine_list *q, const struct user_id *key,
+    uint32_t hash)
+{
+	struct quarantine_slot *slot;
+	size_t i;
+
+	for (i = hash & (q->cap - 1); ; i = (i + 1) & (q->cap - 1)) {
+		slot = &q->slots[i];
+
+		if (slot->hash == 0 || (slot->hash == hash &&
+		    memcmp(&slot->e.user, key, sizeof(*key)) == 0))
+			return slot;
+	}
+}
+
+static void
+quarantine_unlink(struct quarantine_list *q, uint32_t i)
+{
+	struct quarantine_slot *slot = &q->slots[i];
+
+	if (slot->prev != SLOT_NIL)
+		q->slots[slot->prev].next = slot->next;
+	else
+		q->head = slot->next;
+
+	if (slot->next != SLOT_NIL)
+		q->slots[slot->next].prev = slot->prev;
+	else
+		q->tail = slot->prev;
+}
+
+/*
+ * Links slot i in behind the last entry that failed no later than it did.
+ * Failures happen in order, so this normally stops at the tail.
+ */
+static void
+quarantine_link(struct quarantine_list *q, uint32_t i)
+{
+	struct quarantine_slot *slot = &q->slots[i];
+	uint32_t after;
+
+	after = q->tail;
+	while (after != SLOT_NIL &&
+	    q->slots[after].e.last_seen > slot->e.last_seen)
+		after = q->slots[after].prev;
+
+	slot->prev = after;
+
+	if (after != SLOT_NIL) {
+		slot->next = q->slots[after].next;
+		q->slots[after].next = i;
+	} else {
+		slot->next = q->head;
+		q->head = i;
+	}
+
+	if (slot->next != SLOT_NIL)
+		q->slots[slot->next].prev = i;
+	else
+		q->tail = i;
+}
+
+static bool
+quarantine_grow(struct quarantine_list *q)
+{
+	struct quarantine_slot *old, *slot;
+	uint32_t i;
+
+	old = q->slots;
+
+	if (!(q->slots = quarantine_slots_new(q->cap * 2))) {
+		q->slots = old;
+		return false;
+	}
+	q->cap *= 2;
+
+	// rehash in list order, which keeps the list sorted
+	i = q->head;
+	q->head = q->tail = SLOT_NIL;
+
+	for (; i != SLOT_NIL; i = old[i].next) {
+		slot = quarantine_find_slot(q, &old[i].e.user, old[i].hash);
+		slot->e = old[i].e;
+		slot->hash = old[i].hash;
+
+		quarantine_link(q, slot - q->slots);
+	}
+
+	free(old);
+
+	return true;
 }
 
 struct quarantine_list *
-quarantine_new(void)
+quarantine_new(size_t max, unsigned prefix_v4, unsigned prefix_v6)
 {
 	struct quarantine_list *q;
 
-	q = calloc(1, sizeof(struct quarantine_list));
-	TAILQ_INIT(q);
+	if (!(q = calloc(1, sizeof(struct quarantine_list))))
+		return NULL;
+
+	if (!(q->slots = quarantine_slots_new(QUARANTINE_CAP_MIN))) {
+		free(q);
+		return NULL;
+	}
+
+	q->cap = QUARANTINE_CAP_MIN;
+	q->max = max;
+	q->head = q->tail = SLOT_NIL;
+	arc4random_buf(&q->seed, sizeof(q->seed));
+
+	radix_init(&q->prefixes);
+	q->prefix_v4 = prefix_v4;
+	q->prefix_v6 = prefix_v6;
 
 	return q;
 }
@@ -66,78 +250,302 @@ quarantine_new(void)
 void
 quarantine_free(struct quarantine_list **q)
 {
-	struct quarantine_entry *e1, *e2;
-
-	e1 = TAILQ_FIRST(*q);
-	while (e1 != NULL) {
-		e2 = TAILQ_NEXT(e1, entries);
-		free(e1);
-		e1 = e2;
-	}
+	radix_free(&(*q)->prefixes, free);
+	free((*q)->slots);
 	free(*q);
-	q = NULL;
+	*q = NULL;
 }
 
+/*
+ * Adds a user last seen at now, which is usually the latest time in the
+ * list, so linking it in stops at the tail.
+ */
 struct quarantine_entry *
-quarantine_add(struct quarantine_list *q, const struct user_id *id)
+quarantine_add(struct quarantine_list *q, const struct user_id *id,
+    time_t now)
 {
-	struct quarantine_entry *e;
+	struct quarantine_slot *slot;
+	struct user_id key;
+	uint32_t hash;
 
-	e = calloc(1, sizeof(struct quarantine_entry));
+	quarantine_key(id, &key);
+	hash = quarantine_hash(q, &key);
 
-	e->user.rhost = id->rhost;
-	e->user.af = id->af;
-	memcpy(e->user.hash, id->hash, USER_HASH_LEN);
+	slot = quarantine_find_slot(q, &key, hash);
+	if (slot->hash != 0)
+		return &slot->e;
 
-	TAILQ_INSERT_TAIL(q, e, entries);
+	if (q->n >= q->max) {
+		dbgxl("quarantine full, evicting oldest entry");
+		quarantine_remove(q, &q->slots[q->head].e);
+	}
+
+	// keep the load factor at 1/2 at most
+	if ((q->n + 1) * 2 > q->cap && !quarantine_grow(q))
+		errl(1, "quarantine_grow");
+
+	// eviction or growth may have moved things around
+	slot = quarantine_find_slot(q, &key, hash);
 
-#ifdef DEBUG_BUILD
-    struct quarantine_entry *d;
-    size_t len = 0;
-    TAILQ_FOREACH(d, q, entries) len++;
-    dbgxl("quarantine size: %lu", len);
-#endif
+	memset(&slot->e, 0, sizeof(slot->e));
+	slot->e.user = key;
+	slot->e.last_seen = now;
+	slot->hash = hash;
+	quarantine_link(q, slot - q->slots);
+	q->n++;
 
-	return e;
+	dbgxl("quarantine size: %lu", q->n);
+
+	return &slot->e;
 }
 
 struct quarantine_entry *
-quarantine_get_entry(struct quarantine_list *q, struct user_id id)
+quarantine_get_entry(struct quarantine_list *q, const struct user_id *id)
 {
-	struct quarantine_entry candidate = {
-		.user = id,
-	};
-	struct quarantine_entry *e;
+	struct quarantine_slot *slot;
+	struct user_id key;
 
-	TAILQ_FOREACH(e, q, entries) {
-		if (quarantine_entry_equals(*e, candidate))
-			return e;
-	}
+	quarantine_key(id, &key);
 
-	return NULL;
+	slot = quarantine_find_slot(q, &key, quarantine_hash(q, &key));
+
+	return slot->hash != 0 ? &slot->e : NULL;
 }
 
+void
+quarantine_touch(struct quarantine_list *q, struct quarantine_entry *e,
+    time_t now)
+{
+	uint32_t i = (struct quarantine_slot *)e - q->slots;
+
+	e->last_seen = now;
+
+	if (i != q->tail) {
+		quarantine_unlink(q, i);
+		quarantine_link(q, i);
+	}
+}
+
+/*
+ * Backward shift deletion: entries following the removed one move into
+ * the gap, unless that would put them in front of their home slot.
+ */
 void
 quarantine_remove(struct quarantine_list *q, struct quarantine_entry *e)
 {
-	TAILQ_REMOVE(q, e, entries);
+	struct quarantine_slot *slot;
+	size_t hole, i, home, mask;
+
+	mask = q->cap - 1;
+	hole = (struct quarantine_slot *)e - q->slots;
+
+	quarantine_unlink(q, hole);
+
+	for (i = (hole + 1) & mask; q->slots[i].hash != 0; i = (i + 1) & mask) {
+		home = q->slots[i].hash & mask;
+
+		// home cyclically within (hole, i]: the entry has to stay
+		if (((i - home) & mask) < ((i - hole) & mask))
+			continue;
+
+		slot = &q->slots[hole];
+		*slot = q->slots[i];
 
-#ifdef DEBUG_BUILD
-    struct quarantine_entry *d;
-    size_t len = 0;
-    TAILQ_FOREACH(d, q, entries) len++;
-    dbgxl("quarantine size: %lu", len);
-#endif
+		if (slot->prev != SLOT_NIL)
+			q->slots[slot->prev].next = hole;
+		else
+			q->head = hole;
+
+		if (slot->next != SLOT_NIL)
+			q->slots[slot->next].prev = hole;
+		else
+			q->tail = hole;
+
+		hole = i;
+	}
+
+	q->slots[hole].hash = 0;
+	q->n--;
+
+	dbgxl("quarantine size: %lu", q->n);
+}
+
+size_t
+quarantine_expire(struct quarantine_list *q, time_t before, size_t max)
+{
+	size_t n;
+
+	for (n = 0; n < max && q->head != SLOT_NIL; ++n) {
+		if (q->slots[q->head].e.last_seen >= before)
+			break;
+
+		quarantine_remove(q, &q->slots[q->head].e);
+	}
+
+	return n;
+}
+
+size_t
+quarantine_size(const struct quarantine_list *q)
+{
+	return q->n;
+}
+
+static bool
+quarantine_prefix_key(const struct quarantine_list *q,
+    const struct user_id *id, uint8_t *key, unsigned *bits)
+{
+	unsigned len;
+
+	if ((len = id->af == AF_INET ? q->prefix_v4 : q->prefix_v6) == 0)
+		return false;
+
+	*bits = radix_addr_key(key, id->af, &id->rhost) + len;
+
+	return true;
+}
+
+/*
+ * The shard out of n a user belongs to: by the network of their address
+ * if networks are aggregated, by the address otherwise. All shards have
+ * the prefix lengths of the first one, whose seed keys the hash.
+ */
+struct quarantine_shard *
+quarantine_shard(struct quarantine_shard *shards, size_t n,
+    const struct user_id *id)
+{
+	const struct quarantine_list *q = shards[0].list;
+	uint8_t key[RADIX_KEY_BITS / 8];
+	uint64_t w[2];
+	unsigned bits, i;
+
+	if (!quarantine_prefix_key(q, id, key, &bits)) {
+		radix_addr_key(key, id->af, &id->rhost);
+		bits = RADIX_KEY_BITS;
+	}
+
+	i = bits / 8;
+	if (bits % 8)
+		key[i++] &= 0xff << (8 - bits % 8);
+	memset(key + i, 0, sizeof(key) - i);
+
+	memcpy(w, key, sizeof(w));
+
+	return &shards[mix(mix(q->seed ^ w[0]) ^ w[1]) % n];
+}
+
+/*
+ * Returns the entry of the network a user's address belongs to, or NULL
+ * if there is none or addresses of its family aren't aggregated.
+ */
+struct quarantine_prefix *
+quarantine_get_prefix(struct quarantine_list *q, const struct user_id *id)
+{
+	uint8_t key[RADIX_KEY_BITS / 8];
+	unsigned bits;
+
+	if (!quarantine_prefix_key(q, id, key, &bits))
+		return NULL;
+
+	return radix_get(&q->prefixes, key, bits);
+}
+
+/*
+ * Like quarantine_get_prefix(), but adds the entry with full buckets if
+ * missing. Beyond the size of the quarantine, new networks are not
+ * tracked until idle ones expire.
+ */
+struct quarantine_prefix *
+quarantine_add_prefix(struct quarantine_list *q, const struct user_id *id,
+    uint32_t now)
+{
+	struct quarantine_prefix *p;
+	uint8_t key[RADIX_KEY_BITS / 8];
+	unsigned bits;
+
+	if (!quarantine_prefix_key(q, id, key, &bits))
+		return NULL;
+
+	if ((p = radix_get(&q->prefixes, key, bits)))
+		return p;
+
+	if (q->prefixes.n >= q->max) {
+		dbgxl("quarantine full, not tracking network");
+		return NULL;
+	}
+
+	if (!(p = malloc(sizeof(struct quarantine_prefix))))
+		errl(1, "malloc");
+
+	p->post_tat = p->failure_tat = now;
+	radix_insert(&q->prefixes, key, bits, p);
+
+	return p;
+}
+
+static bool
+quarantine_prefix_idle(void *value, void *arg)
+{
+	struct quarantine_prefix *p = value;
+	uint32_t now = *(uint32_t *)arg;
+
+	// both buckets full again, dropping the entry changes nothing
+	if ((int32_t)(p->post_tat - now) > 0 ||
+	    (int32_t)(p->failure_tat - now) > 0)
+		return false;
+
+	free(p);
+	return true;
 }
 
 void
-quarantine_serialize(struct quarantine_list *q, FILE *f)
+quarantine_expire_prefixes(struct quarantine_list *q, uint32_t now)
 {
-	struct quarantine_entry *e;
+	radix_prune(&q->prefixes, quarantine_prefix_idle, &now);
+}
+
+/*
+ * Writes the entries of all shards merged, oldest first, so that
+ * deserializing appends at the tails whichever shards they end up in.
+ */
+void
+quarantine_serialize(struct quarantine_shard *shards, size_t n, FILE *f)
+{
+	const struct quarantine_list *q;
+	const struct quarantine_entry *e;
+	uint32_t *next;
+	size_t i, oldest;
+	time_t first = 0;
 
 	char inet_addr[INET6_ADDRSTRLEN];
 
-	TAILQ_FOREACH(e, q, entries) {
+	if (!(next = calloc(n, sizeof(*next)))) {
+		warnl("calloc");
+		return;
+	}
+
+	for (i = 0; i < n; ++i)
+		next[i] = shards[i].list->head;
+
+	for (;;) {
+		for (oldest = n, i = 0; i < n; ++i) {
+			if (next[i] == SLOT_NIL)
+				continue;
+
+			e = &shards[i].list->slots[next[i]].e;
+			if (oldest == n || e->last_seen < first) {
+				oldest = i;
+				first = e->last_seen;
+			}
+		}
+
+		if (oldest == n)
+			break;
+
+		q = shards[oldest].list;
+		e = &q->slots[next[oldest]].e;
+		next[oldest] = q->slots[next[oldest]].next;
+
 		if (!inet_ntop(e->user.af, &e->user.rhost, inet_addr,
 		    INET6_ADDRSTRLEN)) {
 			warnl("inet_ntop");
@@ -145,18 +553,26 @@ quarantine_serialize(struct quarantine_list *q, FILE *f)
 		}
 
 		fprintf(f, "%s|%s|%lld|%lu\n", inet_addr, e->user.hash,
-		    (long long)e->last_failure, e->failures);
+		    (long long)e->last_seen, (unsigned long)e->failures);
 	}
+
+	free(next);
 }
 
+/*
+ * Reads entries into the shards they belong to.
+ */
 bool
-quarantine_deserialize(struct quarantine_list *q, FILE *f)
+quarantine_deserialize(struct quarantine_shard *shards, size_t n, FILE *f)
 {
+	struct quarantine_list *q;
 	struct quarantine_entry *entry;
+	struct user_id id;
 	char *delim, *hash, *line, *next, *rhost;
 	const char *errstr;
 	time_t time;
 	size_t linelen, n_failed;
+	uint32_t i;
 	bool success;
 
 	line = NULL;
@@ -196,29 +612,39 @@ quarantine_deserialize(struct quarantine_list *q, FILE *f)
 			break;
 		}
 		*delim = '\0';
-		n_failed = strtonum(next, 0, LONG_MAX, &errstr);
+		n_failed = strtonum(next, 0, UINT32_MAX, &errstr);
 		if (errstr) {
 			success = false;
 			break;
 		}
 
-		entry = calloc(1, sizeof(struct quarantine_entry));
+		memset(&id, 0, sizeof(id));
 
-		if (inet_pton(AF_INET, rhost, &entry->user.rhost.v4) == 1) {
-			entry->user.af = AF_INET;
-		} else if (inet_pton(AF_INET6, rhost, &entry->user.rhost.v6) ==
-		    1) {
-			entry->user.af = AF_INET6;
+		if (inet_pton(AF_INET, rhost, &id.rhost.v4) == 1) {
+			id.af = AF_INET;
+		} else if (inet_pton(AF_INET6, rhost, &id.rhost.v6) == 1) {
+			id.af = AF_INET6;
 		} else {
 			warnl("inet_pton");
 			success = false;
 			break;
 		}
-		strlcpy(entry->user.hash, hash, USER_HASH_LEN);
-		entry->last_failure = time;
-		entry->failures = n_failed;
+		strlcpy(id.hash, hash, USER_HASH_LEN);
+
+		q = quarantine_shard(shards, n, &id)->list;
+
+		// a user listed twice, as by hand, is merged
+		if (!(entry = quarantine_get_entry(q, &id)))
+			entry = quarantine_add(q, &id, time);
 
-		TAILQ_INSERT_TAIL(q, entry, entries);
+		if (entry->last_seen < time) {
+			entry->last_seen = time;
+			i = (struct quarantine_slot *)entry - q->slots;
+			quarantine_unlink(q, i);
+			quarantine_link(q, i);
+		}
+		if (entry->failures < n_failed)
+			entry->failures = n_failed;
 	}
 
 	if (line) {
@@ -231,9 +657,25 @@ quarantine_deserialize(struct quarantine_list *q, FILE *f)
 	return success;
 }
 
+/*
+ * Rate limiter state is kept in monotonic time and isn't serialized,
+ * recreate it as if the failures happened in a row when last seen.
+ */
 void
-quarantine_entry_free(struct quarantine_entry **e)
+quarantine_restore(struct quarantine_list *q, const struct ratelimit *rl)
 {
-	free(*e);
-	*e = NULL;
+	struct quarantine_entry *e;
+	uint32_t i, now;
+	time_t wall;
+
+	now = ratelimit_now();
+	time(&wall);
+
+	for (i = q->head; i != SLOT_NIL; i = q->slots[i].next) {
+		e = &q->slots[i].e;
+
+		e->post_tat = now;
+		ratelimit_restore(rl, &e->failure_tat, e->failures,
+		    ratelimit_ticks(wall - e->last_seen), now);
+	}
 }
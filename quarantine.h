@@ -20,34 +20,73 @@
 
 #include "platform.h"
 
+#include <pthread.h>
 #include <time.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
 
+#include "radix.h"
+#include "ratelimit.h"
 #include "user.h"
 
 #define QUARANTINE_FILENAME "quarantine.txt"
 
+/*
+ * Entries are owned by the quarantine; pointers to them are only valid
+ * until the next quarantine_add() or quarantine_remove().
+ */
 struct quarantine_entry {
 	struct user_id user;
-	time_t last_failure;
-	size_t failures;
-	bool is_blocked;
-	TAILQ_ENTRY(quarantine_entry) entries;
+	uint32_t failures;
+	time_t last_seen;
+	uint32_t post_tat, failure_tat;	// see ratelimit.h
+};
+
+/*
+ * Rate limiter state shared by all users of a network.
+ */
+struct quarantine_prefix {
+	uint32_t post_tat, failure_tat;
 };
 
 struct quarantine_list;
 
-struct quarantine_list  *quarantine_new(void);
+/*
+ * Workers share the quarantine, split into shards by address, so a user
+ * gets the same budget whichever worker they reach. Users of a network
+ * that is rate limited as a whole share the shard of the network.
+ * Entries may only be used with the lock of their shard held.
+ */
+struct quarantine_shard {
+	pthread_mutex_t lock;
+	struct quarantine_list *list;
+};
+
+struct quarantine_list  *quarantine_new(size_t, unsigned, unsigned);
 void                     quarantine_free(struct quarantine_list **);
 struct quarantine_entry *quarantine_add(struct quarantine_list *,
-    const struct user_id *);
+    const struct user_id *, time_t);
 struct quarantine_entry *quarantine_get_entry(struct quarantine_list *,
-    struct user_id);
+    const struct user_id *);
+void                     quarantine_touch(struct quarantine_list *,
+    struct quarantine_entry *, time_t);
 void                     quarantine_remove(struct quarantine_list *,
     struct quarantine_entry *);
-void                     quarantine_serialize(struct quarantine_list *, FILE *);
-bool                     quarantine_deserialize(struct quarantine_list *,
-    FILE *);
-
-void                     quarantine_entry_free(struct quarantine_entry **e);
+size_t                   quarantine_expire(struct quarantine_list *, time_t,
+    size_t);
+size_t                   quarantine_size(const struct quarantine_list *);
+struct quarantine_shard *quarantine_shard(struct quarantine_shard *, size_t,
+    const struct user_id *);
+struct quarantine_prefix *quarantine_get_prefix(struct quarantine_list *,
+    const struct user_id *);
+struct quarantine_prefix *quarantine_add_prefix(struct quarantine_list *,
+    const struct user_id *, uint32_t);
+void                     quarantine_expire_prefixes(struct quarantine_list *,
+    uint32_t);
+void                     quarantine_serialize(struct quarantine_shard *,
+    size_t, FILE *);
+bool                     quarantine_deserialize(struct quarantine_shard *,
+    size_t, FILE *);
+void                     quarantine_restore(struct quarantine_list *,
+    const struct ratelimit *);
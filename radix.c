@@ -0,0 +1,250 @@
+/**
+ * gmlgcd - the gemlog comment daemon
+ * Copyright (C) 2024 github.com/Sir-Photch
+ *
+ * This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "radix.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+
+#include "log.h"
+
+struct radix_node {
+	struct radix_node *child[2];
+	void *value;
+	uint8_t key[RADIX_KEY_BITS / 8];	// bits past the prefix are zero
+	uint8_t bits;
+};
+
+static inline unsigned
+bit(const uint8_t *key, unsigned i)
+{
+	return (key[i / 8] >> (7 - i % 8)) & 1;
+}
+
+/*
+ * Number of leading bits a and b have in common, at most max.
+ */
+static unsigned
+common_bits(const uint8_t *a, const uint8_t *b, unsigned max)
+{
+	unsigned i, n;
+	uint8_t x;
+
+	for (i = 0, n = 0; n < max; ++i, n += 8) {
+		if ((x = a[i] ^ b[i]) == 0)
+			continue;
+
+		while (!(x & 0x80)) {
+			x <<= 1;
+			n++;
+		}
+		break;
+	}
+
+	return n < max ? n : max;
+}
+
+static struct radix_node *
+node_new(const uint8_t *key, unsigned bits)
+{
+	struct radix_node *n;
+
+	if (!(n = calloc(1, sizeof(struct radix_node))))
+		errl(1, "calloc");
+
+	memcpy(n->key, key, (bits + 7) / 8);
+	if (bits % 8)
+		n->key[bits / 8] &= 0xff << (8 - bits % 8);
+	n->bits = bits;
+
+	return n;
+}
+
+static void
+node_free(struct radix_node *n, void (*free_value)(void *))
+{
+	if (!n)
+		return;
+
+	node_free(n->child[0], free_value);
+	node_free(n->child[1], free_value);
+
+	if (n->value && free_value)
+		free_value(n->value);
+	free(n);
+}
+
+void
+radix_init(struct radix *r)
+{
+	r->root = NULL;
+	r->n = 0;
+}
+
+void
+radix_free(struct radix *r, void (*free_value)(void *))
+{
+	node_free(r->root, free_value);
+	radix_init(r);
+}
+
+static struct radix_node *
+node_insert(struct radix *r, const uint8_t *key, unsigned bits)
+{
+	struct radix_node **link, *n, *glue, *leaf;
+	unsigned common;
+
+	for (link = &r->root; (n = *link); link = &n->child[bit(key, n->bits)]) {
+		common = common_bits(n->key, key, n->bits < bits ? n->bits :
+		    bits);
+
+		if (common == n->bits) {
+			if (common == bits)
+				return n;
+			continue;
+		}
+
+		leaf = node_new(key, bits);
+
+		if (common == bits) {
+			// key is a prefix of n
+			leaf->child[bit(n->key, bits)] = n;
+			*link = leaf;
+		} else {
+			glue = node_new(key, common);
+			glue->child[bit(n->key, common)] = n;
+			glue->child[bit(key, common)] = leaf;
+			*link = glue;
+		}
+
+		return leaf;
+	}
+
+	return *link = node_new(key, bits);
+}
+
+/*
+ * Sets the value of a prefix, replacing the previous one.
+ */
+void
+radix_insert(struct radix *r, const uint8_t *key, unsigned bits, void *value)
+{
+	struct radix_node *n;
+
+	n = node_insert(r, key, bits);
+	if (!n->value)
+		r->n++;
+	n->value = value;
+}
+
+void *
+radix_get(const struct radix *r, const uint8_t *key, unsigned bits)
+{
+	const struct radix_node *n;
+
+	for (n = r->root; n; n = n->child[bit(key, n->bits)]) {
+		if (n->bits > bits ||
+		    common_bits(n->key, key, n->bits) < n->bits)
+			return NULL;
+
+		if (n->bits == bits)
+			return n->value;
+	}
+
+	return NULL;
+}
+
+/*
+ * Longest prefix match: the value of the longest prefix of key.
+ */
+void *
+radix_match(const struct radix *r, const uint8_t *key, unsigned bits)
+{
+	const struct radix_node *n;
+	void *best = NULL;
+
+	for (n = r->root; n; n = n->child[bit(key, n->bits)]) {
+		if (n->bits > bits ||
+		    common_bits(n->key, key, n->bits) < n->bits)
+			break;
+
+		if (n->value)
+			best = n->value;
+
+		if (n->bits == bits)
+			break;
+	}
+
+	return best;
+}
+
+static struct radix_node *
+node_prune(struct radix *r, struct radix_node *n, radix_drop_cb drop,
+    void *arg)
+{
+	struct radix_node *child;
+
+	if (!n)
+		return NULL;
+
+	n->child[0] = node_prune(r, n->child[0], drop, arg);
+	n->child[1] = node_prune(r, n->child[1], drop, arg);
+
+	if (n->value && drop(n->value, arg)) {
+		n->value = NULL;
+		r->n--;
+	}
+
+	if (n->value || (n->child[0] && n->child[1]))
+		return n;
+
+	// no value and at most one child: the node only costs a hop
+	child = n->child[0] ? n->child[0] : n->child[1];
+	free(n);
+
+	return child;
+}
+
+/*
+ * Removes all values drop() returns true for, freeing them is up to drop().
+ */
+void
+radix_prune(struct radix *r, radix_drop_cb drop, void *arg)
+{
+	r->root = node_prune(r, r->root, drop, arg);
+}
+
+/*
+ * Writes the key of an address, returns the bit offset of the address.
+ */
+unsigned
+radix_addr_key(uint8_t *key, sa_family_t af, const void *addr)
+{
+	memset(key, 0, RADIX_KEY_BITS / 8);
+
+	if (af == AF_INET6) {
+		memcpy(key, addr, sizeof(struct in6_addr));
+		return 0;
+	}
+
+	key[10] = key[11] = 0xff;
+	memcpy(key + 12, addr, sizeof(struct in_addr));
+
+	return RADIX_V4_OFFSET;
+}
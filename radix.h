@@ -0,0 +1,50 @@
+/**
+ * gmlgcd - the gemlog comment daemon
+ * Copyright (C) 2024 github.com/Sir-Photch
+ *
+ * This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#define RADIX_KEY_BITS	128
+#define RADIX_V4_OFFSET	96	// IPv4 addresses are keyed as ::ffff:a.b.c.d
+
+struct radix_node;
+
+/*
+ * Path-compressed binary trie over bit strings of up to RADIX_KEY_BITS,
+ * mapping prefixes to values. Lookups take O(prefix length).
+ * Values belong to the caller, the trie never frees them.
+ */
+struct radix {
+	struct radix_node *root;
+	size_t n;			// nodes holding a value
+};
+
+typedef bool (*radix_drop_cb)(void *value, void *arg);
+
+void   radix_init(struct radix *);
+void   radix_free(struct radix *, void (*)(void *));
+void   radix_insert(struct radix *, const uint8_t *, unsigned, void *);
+void  *radix_get(const struct radix *, const uint8_t *, unsigned);
+void  *radix_match(const struct radix *, const uint8_t *, unsigned);
+void   radix_prune(struct radix *, radix_drop_cb, void *);
+
+unsigned radix_addr_key(uint8_t *, sa_family_t, const void *);
@@ -0,0 +1,95 @@
+/**
+ * gmlgcd - the gemlog comment daemon
+ * Copyright (C) 2024 github.com/Sir-Photch
+ *
+ * This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "ratelimit.h"
+
+#include <time.h>
+
+#include "log.h"
+
+#ifdef CLOCK_MONOTONIC_COARSE
+#define RATELIMIT_CLOCK CLOCK_MONOTONIC_COARSE
+#else
+#define RATELIMIT_CLOCK CLOCK_MONOTONIC
+#endif
+
+uint32_t
+ratelimit_now(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(RATELIMIT_CLOCK, &ts) == -1)
+		errl(1, "clock_gettime");
+
+	return (uint32_t)ts.tv_sec * (1000 / RATELIMIT_TICK_MS) +
+	    (uint32_t)(ts.tv_nsec / (RATELIMIT_TICK_MS * 1000000L));
+}
+
+uint32_t
+ratelimit_ticks(time_t seconds)
+{
+	if (seconds < 0)
+		return 0;
+	if ((uintmax_t)seconds > UINT32_MAX / (1000 / RATELIMIT_TICK_MS))
+		return UINT32_MAX;
+
+	return (uint32_t)seconds * (1000 / RATELIMIT_TICK_MS);
+}
+
+/*
+ * True if a token could be taken at now.
+ */
+bool
+ratelimit_allows(const struct ratelimit *rl, uint32_t tat, uint32_t now)
+{
+	if ((int32_t)(tat - now) < 0)
+		tat = now;
+
+	return tat + rl->interval - now <= rl->interval * rl->burst;
+}
+
+bool
+ratelimit_take(const struct ratelimit *rl, uint32_t *tat, uint32_t now)
+{
+	if (!ratelimit_allows(rl, *tat, now))
+		return false;
+
+	if ((int32_t)(*tat - now) < 0)
+		*tat = now;
+
+	*tat += rl->interval;
+
+	return true;
+}
+
+/*
+ * Sets up a bucket as if n tokens had been taken ago ticks before now.
+ */
+void
+ratelimit_restore(const struct ratelimit *rl, uint32_t *tat, uint32_t n,
+    uint32_t ago, uint32_t now)
+{
+	uint32_t debt;
+
+	if (n > rl->burst)
+		n = rl->burst;
+
+	debt = n * rl->interval;
+
+	*tat = debt > ago ? now + (debt - ago) : now;
+}
@@ -0,0 +1,42 @@
+/**
+ * gmlgcd - the gemlog comment daemon
+ * Copyright (C) 2024 github.com/Sir-Photch
+ *
+ * This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#define RATELIMIT_TICK_MS 100
+
+/*
+ * Token buckets in GCRA form: the state of a bucket is its theoretical
+ * arrival time (tat), in ticks of the monotonic clock. Ticks wrap around,
+ * so they're only ever compared through their difference.
+ */
+struct ratelimit {
+	uint32_t interval;	// ticks per token
+	uint32_t burst;		// bucket size
+};
+
+uint32_t ratelimit_now(void);
+uint32_t ratelimit_ticks(time_t);
+bool     ratelimit_allows(const struct ratelimit *, uint32_t, uint32_t);
+bool     ratelimit_take(const struct ratelimit *, uint32_t *, uint32_t);
+void     ratelimit_restore(const struct ratelimit *, uint32_t *, uint32_t,
+    uint32_t, uint32_t);
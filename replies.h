@@ -28,4 +28,8 @@
 #define HEADERS_NOT_ALLOWED "59 headers not allowed\r\n"
 #define LINKS_NOT_ALLOWED "59 links not allowed\r\n"
 #define TOO_MANY_LINES "59 too many lines\r\n"
+#define PREFORMATTED_NOT_ALLOWED "59 preformatted text not allowed\r\n"
+#define INVALID_TEXT "59 invalid utf-8\r\n"
 #define SLOW_DOWN "44 back off\r\n"
+#define BLOCKED "50 blocked\r\n"
+#define WRITE_FAILED "40 saving comment failed\r\n"
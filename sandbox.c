@@ -78,8 +78,11 @@ ruleset_compat(struct landlock_ruleset_attr *attr, bool allow_unsupported)
 #	include <sys/socket.h>
 #endif
 
+/*
+ * comments_fd is an open descriptor of cfg->comments_dir.
+ */
 void
-enter_the_sandbox(struct config *cfg)
+enter_the_sandbox(struct config *cfg, int comments_fd)
 {
 #if defined(__linux__)
 	int error, ruleset_fd;
@@ -115,11 +118,7 @@ enter_the_sandbox(struct config *cfg)
 		errl(1, "landlock_create_ruleset");
 
 	path.allowed_access = LANDLOCK_ACCESS_FS_WRITE_FILE;
-	path.parent_fd = open(cfg->comments_dir, O_PATH | O_CLOEXEC);
-	if (path.parent_fd == -1) {
-		close(ruleset_fd);
-		errl(1, "open %s", cfg->comments_dir);
-	}
+	path.parent_fd = comments_fd;
 	error = syscall(SYS_landlock_add_rule, ruleset_fd,
 	    LANDLOCK_RULE_PATH_BENEATH, &path, 0);
 	if (error) {
@@ -127,8 +126,6 @@ enter_the_sandbox(struct config *cfg)
 		errl(1, "landlock_add_rule");
 	}
 
-	close(path.parent_fd);
-
 	path.allowed_access =
 	    LANDLOCK_ACCESS_FS_TRUNCATE |
 	    LANDLOCK_ACCESS_FS_WRITE_FILE |
@@ -191,17 +188,26 @@ enter_the_sandbox(struct config *cfg)
 	close(ruleset_fd);
 
 #elif defined(__OpenBSD__)
-	unveil(cfg->comments_dir, "w");
+	char promises[64];
+
+	(void)comments_fd;
+
+	unveil(cfg->comments_dir, "rw");
 	unveil(cfg->persistent_dir, "crw");
 
-	if (cfg->af == AF_UNIX) {
+	if (cfg->af == AF_UNIX)
 		unveil(cfg->listen.runtime_dir, "c");
-		pledge("stdio rpath wpath cpath unix", NULL);
-	} else {
-		pledge("stdio rpath wpath cpath inet", NULL);
-	}
+
+	// the metrics listener may be of the other kind
+	snprintf(promises, sizeof(promises), "stdio rpath wpath cpath%s%s",
+	    cfg->af == AF_UNIX || cfg->metrics.af == AF_UNIX ? " unix" : "",
+	    cfg->af != AF_UNIX || cfg->metrics.af == AF_INET ||
+	    cfg->metrics.af == AF_INET6 ? " inet" : "");
+	pledge(promises, NULL);
 
 #else
+	(void)cfg;
+	(void)comments_fd;
 #	warning "unknown platform, don't know how to sandbox myself! :/"
 #endif
 
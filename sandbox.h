@@ -20,4 +20,4 @@
 
 #include "config.h"
 
-void enter_the_sandbox(struct config *);
+void enter_the_sandbox(struct config *, int);
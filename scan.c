@@ -0,0 +1,179 @@
+/**
+ * gmlgcd - the gemlog comment daemon
+ * Copyright (C) 2024 github.com/Sir-Photch
+ *
+ * This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "scan.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+
+#define SCAN_BLOCK 32
+
+static inline void
+scan_masks(const char *p, uint32_t *nl, uint32_t *hi, uint32_t *zero)
+{
+	__m256i v = _mm256_loadu_si256((const __m256i *)p);
+
+	*nl = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v,
+	    _mm256_set1_epi8('\n')));
+	*hi = _mm256_movemask_epi8(v);
+	*zero = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v,
+	    _mm256_setzero_si256()));
+}
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+
+#define SCAN_BLOCK 16
+
+static inline void
+scan_masks(const char *p, uint32_t *nl, uint32_t *hi, uint32_t *zero)
+{
+	__m128i v = _mm_loadu_si128((const __m128i *)p);
+
+	*nl = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+	*hi = _mm_movemask_epi8(v);
+	*zero = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128()));
+}
+#endif
+
+/*
+ * Returns the length of the UTF-8 sequence at p, or 0 if there is none.
+ * Overlong encodings, surrogates and anything beyond U+10FFFF are not.
+ */
+static size_t
+scan_utf8(const unsigned char *p, size_t n)
+{
+	uint32_t c;
+	size_t len, i;
+
+	if (p[0] < 0x80)
+		return 1;
+	if (p[0] < 0xc2)
+		return 0;
+
+	len = p[0] < 0xe0 ? 2 : p[0] < 0xf0 ? 3 : p[0] < 0xf5 ? 4 : 0;
+	if (len == 0 || len > n)
+		return 0;
+
+	c = p[0] & (0x7f >> len);
+	for (i = 1; i < len; ++i) {
+		if ((p[i] & 0xc0) != 0x80)
+			return 0;
+		c = c << 6 | (p[i] & 0x3f);
+	}
+
+	if ((len == 3 && (c < 0x800 || (c >= 0xd800 && c <= 0xdfff))) ||
+	    (len == 4 && (c < 0x10000 || c > 0x10ffff)))
+		return 0;
+
+	return len;
+}
+
+static void
+scan_line(const char *s, size_t len, size_t pos, struct scan_result *r)
+{
+	r->lines++;
+
+	switch (s[pos]) {
+	case '#':
+		r->flags |= SCAN_HEADER;
+		break;
+	case '=':
+		if (pos + 1 < len && s[pos + 1] == '>')
+			r->flags |= SCAN_LINK;
+		break;
+	case '`':
+		if (pos + 2 < len && s[pos + 1] == '`' && s[pos + 2] == '`')
+			r->flags |= SCAN_PREFORMATTED;
+		break;
+	default:
+		break;
+	}
+}
+
+/*
+ * A newline at pos starts a line, unless it ends the text.
+ */
+static inline void
+scan_newline(const char *s, size_t len, size_t start, size_t pos,
+    struct scan_result *r)
+{
+	if (pos >= start && pos + 1 < len)
+		scan_line(s, len, pos + 1, r);
+}
+
+/*
+ * Checks the len bytes of s in one pass: all of it has to be UTF-8, and
+ * from start on, which begins a line, lines are counted and checked for
+ * what gemtext would make of them. Blocks of ASCII without newlines are
+ * skipped with SIMD where available.
+ */
+void
+scan_text(const char *s, size_t len, size_t start, struct scan_result *r)
+{
+	const unsigned char *u = (const unsigned char *)s;
+	size_t i = 0, pos, seq, valid = 0;	// below valid is UTF-8
+#ifdef SCAN_BLOCK
+	uint32_t nl, hi, zero;
+#endif
+
+	memset(r, 0, sizeof(*r));
+
+	if (start < len)
+		scan_line(s, len, start, r);
+
+#ifdef SCAN_BLOCK
+	for (; i + SCAN_BLOCK <= len; i += SCAN_BLOCK) {
+		scan_masks(s + i, &nl, &hi, &zero);
+
+		if (zero) {
+			r->flags |= SCAN_INVALID;
+			return;
+		}
+
+		for (; nl; nl &= nl - 1)
+			scan_newline(s, len, start, i + __builtin_ctz(nl), r);
+
+		if (!hi || valid >= i + SCAN_BLOCK)
+			continue;
+
+		// sequences may run into the next block
+		pos = i + __builtin_ctz(hi);
+		for (pos = pos > valid ? pos : valid; pos < i + SCAN_BLOCK;
+		    pos += seq) {
+			if (!(seq = scan_utf8(u + pos, len - pos))) {
+				r->flags |= SCAN_INVALID;
+				return;
+			}
+		}
+		valid = pos;
+	}
+#endif
+
+	for (pos = i > valid ? i : valid; pos < len; pos += seq) {
+		if (u[pos] == '\n')
+			scan_newline(s, len, start, pos, r);
+
+		if (u[pos] == '\0' || !(seq = scan_utf8(u + pos, len - pos))) {
+			r->flags |= SCAN_INVALID;
+			return;
+		}
+	}
+}
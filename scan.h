@@ -0,0 +1,33 @@
+/**
+ * gmlgcd - the gemlog comment daemon
+ * Copyright (C) 2024 github.com/Sir-Photch
+ *
+ * This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+#define SCAN_HEADER		0x01	// a line starts with '#'
+#define SCAN_LINK		0x02	// ... with "=>"
+#define SCAN_PREFORMATTED	0x04	// ... with "```"
+#define SCAN_INVALID		0x08	// not UTF-8, or a NUL byte
+
+struct scan_result {
+	size_t lines;
+	unsigned flags;
+};
+
+void scan_text(const char *, size_t, size_t, struct scan_result *);
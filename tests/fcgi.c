@@ -0,0 +1,190 @@
+#include "../fcgi.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BUFSIZE 2048
+
+struct pair {
+	const char *name, *value;
+};
+
+static const struct pair pairs[] = {
+	{ "REMOTE_ADDR", "192.0.2.1" },
+	{ "EMPTY", "" },
+	{ "", "nameless" },
+	{ "GEMINI_SEARCH_STRING",
+	  "a value that is long enough to need a four byte length, which "
+	  "starts with the high bit set and goes on for another three bytes "
+	  "of big-endian length" },
+	{ "GEMINI_URL_PATH", "/comments/hello.gmi" },
+};
+
+#define NPAIRS (sizeof(pairs) / sizeof(pairs[0]))
+
+struct seen {
+	size_t n;
+	bool ok;
+};
+
+static size_t
+put_length(unsigned char *buf, size_t len)
+{
+	if (len < 0x80) {
+		buf[0] = len;
+		return 1;
+	}
+
+	buf[0] = (len >> 24) | 0x80;
+	buf[1] = len >> 16;
+	buf[2] = len >> 8;
+	buf[3] = len;
+
+	return 4;
+}
+
+static size_t
+put_pairs(unsigned char buf[BUFSIZE])
+{
+	size_t i, len = 0;
+
+	for (i = 0; i < NPAIRS; ++i) {
+		len += put_length(buf + len, strlen(pairs[i].name));
+		len += put_length(buf + len, strlen(pairs[i].value));
+		memcpy(buf + len, pairs[i].name, strlen(pairs[i].name));
+		len += strlen(pairs[i].name);
+		memcpy(buf + len, pairs[i].value, strlen(pairs[i].value));
+		len += strlen(pairs[i].value);
+	}
+
+	return len;
+}
+
+static bool
+check_pair(struct fcgi_request *r, const struct fcgi_param *p, void *arg)
+{
+	struct seen *seen = arg;
+	const struct pair *want;
+
+	(void)r;
+
+	if (seen->n >= NPAIRS) {
+		seen->ok = false;
+		return false;
+	}
+
+	want = &pairs[seen->n++];
+
+	if (p->name_len != strlen(want->name) ||
+	    p->value_len != strlen(want->value) ||
+	    memcmp(p->name, want->name, p->name_len) != 0 ||
+	    memcmp(p->value, want->value, p->value_len) != 0) {
+		fprintf(stderr, "pair %lu differs\n", seen->n - 1);
+		seen->ok = false;
+	}
+
+	return seen->ok;
+}
+
+/*
+ * Feeds the stream in records of at most step bytes, the first one cut
+ * at first, as if the web server split it anywhere it likes.
+ */
+static bool
+feed(const unsigned char *buf, size_t len, size_t first, size_t step)
+{
+	struct fcgi_request r;
+	struct seen seen = { 0, true };
+	size_t off, n;
+	bool ok;
+
+	memset(&r, 0, sizeof(r));
+	arena_init(&r.arena);
+
+	ok = fcgi_feed_params(&r, buf, first, check_pair, &seen);
+
+	for (off = first; ok && off < len; off += n) {
+		n = len - off < step ? len - off : step;
+		ok = fcgi_feed_params(&r, buf + off, n, check_pair, &seen);
+	}
+
+	arena_free(&r.arena);
+
+	if (!ok || seen.n != NPAIRS || r.carry_len != 0) {
+		fprintf(stderr, "split at %lu, then by %lu: %lu pairs\n",
+		    first, step, seen.n);
+		return false;
+	}
+
+	return true;
+}
+
+int
+params_test(void)
+{
+	unsigned char buf[BUFSIZE];
+	size_t len, first, step;
+
+	len = put_pairs(buf);
+
+	for (first = 0; first <= len; ++first) {
+		if (!feed(buf, len, first, len))
+			return 1;
+	}
+
+	for (step = 1; step <= 9; ++step) {
+		if (!feed(buf, len, 0, step))
+			return 1;
+	}
+
+	return 0;
+}
+
+int
+parse_test(void)
+{
+	unsigned char buf[BUFSIZE];
+	struct fcgi_param p;
+	size_t len, cut;
+
+	len = put_pairs(buf);
+
+	// nothing short of a whole pair parses
+	for (cut = 0; cut < 2 + strlen(pairs[0].name) +
+	    strlen(pairs[0].value); ++cut) {
+		if (fcgi_parse_param(buf, cut, &p) != 0)
+			return 1;
+	}
+
+	if (fcgi_parse_param(buf, len, &p) != (ssize_t)cut ||
+	    p.name_len != strlen(pairs[0].name) ||
+	    memcmp(p.value, pairs[0].value, p.value_len) != 0)
+		return 1;
+
+	// lengths adding up to more than FCGI_PARAMS_MAX
+	len = put_length(buf, FCGI_PARAMS_MAX);
+	len += put_length(buf + len, 1);
+	if (fcgi_parse_param(buf, len, &p) != -1)
+		return 1;
+
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	if (argc < 2) {
+		fprintf(stderr, "usage");
+		return 1;
+	}
+
+	if (strcmp(argv[1], "params") == 0)
+		return params_test();
+	else if (strcmp(argv[1], "parse") == 0)
+		return parse_test();
+	else {
+		fprintf(stderr, "usage");
+		return 1;
+	}
+}
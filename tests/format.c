@@ -0,0 +1,185 @@
+#include "../format.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define BUFSIZE 2048
+
+/*
+ * Values, in the order of enum format_field.
+ */
+struct values {
+	const char *user, *hash, *verb, *message, *date;
+};
+
+static const struct values full = {
+	"alice", "c0ffee", "writes", "hello", "2024-01-31 9:05"
+};
+
+static const struct values anonymous = {
+	"alice", "", "writes", "hello", "2024-01-31 9:05"
+};
+
+static const struct values silent = {
+	"", "", "", "", ""
+};
+
+static void
+set_values(struct format_value v[FORMAT_FIELDS], const struct values *from)
+{
+	size_t i;
+
+	v[FORMAT_USER].s = from->user;
+	v[FORMAT_HASH].s = from->hash;
+	v[FORMAT_VERB].s = from->verb;
+	v[FORMAT_MESSAGE].s = from->message;
+	v[FORMAT_DATE].s = from->date;
+
+	for (i = 0; i < FORMAT_FIELDS; ++i)
+		v[i].len = strlen(v[i].s);
+}
+
+static bool
+renders(const char *template, const struct values *from, const char *want)
+{
+	struct format f;
+	struct format_value v[FORMAT_FIELDS];
+	char buf[BUFSIZE];
+	const char *errstr;
+	size_t len;
+
+	if (!format_compile(&f, template, &errstr)) {
+		fprintf(stderr, "\"%s\": %s\n", template, errstr);
+		return false;
+	}
+
+	set_values(v, from);
+	len = format_render(&f, buf, sizeof(buf), v);
+	format_free(&f);
+
+	if (len != strlen(want) || strcmp(buf, want) != 0) {
+		fprintf(stderr, "\"%s\": \"%s\", expected \"%s\"\n", template,
+		    buf, want);
+		return false;
+	}
+
+	return true;
+}
+
+static bool
+refused(const char *template)
+{
+	struct format f;
+	const char *errstr = NULL;
+
+	if (!format_compile(&f, template, &errstr) && errstr)
+		return true;
+
+	fprintf(stderr, "\"%s\" compiled\n", template);
+	format_free(&f);
+
+	return false;
+}
+
+int
+render_test(void)
+{
+	bool ok;
+
+	ok = renders(FORMAT_DEFAULT, &full, "### alice (c0ffee) writes:\n"
+	    "hello\n--- 2024-01-31 9:05 (UTC)\n\n") &&
+	    renders(FORMAT_DEFAULT, &anonymous, "### alice writes:\n"
+	    "hello\n--- 2024-01-31 9:05 (UTC)\n\n") &&
+	    renders("", &full, "") &&
+	    renders("plain", &full, "plain") &&
+	    renders("{user}{hash}", &full, "alicec0ffee") &&
+	    renders("{{user}} [[{user}]] }}", &full, "{user} [alice] }") &&
+	    // groups at either end, empty or with nothing to leave out
+	    renders("[{hash}: ]{user}", &anonymous, "alice") &&
+	    renders("{user}[ ({hash})]", &anonymous, "alice") &&
+	    renders("{user}[ ({hash})]", &full, "alice (c0ffee)") &&
+	    renders("[]{user}[always]", &full, "alicealways") &&
+	    // any empty field drops the whole group
+	    renders("<[{user} {hash} {verb}]>", &anonymous, "<>") &&
+	    renders("<[{user} {verb}]>", &anonymous, "<alice writes>") &&
+	    // fields outside of groups are just empty
+	    renders("<{hash}>[{hash}]<{hash}>", &silent, "<><>") &&
+	    renders("[by {user}][ on {date}].", &silent, ".") &&
+	    renders("[a{user}][b{hash}][c{verb}]", &anonymous, "aalicecwrites");
+
+	return ok ? 0 : 1;
+}
+
+int
+compile_test(void)
+{
+	bool ok;
+
+	ok = refused("{nope}") &&
+	    refused("{user") &&
+	    refused("{}") &&
+	    refused("user}") &&
+	    refused("[{user}") &&
+	    refused("{user}]") &&
+	    refused("[[{user}]") &&
+	    refused("[a[{user}]]");
+
+	return ok ? 0 : 1;
+}
+
+/*
+ * Output is cut off like snprintf()'s, the length returned is not.
+ */
+int
+truncate_test(void)
+{
+	struct format f;
+	struct format_value v[FORMAT_FIELDS];
+	char buf[BUFSIZE];
+	const char *errstr, *want;
+	size_t n, len;
+
+	want = "### alice (c0ffee) writes:\nhello\n"
+	    "--- 2024-01-31 9:05 (UTC)\n\n";
+
+	if (!format_compile(&f, FORMAT_DEFAULT, &errstr))
+		return 1;
+
+	set_values(v, &full);
+
+	for (n = 0; n <= strlen(want) + 1; ++n) {
+		memset(buf, 'x', sizeof(buf));
+		len = format_render(&f, buf, n, v);
+
+		if (len != strlen(want) || buf[n] != 'x' ||
+		    (n > 0 && (strlen(buf) != n - 1 ||
+		    strncmp(buf, want, n - 1) != 0))) {
+			fprintf(stderr, "cut at %lu: \"%s\"\n", n, buf);
+			return 1;
+		}
+	}
+
+	format_free(&f);
+
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	if (argc < 2) {
+		fprintf(stderr, "usage");
+		return 1;
+	}
+
+	if (strcmp(argv[1], "render") == 0)
+		return render_test();
+	else if (strcmp(argv[1], "compile") == 0)
+		return compile_test();
+	else if (strcmp(argv[1], "truncate") == 0)
+		return truncate_test();
+	else {
+		fprintf(stderr, "usage");
+		return 1;
+	}
+}
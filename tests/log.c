@@ -0,0 +1,247 @@
+#include "../log.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define DATAGRAM_MAX	2048
+#define FIELDS_MAX	16
+
+struct field {
+	char name[32];
+	const char *value;
+	size_t len;
+};
+
+struct scratch {
+	char dir[32];
+	char path[64];
+	int fd;
+};
+
+static bool
+listen_here(struct scratch *s)
+{
+	struct sockaddr_un sun = { .sun_family = AF_UNIX };
+
+	strcpy(s->dir, "/tmp/gmlgcd-test.XXXXXX");
+	if (!mkdtemp(s->dir))
+		return false;
+
+	snprintf(s->path, sizeof(s->path), "%s/socket", s->dir);
+	snprintf(sun.sun_path, sizeof(sun.sun_path), "%s", s->path);
+
+	return (s->fd = socket(AF_UNIX, SOCK_DGRAM, 0)) != -1 &&
+	    bind(s->fd, (struct sockaddr *)&sun, sizeof(sun)) == 0;
+}
+
+static void
+clean_up(struct scratch *s)
+{
+	if (s->fd != -1)
+		close(s->fd);
+	unlink(s->path);
+	rmdir(s->dir);
+}
+
+/*
+ * Splits a datagram of the native protocol into its fields: NAME=value
+ * lines, or a name followed by a little endian length and the value.
+ */
+static size_t
+parse(const char *buf, size_t len, struct field fields[FIELDS_MAX])
+{
+	const char *p = buf, *end = buf + len, *eol, *eq;
+	size_t n = 0, i;
+	uint64_t vlen;
+
+	while (p < end && n < FIELDS_MAX) {
+		if (!(eol = memchr(p, '\n', end - p)))
+			return 0;
+
+		eq = memchr(p, '=', eol - p);
+		snprintf(fields[n].name, sizeof(fields[n].name), "%.*s",
+		    (int)((eq ? eq : eol) - p), p);
+
+		if (eq) {
+			fields[n].value = eq + 1;
+			fields[n].len = eol - eq - 1;
+			p = eol + 1;
+		} else {
+			if (end - eol - 1 < 8)
+				return 0;
+			for (vlen = 0, i = 0; i < 8; ++i)
+				vlen |= (uint64_t)(unsigned char)eol[1 + i] <<
+				    (8 * i);
+			if ((uint64_t)(end - eol - 9) < vlen + 1 ||
+			    eol[9 + vlen] != '\n')
+				return 0;
+
+			fields[n].value = eol + 9;
+			fields[n].len = vlen;
+			p = eol + 10 + vlen;
+		}
+
+		n++;
+	}
+
+	return p == end ? n : 0;
+}
+
+static bool
+has(const struct field *fields, size_t n, const char *name,
+    const char *value)
+{
+	size_t i;
+
+	for (i = 0; i < n; ++i) {
+		if (strcmp(fields[i].name, name) != 0)
+			continue;
+
+		if (!value || fields[i].len != strlen(value) ||
+		    memcmp(fields[i].value, value, fields[i].len) != 0) {
+			fprintf(stderr, "%s=%.*s, expected %s\n", name,
+			    (int)fields[i].len, fields[i].value,
+			    value ? value : "none");
+			return false;
+		}
+
+		return true;
+	}
+
+	if (value)
+		fprintf(stderr, "no %s\n", name);
+
+	return value == NULL;
+}
+
+/*
+ * Lines go out as datagrams with the request's fields, the message in
+ * binary form so it may contain newlines.
+ */
+int
+journald_test(void)
+{
+	struct scratch s = { .fd = -1 };
+	struct field fields[FIELDS_MAX];
+	char buf[DATAGRAM_MAX];
+	ssize_t len;
+	size_t n;
+	bool ok;
+
+	if (!listen_here(&s)) {
+		perror("listen_here");
+		clean_up(&s);
+		return 1;
+	}
+
+	log_start(s.path);
+
+	__log_context.rid = 7;
+	__log_context.rhost = "192.0.2.1";
+	__log_context.server_name = "example.org";
+	__log_context.file = "posts/hello.gmi";
+	__log_context.outcome = "posted";
+	errno = EACCES;
+	log_emit(LOG_LEVEL_WARNING, errno, "two\nlines, %d", 42);
+
+	log_context_reset();
+	log_emit(LOG_LEVEL_MESSAGE, -1, "no request");
+
+	log_stop();
+
+	ok = (len = recv(s.fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0 &&
+	    (n = parse(buf, len, fields)) > 0 &&
+	    has(fields, n, "PRIORITY", "4") &&
+	    has(fields, n, "ERRNO", "13") &&
+	    has(fields, n, "REQUEST_ID", "7") &&
+	    has(fields, n, "RHOST", "192.0.2.1") &&
+	    has(fields, n, "SERVER_NAME", "example.org") &&
+	    has(fields, n, "COMMENT_FILE", "posts/hello.gmi") &&
+	    has(fields, n, "OUTCOME", "posted") &&
+	    has(fields, n, "MESSAGE", "two\nlines, 42: Permission denied");
+
+	ok = ok && (len = recv(s.fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0 &&
+	    (n = parse(buf, len, fields)) > 0 &&
+	    has(fields, n, "PRIORITY", "6") &&
+	    has(fields, n, "MESSAGE", "no request") &&
+	    has(fields, n, "ERRNO", NULL) &&
+	    has(fields, n, "REQUEST_ID", NULL) &&
+	    has(fields, n, "RHOST", NULL) &&
+	    has(fields, n, "OUTCOME", NULL);
+
+	ok = ok && recv(s.fd, buf, sizeof(buf), MSG_DONTWAIT) == -1;
+
+	clean_up(&s);
+
+	return ok ? 0 : 1;
+}
+
+/*
+ * Once journald is gone, lines are written to stdout and stderr.
+ */
+int
+journald_lost_test(void)
+{
+	struct scratch s = { .fd = -1 };
+	char out[] = "/tmp/gmlgcd-test.XXXXXX", buf[DATAGRAM_MAX];
+	ssize_t len;
+	int fd, saved;
+	bool ok;
+
+	if (!listen_here(&s) || (fd = mkstemp(out)) == -1) {
+		perror("listen_here");
+		clean_up(&s);
+		return 1;
+	}
+
+	saved = dup(STDERR_FILENO);
+	dup2(fd, STDOUT_FILENO);
+	dup2(fd, STDERR_FILENO);
+
+	log_start(s.path);
+
+	close(s.fd);
+	s.fd = -1;
+
+	log_emit(LOG_LEVEL_MESSAGE, -1, "after journald");
+	log_stop();
+
+	dup2(saved, STDERR_FILENO);
+
+	len = pread(fd, buf, sizeof(buf) - 1, 0);
+	buf[len > 0 ? len : 0] = '\0';
+
+	ok = strstr(buf, "logging to stdout instead") &&
+	    strstr(buf, ": after journald\n");
+	if (!ok)
+		fprintf(stderr, "output: %s\n", buf);
+
+	close(fd);
+	unlink(out);
+	clean_up(&s);
+
+	return ok ? 0 : 1;
+}
+
+int
+main(int argc, char **argv)
+{
+	if (argc < 2) {
+		fprintf(stderr, "usage");
+		return 1;
+	}
+
+	if (strcmp(argv[1], "journald") == 0)
+		return journald_test();
+	else if (strcmp(argv[1], "journald-lost") == 0)
+		return journald_lost_test();
+	else {
+		fprintf(stderr, "usage");
+		return 1;
+	}
+}
@@ -0,0 +1,294 @@
+#include "../quarantine.h"
+
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#define USERS	512
+#define ROUNDS	50000
+#define FLOOD	200000
+#define SHARDS	4
+
+static void
+user(struct user_id *id, size_t i)
+{
+	memset(id, 0, sizeof(*id));
+	id->af = AF_INET;
+	id->rhost.v4.s_addr = htonl(0xc0000200 + i / 4);
+	snprintf(id->hash, sizeof(id->hash), "%lu", i % 4);
+}
+
+/*
+ * Every user the model has is found with its last_seen, the others are
+ * not, and the list is ordered by last_seen.
+ */
+static bool
+check(struct quarantine_list *q, const time_t seen[USERS])
+{
+	struct quarantine_entry *e;
+	struct user_id id;
+	size_t i, n = 0;
+
+	for (i = 0; i < USERS; ++i) {
+		user(&id, i);
+		e = quarantine_get_entry(q, &id);
+
+		if ((e != NULL) != (seen[i] != 0) ||
+		    (e && e->last_seen != seen[i])) {
+			fprintf(stderr, "user %lu: %s\n", i,
+			    e ? "wrong or unexpected" : "lost");
+			return false;
+		}
+
+		n += e != NULL;
+	}
+
+	if (quarantine_size(q) != n) {
+		fprintf(stderr, "size %lu, expected %lu\n",
+		    quarantine_size(q), n);
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Random adds, touches and removes against a model. At a load factor of
+ * up to 1/2 clusters form and wrap around the table, so removals have
+ * to shift entries back, across the end of the table too.
+ */
+int
+remove_test(void)
+{
+	struct quarantine_list *q;
+	struct quarantine_entry *e;
+	struct user_id id;
+	time_t seen[USERS] = { 0 }, now;
+	size_t i, round;
+
+	if (!(q = quarantine_new(USERS, 0, 0)))
+		return 1;
+
+	srand(1);
+
+	for (round = 0, now = 1; round < ROUNDS; ++round, ++now) {
+		i = rand() % USERS;
+		user(&id, i);
+
+		if (rand() % 3 == 0) {
+			if ((e = quarantine_get_entry(q, &id)))
+				quarantine_remove(q, e);
+			seen[i] = 0;
+		} else {
+			e = quarantine_add(q, &id, now);
+			quarantine_touch(q, e, now);
+			seen[i] = now;
+		}
+
+		if (round % 1000 == 0 && !check(q, seen))
+			return 1;
+	}
+
+	if (!check(q, seen))
+		return 1;
+
+	// expiry walks the list, which removals have to keep linked
+	for (now -= USERS; now < ROUNDS; now += 64) {
+		quarantine_expire(q, now, SIZE_MAX);
+
+		for (i = 0; i < USERS; ++i) {
+			if (seen[i] < now)
+				seen[i] = 0;
+		}
+
+		if (!check(q, seen))
+			return 1;
+	}
+
+	quarantine_free(&q);
+
+	return 0;
+}
+
+/*
+ * Once full, adding evicts whoever was seen longest ago.
+ */
+int
+evict_test(void)
+{
+	struct quarantine_list *q;
+	struct user_id id;
+	time_t seen[USERS] = { 0 };
+	size_t i;
+
+	if (!(q = quarantine_new(USERS / 2, 0, 0)))
+		return 1;
+
+	for (i = 0; i < USERS; ++i) {
+		user(&id, i);
+		quarantine_add(q, &id, i + 1);
+
+		seen[i] = i + 1;
+		if (i >= USERS / 2)
+			seen[i - USERS / 2] = 0;
+	}
+
+	if (!check(q, seen))
+		return 1;
+
+	quarantine_free(&q);
+
+	return 0;
+}
+
+static void
+flood_user(struct user_id *id, size_t i)
+{
+	memset(id, 0, sizeof(*id));
+	id->af = AF_INET;
+	id->rhost.v4.s_addr = htonl(0x0a000000 + i);
+}
+
+/*
+ * A new address every second, as from a flood of rotating addresses.
+ * Adding has to stay O(1), or this takes minutes, and expiry has to find
+ * the list in order.
+ */
+int
+flood_test(void)
+{
+	struct quarantine_list *q;
+	struct user_id id;
+	size_t i, n;
+
+	if (!(q = quarantine_new(FLOOD, 0, 0)))
+		return 1;
+
+	for (i = 0; i < FLOOD; ++i) {
+		flood_user(&id, i);
+		quarantine_add(q, &id, i + 1);
+	}
+
+	if (quarantine_size(q) != FLOOD)
+		return 1;
+
+	// oldest first: each step drops exactly the entries before it
+	for (i = 0; i < FLOOD; i += n) {
+		n = quarantine_expire(q, i + 1 + 1000, SIZE_MAX);
+
+		if (n != (FLOOD - i < 1000 ? FLOOD - i : 1000) ||
+		    quarantine_size(q) != FLOOD - i - n) {
+			fprintf(stderr, "expired %lu at %lu\n", n, i);
+			return 1;
+		}
+	}
+
+	quarantine_free(&q);
+
+	return 0;
+}
+
+/*
+ * Shards written out and read back hold the same entries, wherever those
+ * end up.
+ */
+int
+roundtrip_test(void)
+{
+	struct quarantine_shard out[SHARDS], in[SHARDS];
+	struct quarantine_entry *e;
+	struct user_id id;
+	FILE *f;
+	long long seen, last;
+	size_t i, n;
+
+	for (i = 0; i < SHARDS; ++i) {
+		if (!(out[i].list = quarantine_new(USERS, 0, 0)) ||
+		    !(in[i].list = quarantine_new(USERS, 0, 0)))
+			return 1;
+	}
+
+	for (i = 0; i < USERS; ++i) {
+		user(&id, i);
+		e = quarantine_add(quarantine_shard(out, SHARDS, &id)->list,
+		    &id, 1000 + i);
+		e->failures = i % 7;
+	}
+
+	if (!(f = tmpfile()))
+		return 1;
+
+	quarantine_serialize(out, SHARDS, f);
+	rewind(f);
+
+	// oldest first, so reading it back only ever appends
+	for (last = 0; fscanf(f, "%*[^|]|%*[^|]|%lld|%*u\n", &seen) == 1;
+	    last = seen) {
+		if (seen < last) {
+			fprintf(stderr, "%lld written after %lld\n", seen, last);
+			return 1;
+		}
+	}
+	rewind(f);
+
+	if (!quarantine_deserialize(in, SHARDS, f))
+		return 1;
+	fclose(f);
+
+	for (i = 0, n = 0; i < USERS; ++i) {
+		user(&id, i);
+		e = quarantine_get_entry(quarantine_shard(in, SHARDS,
+		    &id)->list, &id);
+
+		if (!e || e->last_seen != (time_t)(1000 + i) ||
+		    e->failures != i % 7) {
+			fprintf(stderr, "user %lu not restored\n", i);
+			return 1;
+		}
+	}
+
+	for (i = 0; i < SHARDS; ++i) {
+		n += quarantine_size(in[i].list);
+
+		// in order, or expiry would stop early
+		quarantine_expire(in[i].list, 1000 + USERS / 2, SIZE_MAX);
+		n -= quarantine_size(in[i].list);
+
+		quarantine_free(&out[i].list);
+	}
+
+	if (n != USERS / 2) {
+		fprintf(stderr, "%lu expired, expected %d\n", n, USERS / 2);
+		return 1;
+	}
+
+	for (i = 0; i < SHARDS; ++i)
+		quarantine_free(&in[i].list);
+
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	if (argc < 2) {
+		fprintf(stderr, "usage");
+		return 1;
+	}
+
+	if (strcmp(argv[1], "remove") == 0)
+		return remove_test();
+	else if (strcmp(argv[1], "evict") == 0)
+		return evict_test();
+	else if (strcmp(argv[1], "flood") == 0)
+		return flood_test();
+	else if (strcmp(argv[1], "roundtrip") == 0)
+		return roundtrip_test();
+	else {
+		fprintf(stderr, "usage");
+		return 1;
+	}
+}
@@ -0,0 +1,232 @@
+#include "../radix.h"
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PREFIXES	300
+#define LOOKUPS		20000
+
+/*
+ * Parses an address with an optional /length into its key, returns the
+ * number of bits that count.
+ */
+static unsigned
+cidr(uint8_t key[RADIX_KEY_BITS / 8], const char *s)
+{
+	char addr[INET6_ADDRSTRLEN];
+	const char *slash;
+	unsigned char buf[sizeof(struct in6_addr)];
+	unsigned offset, bits;
+	sa_family_t af;
+
+	slash = strchr(s, '/');
+	snprintf(addr, sizeof(addr), "%.*s", slash ? (int)(slash - s) :
+	    (int)strlen(s), s);
+
+	af = strchr(addr, ':') ? AF_INET6 : AF_INET;
+	if (inet_pton(af, addr, buf) != 1) {
+		fprintf(stderr, "bad address %s\n", addr);
+		exit(1);
+	}
+
+	offset = radix_addr_key(key, af, buf);
+	bits = af == AF_INET6 ? 128 : 32;
+
+	return offset + (slash ? (unsigned)atoi(slash + 1) : bits);
+}
+
+static void
+insert(struct radix *r, const char *s)
+{
+	uint8_t key[RADIX_KEY_BITS / 8];
+	unsigned bits;
+
+	bits = cidr(key, s);
+	radix_insert(r, key, bits, (void *)s);
+}
+
+static bool
+expect(const struct radix *r, const char *addr, const char *network)
+{
+	uint8_t key[RADIX_KEY_BITS / 8];
+	const char *got;
+
+	got = radix_match(r, key, cidr(key, addr));
+
+	if (got == network || (got && network && strcmp(got, network) == 0))
+		return true;
+
+	fprintf(stderr, "%s: matched %s, expected %s\n", addr,
+	    got ? got : "nothing", network ? network : "nothing");
+
+	return false;
+}
+
+int
+match_test(void)
+{
+	struct radix r;
+	uint8_t key[RADIX_KEY_BITS / 8];
+	bool ok;
+
+	radix_init(&r);
+
+	// out of order, so prefixes end up both above and below glue
+	insert(&r, "10.1.2.3/32");
+	insert(&r, "10.0.0.0/8");
+	insert(&r, "10.1.0.0/16");
+	insert(&r, "2001:db8::1/128");
+	insert(&r, "2001:db8::/32");
+	insert(&r, "192.168.0.0/24");
+	insert(&r, "192.168.1.0/24");
+
+	ok = expect(&r, "10.1.2.3", "10.1.2.3/32") &&
+	    expect(&r, "10.1.2.4", "10.1.0.0/16") &&
+	    expect(&r, "10.2.0.0", "10.0.0.0/8") &&
+	    expect(&r, "10.255.255.255", "10.0.0.0/8") &&
+	    expect(&r, "11.0.0.0", NULL) &&
+	    expect(&r, "9.255.255.255", NULL) &&
+	    expect(&r, "192.168.0.255", "192.168.0.0/24") &&
+	    expect(&r, "192.168.1.0", "192.168.1.0/24") &&
+	    expect(&r, "192.168.2.0", NULL) &&
+	    expect(&r, "2001:db8::1", "2001:db8::1/128") &&
+	    expect(&r, "2001:db8::2", "2001:db8::/32") &&
+	    expect(&r, "2001:db8:ffff::", "2001:db8::/32") &&
+	    expect(&r, "2001:db9::", NULL) &&
+	    // the v4-mapped form of an address is the address
+	    expect(&r, "::ffff:10.1.2.3", "10.1.2.3/32");
+
+	if (!ok)
+		return 1;
+
+	// exact lookups don't fall back to shorter prefixes
+	if (radix_get(&r, key, cidr(key, "10.1.0.0/16")) == NULL ||
+	    radix_get(&r, key, cidr(key, "10.1.0.0/17")) != NULL ||
+	    radix_get(&r, key, cidr(key, "10.1.2.3")) == NULL ||
+	    r.n != 7)
+		return 1;
+
+	// 0.0.0.0/0 covers IPv4 only, ::/0 everything
+	insert(&r, "0.0.0.0/0");
+	if (!expect(&r, "11.0.0.0", "0.0.0.0/0") ||
+	    !expect(&r, "10.1.2.4", "10.1.0.0/16") ||
+	    !expect(&r, "2001:db9::", NULL))
+		return 1;
+
+	insert(&r, "::/0");
+	if (!expect(&r, "2001:db9::", "::/0") ||
+	    !expect(&r, "11.0.0.0", "0.0.0.0/0") ||
+	    !expect(&r, "2001:db8::1", "2001:db8::1/128"))
+		return 1;
+
+	radix_free(&r, NULL);
+
+	return 0;
+}
+
+static bool
+drop_odd(void *value, void *arg)
+{
+	(void)arg;
+
+	return (*(unsigned *)value & 1) != 0;
+}
+
+static bool
+covers(const uint8_t *prefix, unsigned bits, const uint8_t *key)
+{
+	unsigned i;
+
+	for (i = 0; i < bits; ++i) {
+		if (((prefix[i / 8] ^ key[i / 8]) >> (7 - i % 8)) & 1)
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Longest prefix matches against a linear search, before and after
+ * pruning. Keys share their first bytes, so prefixes nest a lot.
+ */
+int
+model_test(void)
+{
+	struct radix r;
+	uint8_t keys[PREFIXES][RADIX_KEY_BITS / 8], key[RADIX_KEY_BITS / 8];
+	unsigned bits[PREFIXES], ids[PREFIXES], *want, *got;
+	size_t i, j, k;
+	bool live[PREFIXES], pruned = false;
+
+	radix_init(&r);
+	srand(1);
+
+	for (i = 0; i < PREFIXES; ++i) {
+		memset(keys[i], 0, sizeof(keys[i]));
+		for (k = 13; k < sizeof(keys[i]); ++k)
+			keys[i][k] = rand() & (k == 13 ? 0x3 : 0xff);
+
+		// anything from /0 down to /128, mostly near the end
+		bits[i] = rand() % 4 ? 96 + rand() % 33 : rand() % 129;
+		ids[i] = i;
+
+		// the same prefix once more would take over the node
+		if ((live[i] = !radix_get(&r, keys[i], bits[i])))
+			radix_insert(&r, keys[i], bits[i], &ids[i]);
+	}
+
+again:
+	for (j = 0; j < LOOKUPS; ++j) {
+		memcpy(key, keys[rand() % PREFIXES], sizeof(key));
+		key[15] ^= rand() & 0xf;
+
+		want = NULL;
+		for (i = 0; i < PREFIXES; ++i) {
+			if (!live[i] || (pruned && (ids[i] & 1)) ||
+			    !covers(keys[i], bits[i], key))
+				continue;
+			if (!want || bits[i] > bits[*want])
+				want = &ids[i];
+		}
+
+		got = radix_match(&r, key, RADIX_KEY_BITS);
+
+		if (got != want) {
+			fprintf(stderr, "lookup %lu%s: got /%d, expected /%d\n",
+			    j, pruned ? " after pruning" : "",
+			    got ? (int)bits[*got] : -1,
+			    want ? (int)bits[*want] : -1);
+			return 1;
+		}
+	}
+
+	if (!pruned) {
+		radix_prune(&r, drop_odd, NULL);
+		pruned = true;
+		goto again;
+	}
+
+	radix_free(&r, NULL);
+
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	if (argc < 2) {
+		fprintf(stderr, "usage");
+		return 1;
+	}
+
+	if (strcmp(argv[1], "match") == 0)
+		return match_test();
+	else if (strcmp(argv[1], "model") == 0)
+		return model_test();
+	else {
+		fprintf(stderr, "usage");
+		return 1;
+	}
+}
@@ -0,0 +1,223 @@
+#include "../scan.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TEXT_MAX	160
+#define ROUNDS		200000
+
+/*
+ * Well-formed sequences after table 3-7 of the Unicode standard: the
+ * allowed range of each byte, by lead byte.
+ */
+static size_t
+utf8_len(const unsigned char *p, size_t n)
+{
+	static const struct {
+		unsigned char lead_lo, lead_hi, lo, hi;
+		size_t len;
+	} forms[] = {
+		{ 0x00, 0x7f, 0x00, 0x00, 1 },
+		{ 0xc2, 0xdf, 0x80, 0xbf, 2 },
+		{ 0xe0, 0xe0, 0xa0, 0xbf, 3 },
+		{ 0xe1, 0xec, 0x80, 0xbf, 3 },
+		{ 0xed, 0xed, 0x80, 0x9f, 3 },
+		{ 0xee, 0xef, 0x80, 0xbf, 3 },
+		{ 0xf0, 0xf0, 0x90, 0xbf, 4 },
+		{ 0xf1, 0xf3, 0x80, 0xbf, 4 },
+		{ 0xf4, 0xf4, 0x80, 0x8f, 4 },
+	};
+	size_t i, k;
+
+	for (i = 0; i < sizeof(forms) / sizeof(forms[0]); ++i) {
+		if (p[0] < forms[i].lead_lo || p[0] > forms[i].lead_hi)
+			continue;
+
+		if (forms[i].len > n)
+			return 0;
+
+		// only the second byte has a range of its own
+		for (k = 1; k < forms[i].len; ++k) {
+			if (p[k] < (k == 1 ? forms[i].lo : 0x80) ||
+			    p[k] > (k == 1 ? forms[i].hi : 0xbf))
+				return 0;
+		}
+
+		return forms[i].len;
+	}
+
+	return 0;
+}
+
+static void
+reference(const char *s, size_t len, size_t start, struct scan_result *r)
+{
+	const unsigned char *u = (const unsigned char *)s;
+	size_t pos, seq;
+
+	memset(r, 0, sizeof(*r));
+
+	for (pos = 0; pos < len; pos += seq) {
+		if (u[pos] == '\0' || !(seq = utf8_len(u + pos, len - pos))) {
+			r->flags = SCAN_INVALID;
+			return;
+		}
+	}
+
+	for (pos = start; pos < len; ++pos) {
+		if (pos > start && s[pos - 1] != '\n')
+			continue;
+
+		r->lines++;
+
+		if (s[pos] == '#')
+			r->flags |= SCAN_HEADER;
+		else if (len - pos >= 2 && strncmp(s + pos, "=>", 2) == 0)
+			r->flags |= SCAN_LINK;
+		else if (len - pos >= 3 && strncmp(s + pos, "```", 3) == 0)
+			r->flags |= SCAN_PREFORMATTED;
+	}
+}
+
+/*
+ * Scans a copy without any slack behind it, so reads past the end show
+ * up under a sanitizer.
+ */
+static bool
+same(const char *s, size_t len, size_t start)
+{
+	struct scan_result got, want;
+	char *copy;
+	size_t i;
+
+	if (!(copy = malloc(len ? len : 1)))
+		return false;
+	memcpy(copy, s, len);
+
+	scan_text(copy, len, start, &got);
+	reference(copy, len, start, &want);
+	free(copy);
+
+	// where the text is invalid, lines and flags are of no interest
+	if (want.flags & SCAN_INVALID ? got.flags & SCAN_INVALID :
+	    got.flags == want.flags && got.lines == want.lines)
+		return true;
+
+	fprintf(stderr, "len %lu, start %lu: lines %lu flags %#x, expected "
+	    "lines %lu flags %#x\n", len, start, got.lines, got.flags,
+	    want.lines, want.flags);
+	for (i = 0; i < len; ++i)
+		fprintf(stderr, "%02x%c", (unsigned char)s[i],
+		    i + 1 < len ? ' ' : '\n');
+
+	return false;
+}
+
+/*
+ * Every sequence at every offset around the 16 and 32 byte blocks SIMD
+ * scans in, in ASCII text of every length up to two blocks beyond.
+ */
+int
+edges_test(void)
+{
+	static const char *seqs[] = {
+		"\n", "\n#", "\n=>", "\n```", "\xc3\xa4", "\xe2\x82\xac",
+		"\xf0\x9f\x98\x80", "\xf4\x8f\xbf\xbf", "\xed\x9f\xbf",
+		"\xee\x80\x80", "\xef\xbf\xbf",
+		// invalid: stray, overlong, surrogate, too large, cut short
+		"\x80", "\xbf", "\xc0\x80", "\xc1\xbf", "\xe0\x80\x80",
+		"\xed\xa0\x80", "\xf0\x80\x80\x80", "\xf4\x90\x80\x80",
+		"\xf5\x80\x80\x80", "\xff", "\xc3", "\xe2\x82", "\xf0\x9f\x98",
+		"\xe2\x28\xa1",
+	};
+	char text[TEXT_MAX];
+	size_t i, off, len, n;
+
+	for (i = 0; i < sizeof(seqs) / sizeof(seqs[0]); ++i) {
+		n = strlen(seqs[i]);
+
+		for (len = n; len <= 96; ++len) {
+			for (off = 0; off + n <= len; ++off) {
+				memset(text, 'a', len);
+				memcpy(text + off, seqs[i], n);
+
+				if (!same(text, len, 0) ||
+				    !same(text, len, off) ||
+				    !same(text, len, len))
+					return 1;
+			}
+		}
+	}
+
+	// a NUL anywhere
+	for (len = 1; len <= 96; ++len) {
+		for (off = 0; off < len; ++off) {
+			memset(text, 'a', len);
+			text[off] = '\0';
+
+			if (!same(text, len, 0))
+				return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Random text from pieces that matter to the scanner.
+ */
+int
+random_test(void)
+{
+	static const char *pieces[] = {
+		"a", "a", "a", "a", "a", "a", "a", "a", " ", "\n", "\n", "#",
+		"=", ">", "`", "\xc3\xa4", "\xe2\x82\xac", "\xf0\x9f\x98\x80",
+		"\x80", "\xc3", "\xed\xa0\x80", "\0",
+	};
+	char text[TEXT_MAX];
+	size_t round, len, n;
+	const char *piece;
+
+	srand(1);
+
+	for (round = 0; round < ROUNDS; ++round) {
+		for (len = 0, n = rand() % 100; len < n; len += strlen(piece)
+		    + !*piece) {
+			piece = pieces[rand() % (sizeof(pieces) /
+			    sizeof(pieces[0]))];
+			// rarely invalid, or there's little left to compare
+			if (((unsigned char)*piece >= 0x80 &&
+			    strlen(piece) == 1) || !*piece ||
+			    (unsigned char)piece[1] == 0xa0) {
+				if (rand() % 16)
+					piece = "a";
+			}
+			memcpy(text + len, piece, strlen(piece) + !*piece);
+		}
+
+		if (!same(text, len, rand() % (len + 1)))
+			return 1;
+	}
+
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	if (argc < 2) {
+		fprintf(stderr, "usage");
+		return 1;
+	}
+
+	if (strcmp(argv[1], "edges") == 0)
+		return edges_test();
+	else if (strcmp(argv[1], "random") == 0)
+		return random_test();
+	else {
+		fprintf(stderr, "usage");
+		return 1;
+	}
+}
@@ -0,0 +1,58 @@
+/**
+ * gmlgcd - the gemlog comment daemon
+ * Copyright (C) 2024 github.com/Sir-Photch
+ *
+ * This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "timecache.h"
+
+#include <event2/event.h>
+
+#include "log.h"
+#include "ratelimit.h"
+
+#define TICKS_PER_SECOND	(1000 / RATELIMIT_TICK_MS)
+
+void
+timecache_init(struct timecache *tc, struct event_base *evbase)
+{
+	tc->evbase = evbase;
+	tc->minute = -1;
+	tc->tick = ratelimit_now();
+	tc->offset = time(NULL) - tc->tick / TICKS_PER_SECOND;
+
+	timecache_update(tc);
+}
+
+void
+timecache_update(struct timecache *tc)
+{
+	struct timeval tv;
+	struct tm utc;
+
+	tc->tick = ratelimit_now();
+	tc->now = tc->offset + tc->tick / TICKS_PER_SECOND;
+
+	// cached by libevent while callbacks run, no syscall then
+	if (event_base_gettimeofday_cached(tc->evbase, &tv) != 0)
+		errxl(1, "event_base_gettimeofday_cached");
+
+	if (tv.tv_sec / 60 == tc->minute)
+		return;
+
+	tc->minute = tv.tv_sec / 60;
+	gmtime_r(&tv.tv_sec, &utc);
+	tc->date_len = format_date(tc->date, &utc);
+}
@@ -0,0 +1,44 @@
+/**
+ * gmlgcd - the gemlog comment daemon
+ * Copyright (C) 2024 github.com/Sir-Photch
+ *
+ * This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "format.h"
+
+/*
+ * The time as a worker sees it, read once per request instead of every
+ * time it's needed. Seconds follow the monotonic clock, starting out at
+ * the wall clock, so that quarantine expiry doesn't jump along with the
+ * system time. The comment date is only rendered when the minute changes.
+ */
+struct timecache {
+	struct event_base *evbase;
+	time_t now;			// seconds, wall clock at startup
+	uint32_t tick;			// ratelimit_now()
+	time_t offset;			// from monotonic to wall clock
+	time_t minute;			// of date
+	char date[FORMAT_DATE_MAX];
+	size_t date_len;
+};
+
+void timecache_init(struct timecache *, struct event_base *);
+void timecache_update(struct timecache *);
@@ -20,10 +20,17 @@
 
 #include <errno.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <stdarg.h>
 
+#if defined(__linux__)
+#include <linux/openat2.h>
+#include <sys/syscall.h>
+#endif
+
 #include "util.h"
 
 bool
@@ -165,3 +172,52 @@ strrep(const char *s, ...)
 
 	return str;
 }
+
+/*
+ * True if path is relative and has no ".." components.
+ */
+bool
+path_is_beneath(const char *path)
+{
+	const char *p;
+
+	if (*path == '/')
+		return false;
+
+	for (p = path; (p = strstr(p, "..")); p += 2) {
+		if ((p == path || p[-1] == '/') && (p[2] == '\0' || p[2] == '/'))
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Opens path relative to dirfd, failing with EXDEV if that would resolve
+ * to something outside of it. openat2() lets the kernel enforce this,
+ * symlinks included. Where it's missing, absolute paths and ".." are
+ * refused before an ordinary openat().
+ */
+int
+open_beneath(int dirfd, const char *path, int flags)
+{
+#if defined(__linux__) && defined(SYS_openat2)
+	struct open_how how;
+	int fd;
+
+	memset(&how, 0, sizeof(how));
+	how.flags = flags;
+	how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+
+	if ((fd = syscall(SYS_openat2, dirfd, path, &how, sizeof(how))) != -1 ||
+	    errno != ENOSYS)
+		return fd;
+#endif
+
+	if (!path_is_beneath(path)) {
+		errno = EXDEV;
+		return -1;
+	}
+
+	return openat(dirfd, path, flags);
+}
@@ -34,3 +34,5 @@ bool  path_combine(char *, size_t, const char *, const char *);
 char *trim_whitespace(char *s);
 bool  sockaddrs_to_str(char *, socklen_t, const union sockaddrs *, int);
 char *strrep(const char *, ...);
+bool  path_is_beneath(const char *);
+int   open_beneath(int, const char *, int);
@@ -0,0 +1,907 @@
+/**
+ * gmlgcd - the gemlog comment daemon
+ * Copyright (C) 2024 github.com/Sir-Photch
+ *
+ * This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "writer.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#ifdef HAVE_LIBURING
+#include <sys/eventfd.h>
+#endif
+
+#include "fdcache.h"
+#include "journal.h"
+#include "log.h"
+#include "probes.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+static uint32_t
+writer_hash(const char *path)
+{
+	uint32_t h = 2166136261u;
+
+	while (*path) {
+		h ^= (unsigned char)*path++;
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+static void
+writer_job_free(struct writer_job *job)
+{
+	free(job->path);
+	free(job->data);
+	free(job);
+}
+
+static void
+writer_queue_push(struct writer_queue *q, struct writer_job *job)
+{
+	struct writer_job *head;
+
+	head = atomic_load(&q->head);
+	do {
+		job->next = head;
+	} while (!atomic_compare_exchange_weak(&q->head, &head, job));
+
+	// whoever takes the queue empties it, so one wakeup suffices
+	if (!head)
+		event_active(q->event, EV_READ, 0);
+}
+
+/*
+ * Takes all queued jobs, oldest first.
+ */
+static struct writer_job *
+writer_queue_take(struct writer_queue *q)
+{
+	struct writer_job *job, *next, *prev = NULL;
+
+	for (job = atomic_exchange(&q->head, NULL); job; job = next) {
+		next = job->next;
+		job->next = prev;
+		prev = job;
+	}
+
+	return prev;
+}
+
+/*
+ * Writes all of iov, picking up after short writes.
+ */
+static bool
+writer_writev(int fd, struct iovec *iov, int n)
+{
+	ssize_t written;
+
+	while (n > 0) {
+		if ((written = writev(fd, iov, n)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+
+		for (; n > 0 && (size_t)written >= iov->iov_len; ++iov, --n)
+			written -= iov->iov_len;
+
+		if (n > 0) {
+			iov->iov_base = (char *)iov->iov_base + written;
+			iov->iov_len -= written;
+		}
+	}
+
+	return true;
+}
+
+static bool
+writer_write_file(struct writer *wr, struct writer_file *f)
+{
+	struct iovec iov[IOV_MAX];
+	struct writer_job *job;
+	int fd, n;
+
+	PROBE2(write_start, f->path, f->n_jobs);
+
+	if ((fd = fdcache_open(wr->fdcache, wr->dirfd, f->path,
+	    time(NULL))) == -1) {
+		warnl("open(%s)", f->path);
+		return false;
+	}
+
+	n = 0;
+	TAILQ_FOREACH(job, &f->jobs, file) {
+		iov[n].iov_base = job->data;
+		iov[n].iov_len = job->len;
+
+		if (++n == IOV_MAX || wr->durability == DURABILITY_ALWAYS) {
+			if (!writer_writev(fd, iov, n))
+				goto fail;
+			if (wr->durability == DURABILITY_ALWAYS &&
+			    fdatasync(fd) == -1)
+				goto sync_fail;
+			n = 0;
+		}
+	}
+
+	if (n > 0 && !writer_writev(fd, iov, n))
+		goto fail;
+
+	if (wr->durability == DURABILITY_BATCHED && fdatasync(fd) == -1)
+		goto sync_fail;
+
+	dbgxl("%s: %lu appends in one go", f->path, f->n_jobs);
+
+	return true;
+
+ fail:
+	warnl("writev(%s)", f->path);
+	fdcache_close(wr->fdcache, f->path);
+
+	return false;
+
+ sync_fail:
+	warnl("fdatasync(%s)", f->path);
+	fdcache_close(wr->fdcache, f->path);
+
+	return false;
+}
+
+/*
+ * Hands the file's jobs back to their clients.
+ */
+static void
+writer_file_done(struct writer_file *f, bool ok)
+{
+	struct writer_job *job;
+
+	PROBE3(write_done, f->path, f->n_jobs, ok);
+
+	while ((job = TAILQ_FIRST(&f->jobs))) {
+		TAILQ_REMOVE(&f->jobs, job, file);
+		job->ok = ok;
+		writer_queue_push(&job->client->done, job);
+	}
+
+#ifdef HAVE_LIBURING
+	free(f->iov);
+#endif
+	free(f->path);
+	free(f);
+}
+
+/*
+ * Records the appends of all dirty files in the journal, along with the
+ * offsets they'll end up at. Runs between batches, which is when
+ * checkpoints can be taken as well.
+ */
+static bool
+writer_journal(struct writer *wr)
+{
+	struct writer_file *f, *next;
+	struct writer_job *job;
+	struct fdcache_entry *e;
+	struct stat sb;
+	uint64_t offset;
+
+	if (journal_due(wr->journal))
+		journal_checkpoint(wr->journal, wr->dirfd);
+
+	for (f = TAILQ_FIRST(&wr->dirty); f; f = next) {
+		next = TAILQ_NEXT(f, dirty);
+
+		if (!(e = fdcache_get(wr->fdcache, wr->dirfd, f->path,
+		    time(NULL))) || fstat(e->fd, &sb) == -1) {
+			warnl("open(%s)", f->path);
+			TAILQ_REMOVE(&wr->dirty, f, dirty);
+			TAILQ_REMOVE(&wr->buckets[f->hash % WRITER_BUCKETS], f,
+			    bucket);
+			writer_file_done(f, false);
+			continue;
+		}
+
+		offset = sb.st_size;
+
+		TAILQ_FOREACH(job, &f->jobs, file) {
+			if (!journal_add(wr->journal, f->path, offset,
+			    job->data, job->len)) {
+				warnl("journal_add");
+				journal_discard(wr->journal);
+				return false;
+			}
+			offset += job->len;
+		}
+	}
+
+	return journal_commit(wr->journal, wr->journal_sync);
+}
+
+/*
+ * Gives up on all dirty files.
+ */
+static void
+writer_fail(struct writer *wr)
+{
+	struct writer_file *f;
+
+	while ((f = TAILQ_FIRST(&wr->dirty))) {
+		TAILQ_REMOVE(&wr->dirty, f, dirty);
+		TAILQ_REMOVE(&wr->buckets[f->hash % WRITER_BUCKETS], f, bucket);
+		writer_file_done(f, false);
+	}
+}
+
+#ifdef HAVE_LIBURING
+static void
+writer_uring_submit(struct writer *wr)
+{
+	int ret;
+
+	if (wr->unsubmitted == 0)
+		return;
+
+	while ((ret = io_uring_submit(&wr->ring)) == -EINTR)
+		;
+
+	// otherwise, what's queued stays there for the next try
+	if (ret < 0) {
+		errno = -ret;
+		warnl("io_uring_submit");
+		return;
+	}
+
+	wr->unsubmitted = 0;
+}
+
+/*
+ * Queues a write of what's left of f, or its fdatasync.
+ */
+static void
+writer_uring_write(struct writer *wr, struct writer_file *f)
+{
+	struct fdcache_entry *e;
+	struct io_uring_sqe *sqe;
+	bool fixed;
+
+	PROBE2(write_start, f->path, f->n_jobs);
+
+	/*
+	 * Opening may close the least recently used descriptor or reuse
+	 * its registered slot, which must not be one of a queued write.
+	 */
+	if (wr->unsubmitted + 1 >= wr->fdcache->max)
+		writer_uring_submit(wr);
+
+	if (!(e = fdcache_get(wr->fdcache, wr->dirfd, f->path, time(NULL)))) {
+		warnl("open(%s)", f->path);
+		writer_file_done(f, false);
+		return;
+	}
+
+	if (!(sqe = io_uring_get_sqe(&wr->ring))) {
+		writer_uring_submit(wr);
+
+		if (!(sqe = io_uring_get_sqe(&wr->ring))) {
+			warnxl("%s: submission queue full", f->path);
+			writer_file_done(f, false);
+			return;
+		}
+	}
+
+	if (wr->fixed && wr->fixed[e->slot] != e->serial &&
+	    io_uring_register_files_update(&wr->ring, e->slot, &e->fd, 1) == 1)
+		wr->fixed[e->slot] = e->serial;
+
+	fixed = wr->fixed && wr->fixed[e->slot] == e->serial;
+
+	if (f->syncing)
+		io_uring_prep_fsync(sqe, fixed ? (int)e->slot : e->fd,
+		    IORING_FSYNC_DATASYNC);
+	else	// at the file position, like writev()
+		io_uring_prep_writev(sqe, fixed ? (int)e->slot : e->fd, f->next,
+		    wr->durability == DURABILITY_ALWAYS ? 1 :
+		    f->left < IOV_MAX ? f->left : IOV_MAX, -1);
+
+	if (fixed)
+		io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE);
+
+	io_uring_sqe_set_data(sqe, f);
+	wr->inflight++;
+	wr->unsubmitted++;
+}
+
+static void
+writer_uring_complete(struct writer *wr, struct writer_file *f, int res)
+{
+	int left;
+
+	wr->inflight--;
+
+	if (res == -EINTR || res == -EAGAIN) {
+		writer_uring_write(wr, f);
+		return;
+	}
+
+	if (res < 0) {
+		errno = -res;
+		warnl("%s(%s)", f->syncing ? "fdatasync" : "writev", f->path);
+		fdcache_close(wr->fdcache, f->path);
+		writer_file_done(f, false);
+		return;
+	}
+
+	if (f->syncing) {
+		f->syncing = false;
+	} else {
+		left = f->left;
+
+		for (; f->left > 0 && (size_t)res >= f->next->iov_len;
+		    ++f->next, --f->left)
+			res -= f->next->iov_len;
+
+		if (f->left > 0) {
+			f->next->iov_base = (char *)f->next->iov_base + res;
+			f->next->iov_len -= res;
+		}
+
+		// always syncs after each comment, batched after the last
+		f->syncing = wr->durability == DURABILITY_ALWAYS ?
+		    f->left < left : wr->durability == DURABILITY_BATCHED &&
+		    f->left == 0;
+	}
+
+	if (f->syncing || f->left > 0) {
+		writer_uring_write(wr, f);
+		return;
+	}
+
+	dbgxl("%s: %lu appends in one go", f->path, f->n_jobs);
+
+	writer_file_done(f, true);
+}
+
+static void
+writer_uring_flush(struct writer *wr)
+{
+	struct writer_file *f;
+	struct writer_job *job;
+
+	// one batch at a time, so that appends to a file stay in order
+	if (wr->inflight > 0)
+		return;
+
+	if (wr->journal && !writer_journal(wr)) {
+		writer_fail(wr);
+		return;
+	}
+
+	while ((f = TAILQ_FIRST(&wr->dirty))) {
+		TAILQ_REMOVE(&wr->dirty, f, dirty);
+		TAILQ_REMOVE(&wr->buckets[f->hash % WRITER_BUCKETS], f, bucket);
+
+		if (!(f->iov = calloc(f->n_jobs, sizeof(struct iovec)))) {
+			warnl("calloc");
+			writer_file_done(f, false);
+			continue;
+		}
+
+		f->next = f->iov;
+		f->left = 0;
+		f->syncing = false;
+		TAILQ_FOREACH(job, &f->jobs, file) {
+			f->iov[f->left].iov_base = job->data;
+			f->iov[f->left++].iov_len = job->len;
+		}
+
+		writer_uring_write(wr, f);
+	}
+
+	writer_uring_submit(wr);
+}
+
+/*
+ * Handles completions, waiting for one if wait is set. Starts on the next
+ * batch once the current one is through.
+ */
+static void
+writer_uring_reap(struct writer *wr, bool wait)
+{
+	struct io_uring_cqe *cqe;
+	struct writer_file *f;
+	int ret, res;
+
+	for (;;) {
+		if ((ret = wait && wr->inflight > 0 ?
+		    io_uring_wait_cqe(&wr->ring, &cqe) :
+		    io_uring_peek_cqe(&wr->ring, &cqe)) < 0) {
+			if (ret == -EINTR)
+				continue;
+			if (ret != -EAGAIN) {
+				errno = -ret;
+				warnl("io_uring_wait_cqe");
+			}
+			break;
+		}
+
+		f = io_uring_cqe_get_data(cqe);
+		res = cqe->res;
+		io_uring_cqe_seen(&wr->ring, cqe);
+
+		writer_uring_complete(wr, f, res);
+		writer_uring_submit(wr);
+
+		if (wr->inflight == 0)
+			writer_uring_flush(wr);
+	}
+}
+
+static void
+writer_ring_cb(evutil_socket_t fd, short event, void *arg)
+{
+	(void)event;
+
+	uint64_t n;
+
+	if (read(fd, &n, sizeof(n)) == -1 && errno != EAGAIN)
+		warnl("read(eventfd)");
+
+	writer_uring_reap(arg, false);
+}
+
+/*
+ * Sets up the ring, if the kernel lets us. Otherwise, plain writev() it is.
+ */
+static void
+writer_uring_init(struct writer *wr)
+{
+	size_t i, max = wr->fdcache->max;
+	int ret, *fds;
+
+	if ((ret = io_uring_queue_init(WRITER_RING_ENTRIES, &wr->ring,
+	    0)) < 0) {
+		errno = -ret;
+		warnl("io_uring unavailable, falling back to writev");
+		return;
+	}
+
+	if ((wr->ring_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1 ||
+	    io_uring_register_eventfd(&wr->ring, wr->ring_fd) < 0 ||
+	    !(wr->ring_event = event_new(wr->evbase, wr->ring_fd,
+	    EV_READ | EV_PERSIST, writer_ring_cb, wr)) ||
+	    event_add(wr->ring_event, NULL) != 0) {
+		warnxl("io_uring setup failed, falling back to writev");
+		if (wr->ring_event)
+			event_free(wr->ring_event);
+		if (wr->ring_fd != -1)
+			close(wr->ring_fd);
+		wr->ring_event = NULL;
+		io_uring_queue_exit(&wr->ring);
+		return;
+	}
+
+	// registered files spare the kernel a descriptor lookup per write
+	if ((fds = calloc(max, sizeof(int))) &&
+	    (wr->fixed = calloc(max, sizeof(uint64_t)))) {
+		for (i = 0; i < max; ++i)
+			fds[i] = -1;
+
+		if (io_uring_register_files(&wr->ring, fds, max) < 0) {
+			dbgxl("io_uring: not registering files");
+			free(wr->fixed);
+			wr->fixed = NULL;
+		}
+	}
+	free(fds);
+
+	wr->uring = true;
+}
+
+static void
+writer_uring_free(struct writer *wr)
+{
+	if (!wr->uring)
+		return;
+
+	event_free(wr->ring_event);
+	io_uring_queue_exit(&wr->ring);
+	close(wr->ring_fd);
+	free(wr->fixed);
+}
+#endif
+
+/*
+ * Writes every dirty file and hands the jobs back to their clients.
+ */
+static void
+writer_flush(struct writer *wr)
+{
+	struct writer_file *f;
+	bool ok;
+
+#ifdef HAVE_LIBURING
+	if (wr->uring) {
+		writer_uring_flush(wr);
+		return;
+	}
+#endif
+
+	if (wr->journal && !writer_journal(wr)) {
+		writer_fail(wr);
+		return;
+	}
+
+	while ((f = TAILQ_FIRST(&wr->dirty))) {
+		TAILQ_REMOVE(&wr->dirty, f, dirty);
+		TAILQ_REMOVE(&wr->buckets[f->hash % WRITER_BUCKETS], f, bucket);
+
+		ok = writer_write_file(wr, f);
+		writer_file_done(f, ok);
+	}
+}
+
+static void
+writer_flush_cb(evutil_socket_t fd, short event, void *arg)
+{
+	(void)fd;
+	(void)event;
+
+	writer_flush(arg);
+}
+
+/*
+ * Sorts newly queued jobs by file.
+ */
+static void
+writer_wake_cb(evutil_socket_t fd, short event, void *arg)
+{
+	(void)fd;
+	(void)event;
+
+	struct timeval window;
+	struct writer *wr = arg;
+	struct writer_file *f;
+	struct writer_job *job, *next;
+	uint32_t hash;
+
+	for (job = writer_queue_take(&wr->queue); job; job = next) {
+		next = job->next;
+		hash = writer_hash(job->path);
+
+		TAILQ_FOREACH(f, &wr->buckets[hash % WRITER_BUCKETS], bucket) {
+			if (f->hash == hash && strcmp(f->path, job->path) == 0)
+				break;
+		}
+
+		if (!f) {
+			if (!(f = calloc(1, sizeof(*f))) ||
+			    !(f->path = strdup(job->path))) {
+				warnl("calloc");
+				free(f);
+				job->ok = false;
+				writer_queue_push(&job->client->done, job);
+				continue;
+			}
+
+			f->hash = hash;
+			TAILQ_INIT(&f->jobs);
+			TAILQ_INSERT_TAIL(&wr->buckets[hash % WRITER_BUCKETS],
+			    f, bucket);
+			TAILQ_INSERT_TAIL(&wr->dirty, f, dirty);
+		}
+
+		TAILQ_INSERT_TAIL(&f->jobs, job, file);
+		f->n_jobs++;
+	}
+
+	window.tv_sec = 0;
+	window.tv_usec = wr->window;
+
+	// a zero timeout fires right after the current loop iteration
+	if (!TAILQ_EMPTY(&wr->dirty) &&
+	    !evtimer_pending(wr->flush_event, NULL) &&
+	    evtimer_add(wr->flush_event, &window) != 0) {
+		warnxl("evtimer_add");
+		writer_flush(wr);
+	}
+}
+
+static void
+writer_checkpoint_cb(evutil_socket_t fd, short event, void *arg)
+{
+	(void)fd;
+	(void)event;
+
+	struct writer *wr = arg;
+
+#ifdef HAVE_LIBURING
+	// not while a batch is only partly written
+	if (wr->inflight > 0)
+		return;
+#endif
+
+	journal_checkpoint(wr->journal, wr->dirfd);
+}
+
+static void
+writer_stop_cb(evutil_socket_t fd, short event, void *arg)
+{
+	(void)fd;
+	(void)event;
+
+	struct writer *wr = arg;
+
+	writer_wake_cb(-1, EV_READ, wr);
+	writer_flush(wr);
+#ifdef HAVE_LIBURING
+	if (wr->uring)
+		writer_uring_reap(wr, true);
+#endif
+
+	if (wr->journal) {
+		journal_checkpoint(wr->journal, wr->dirfd);
+		event_del(wr->checkpoint_event);
+	}
+
+	event_del(wr->flush_event);
+	event_base_loopexit(wr->evbase, NULL);
+}
+
+static void *
+writer_loop(void *arg)
+{
+	struct writer *wr = arg;
+
+	dbgxl("writer running");
+
+	event_base_loop(wr->evbase, EVLOOP_NO_EXIT_ON_EMPTY);
+
+	return NULL;
+}
+
+struct writer *
+writer_new(int dirfd, size_t fd_cache_size, long window,
+    enum durability durability, struct journal *journal)
+{
+	struct timeval interval = { JOURNAL_CHECKPOINT_INTERVAL, 0 };
+	struct writer *wr;
+	size_t i;
+
+	if (!(wr = calloc(1, sizeof(struct writer))))
+		return NULL;
+
+	for (i = 0; i < WRITER_BUCKETS; ++i)
+		TAILQ_INIT(&wr->buckets[i]);
+	TAILQ_INIT(&wr->dirty);
+	atomic_init(&wr->queue.head, NULL);
+
+	if (!(wr->fdcache = fdcache_new(fd_cache_size)) ||
+	    !(wr->evbase = event_base_new()) ||
+	    !(wr->queue.event = event_new(wr->evbase, -1, 0, writer_wake_cb,
+	    wr)) ||
+	    !(wr->flush_event = evtimer_new(wr->evbase, writer_flush_cb,
+	    wr)) ||
+	    !(wr->stop_event = event_new(wr->evbase, -1, 0, writer_stop_cb,
+	    wr))) {
+		writer_free(&wr);
+		return NULL;
+	}
+
+	wr->dirfd = dirfd;
+	wr->window = window;
+
+	// with a journal, comment files only get synced at checkpoints
+	if ((wr->journal = journal)) {
+		wr->durability = DURABILITY_NONE;
+		wr->journal_sync = durability != DURABILITY_NONE;
+
+		if (!(wr->checkpoint_event = event_new(wr->evbase, -1,
+		    EV_PERSIST, writer_checkpoint_cb, wr)) ||
+		    event_add(wr->checkpoint_event, &interval) != 0) {
+			writer_free(&wr);
+			return NULL;
+		}
+	} else {
+		wr->durability = durability;
+	}
+
+#ifdef HAVE_LIBURING
+	writer_uring_init(wr);
+#endif
+
+	return wr;
+}
+
+/*
+ * Stop the writer first; its clients must be gone by now. The journal is
+ * left to the caller.
+ */
+void
+writer_free(struct writer **wr)
+{
+#ifdef HAVE_LIBURING
+	writer_uring_free(*wr);
+#endif
+	if ((*wr)->queue.event)
+		event_free((*wr)->queue.event);
+	if ((*wr)->flush_event)
+		event_free((*wr)->flush_event);
+	if ((*wr)->stop_event)
+		event_free((*wr)->stop_event);
+	if ((*wr)->checkpoint_event)
+		event_free((*wr)->checkpoint_event);
+	if ((*wr)->evbase)
+		event_base_free((*wr)->evbase);
+	if ((*wr)->fdcache)
+		fdcache_free(&(*wr)->fdcache);
+	free(*wr);
+	*wr = NULL;
+}
+
+bool
+writer_start(struct writer *wr)
+{
+	if ((errno = pthread_create(&wr->thread, NULL, writer_loop, wr)) != 0)
+		return false;
+
+	wr->running = true;
+
+	return true;
+}
+
+/*
+ * Writes out what's still queued and waits for the thread to finish.
+ */
+void
+writer_stop(struct writer *wr)
+{
+	if (!wr->running)
+		return;
+
+	event_active(wr->stop_event, EV_READ, 0);
+	pthread_join(wr->thread, NULL);
+
+	wr->running = false;
+}
+
+/*
+ * Hands jobs the writer is done with to their callbacks.
+ */
+static void
+writer_done_cb(evutil_socket_t fd, short event, void *arg)
+{
+	(void)fd;
+	(void)event;
+
+	struct writer_client *cl = arg;
+	struct writer_job *job, *next;
+
+	for (job = writer_queue_take(&cl->done); job; job = next) {
+		next = job->next;
+		TAILQ_REMOVE(&cl->pending, job, pending);
+
+		metrics_add(cl->metrics, bytes_buffered, -(uint64_t)job->len);
+		if (job->ok)
+			metrics_add(cl->metrics, bytes_written, job->len);
+
+		if (job->cb)
+			job->cb(job->ok, job->owner, job->arg);
+
+		writer_job_free(job);
+	}
+}
+
+struct writer_client *
+writer_client_new(struct writer *wr, struct event_base *base,
+    struct metrics *metrics)
+{
+	struct writer_client *cl;
+
+	if (!(cl = calloc(1, sizeof(struct writer_client))))
+		return NULL;
+
+	if (!(cl->done.event = event_new(base, -1, 0, writer_done_cb, cl))) {
+		free(cl);
+		return NULL;
+	}
+
+	cl->writer = wr;
+	cl->metrics = metrics;
+	atomic_init(&cl->done.head, NULL);
+	TAILQ_INIT(&cl->pending);
+
+	return cl;
+}
+
+/*
+ * Stop the writer first, so that all jobs have come back.
+ */
+void
+writer_client_free(struct writer_client **cl)
+{
+	struct writer_job *job;
+
+	writer_queue_take(&(*cl)->done);
+
+	while ((job = TAILQ_FIRST(&(*cl)->pending))) {
+		TAILQ_REMOVE(&(*cl)->pending, job, pending);
+		writer_job_free(job);
+	}
+
+	event_free((*cl)->done.event);
+	free(*cl);
+	*cl = NULL;
+}
+
+/*
+ * Queues data to be appended to path, relative to the writer's directory.
+ * cb is called with owner and arg on the client's event loop once that
+ * happened.
+ */
+bool
+writer_append(struct writer_client *cl, const char *path, const char *data,
+    size_t len, writer_cb cb, void *owner, void *arg)
+{
+	struct writer_job *job;
+
+	if (!(job = calloc(1, sizeof(*job))))
+		return false;
+
+	if (!(job->path = strdup(path)) || !(job->data = malloc(len))) {
+		writer_job_free(job);
+		return false;
+	}
+
+	memcpy(job->data, data, len);
+	job->len = len;
+	job->client = cl;
+	job->cb = cb;
+	job->owner = owner;
+	job->arg = arg;
+
+	TAILQ_INSERT_TAIL(&cl->pending, job, pending);
+	writer_queue_push(&cl->writer->queue, job);
+
+	metrics_add(cl->metrics, bytes_buffered, len);
+
+	return true;
+}
+
+/*
+ * Drops the callbacks of owner's queued appends, or only those with arg
+ * if it isn't NULL. The data is written nonetheless.
+ */
+void
+writer_cancel(struct writer_client *cl, void *owner, void *arg)
+{
+	struct writer_job *job;
+
+	TAILQ_FOREACH(job, &cl->pending, pending) {
+		if (job->owner == owner && (!arg || job->arg == arg))
+			job->cb = NULL;
+	}
+}
@@ -0,0 +1,146 @@
+/**
+ * gmlgcd - the gemlog comment daemon
+ * Copyright (C) 2024 github.com/Sir-Photch
+ *
+ * This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "platform.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <event2/event.h>
+
+#include "config.h"
+#include "metrics.h"
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+
+#define WRITER_RING_ENTRIES 64
+#endif
+
+#define WRITER_BUCKETS 64
+
+/*
+ * Called once the data has been written, or writing it failed.
+ */
+typedef void (*writer_cb)(bool ok, void *owner, void *arg);
+
+struct writer_job {
+	struct writer_job *next;	// in a writer_queue
+	struct writer_client *client;
+
+	// handed to the writer thread
+	char *path, *data;
+	size_t len;
+	bool ok;
+
+	// kept by the client
+	writer_cb cb;			// NULL if cancelled
+	void *owner, *arg;
+	TAILQ_ENTRY(writer_job) pending;
+	TAILQ_ENTRY(writer_job) file;
+};
+
+TAILQ_HEAD(writer_job_list, writer_job);
+
+/*
+ * Lock-free multi-producer, single-consumer queue. Its event is activated
+ * whenever a job is pushed onto an empty queue.
+ */
+struct writer_queue {
+	_Atomic(struct writer_job *) head;
+	struct event *event;
+};
+
+struct writer_file {
+	char *path;
+	uint32_t hash;
+	struct writer_job_list jobs;
+	size_t n_jobs;
+	TAILQ_ENTRY(writer_file) bucket;
+	TAILQ_ENTRY(writer_file) dirty;
+#ifdef HAVE_LIBURING
+	struct iovec *iov, *next;	// next is what's left to write
+	int left;
+	bool syncing;
+#endif
+};
+
+TAILQ_HEAD(writer_file_list, writer_file);
+
+/*
+ * Runs in a thread of its own, so that no event loop ever waits for the
+ * disk. Group commit: appends are collected per file and written out with
+ * one writev() per file, once the writer's event loop iteration is over
+ * or, with a window, that many microseconds after the first append.
+ * Depending on durability, files are fdatasync()ed once per batch or
+ * after each comment, before anyone learns their comment was written.
+ * With a journal, each batch goes there first and is synced once.
+ * With io_uring, the writes of all files go out in one submission, and
+ * the next batch follows once the previous one completed.
+ */
+struct writer {
+	struct event_base *evbase;
+	struct writer_queue queue;
+	struct event *flush_event, *stop_event, *checkpoint_event;
+	struct writer_file_list buckets[WRITER_BUCKETS];
+	struct writer_file_list dirty;
+	struct fdcache *fdcache;
+	int dirfd;
+	long window;			// microseconds
+	enum durability durability;	// of the comment files
+	struct journal *journal;	// NULL without
+	bool journal_sync;
+	pthread_t thread;
+	bool running;
+#ifdef HAVE_LIBURING
+	struct io_uring ring;
+	struct event *ring_event;	// on ring_fd
+	int ring_fd;			// eventfd signalling completions
+	uint64_t *fixed;		// fdcache serial by registered file
+	size_t inflight, unsubmitted;
+	bool uring;
+#endif
+};
+
+/*
+ * A worker's end: completed jobs come back through done, on the worker's
+ * event loop.
+ */
+struct writer_client {
+	struct writer *writer;
+	struct writer_queue done;
+	struct writer_job_list pending;
+	struct metrics *metrics;	// the worker's
+};
+
+struct writer *writer_new(int, size_t, long, enum durability,
+    struct journal *);
+void           writer_free(struct writer **);
+bool           writer_start(struct writer *);
+void           writer_stop(struct writer *);
+
+struct writer_client *writer_client_new(struct writer *, struct event_base *,
+    struct metrics *);
+void                  writer_client_free(struct writer_client **);
+bool                  writer_append(struct writer_client *, const char *,
+    const char *, size_t, writer_cb, void *, void *);
+void                  writer_cancel(struct writer_client *, void *, void *);